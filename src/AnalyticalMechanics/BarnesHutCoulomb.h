@@ -0,0 +1,582 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file BarnesHutCoulomb.h Coulomb interaction between charged elements, by a Barnes-Hut octree
+
+#ifndef BARNESHUTCOULOMB_H
+#define BARNESHUTCOULOMB_H
+
+#include <PotentialEnergySurface.h>
+#include <ThreadPool.h>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+
+namespace atomism {
+    
+    /** \class BarnesHutCoulomb
+     *
+     * \brief Coulomb energy of charged elements, without cutoff, in O(N log N)
+     *
+     * \f$ U = k \sum_{i<j} q_i q_j / r_{ij} \f$, \f$ k = 1/(4\pi\epsilon_0) \f$. \n
+     * The elements are sorted in an octree (cells of at most getLeafSize() elements). Each
+     * cell carries the multipole expansion of its charges about its center, up to the order
+     * getOrder(): 0 monopole, 1 dipole, 2 quadrupole. The potential at an element is
+     * computed by a traversal of the tree: a cell of size s at the distance d is used as a
+     * whole if s < theta d, and opened otherwise; the pairs of the leaves reached are summed
+     * directly. theta controls the accuracy (0 is the direct sum; 0.3-0.7 are usual values),
+     * and U = 1/2 sum_i q_i phi_i. For 1000 like charges, the relative error of the energy
+     * at the order 2 is about 2e-5 for theta = 0.5 and 1e-6 for theta = 0.3; for a neutral
+     * cluster, whose energy results from cancellations, it is about 1e-2 and 1e-3
+     * (see tests/BarnesHutCoulomb.cpp). \n
+     * With setNoOfThreads(n), the subtrees of the eight octants of the root are built in
+     * parallel and the elements are traversed in tiles, the energies of the tiles being
+     * summed in a fixed order. \n
+     * This term has no cutoff; it can be combined with a short range PES (e.g. PairForceField)
+     * by SplitPotentialEnergySurface.
+     */
+    template<
+    typename TheEntity,
+    typename Scalar      = double,
+    typename Vector      = std::vector<Scalar>,
+    typename Matrix      = std::vector< std::vector<Scalar> >,
+    typename Positions   = std::tuple<Vector&,Vector&,Vector&>
+    >
+    class BarnesHutCoulomb : public PotentialEnergySurface<
+    TheEntity, BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>,
+    Scalar, Vector, Matrix, Positions > {
+        
+        typedef PotentialEnergySurface<
+        TheEntity, BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>,
+        Scalar, Vector, Matrix, Positions >  Base;
+        
+    public:
+        
+        typedef typename Base::ConstPositions ConstPositions;
+        
+        /** \brief constructor
+         *
+         * \param entity entity
+         * \param resource resource manager
+         * \param charges charge of each element [C]
+         * \param theta opening angle, in [0,1)
+         * \param order order of the multipole expansions (0, 1 or 2)
+         */
+        BarnesHutCoulomb( std::shared_ptr<const TheEntity> entity ,
+                          std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                          const std::vector<Scalar>& charges,
+                          Scalar theta = 0.5,
+                          size_t order = 2
+                         );
+        
+        using Base::evaluate;
+        
+        //! Coulomb energy at the positions coors of the coordinates q
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const ConstPositions& coors) const;
+        
+        //! Coulomb energy by direct summation over all the pairs (O(N^2)), for reference
+        Scalar evaluateDirect(const ConstPositions& coors) const;
+        
+        void   setTheta(Scalar theta);
+        Scalar getTheta() const { return _Theta; }
+        
+        void   setOrder(size_t order);
+        size_t getOrder() const { return _Order; }
+        
+        //! maximum number of elements of a leaf
+        void   setLeafSize(size_t n) { ATOMISM_EXCEPT_IF( [&](){ return n == 0; } ); _LeafSize = n; }
+        size_t getLeafSize() const { return _LeafSize; }
+        
+        //! Coulomb constant, 1/(4 pi epsilon_0) in SI units by default
+        void   setCoulombConstant(Scalar k) { _K = k; }
+        
+        const std::vector<Scalar>& getCharges() const { return _Charges; }
+        
+        /** \brief build and traverse the tree with n threads
+         *
+         * The Logger must not be active during the evaluations (see ThreadPool).
+         * \param n number of threads, including the calling one; 1 for a serial evaluation
+         */
+        void setNoOfThreads(size_t n);
+        
+        //! number of cells of the tree of the last evaluation
+        size_t noOfCells() const { return _Cells.size(); }
+        
+    private:
+        
+        BarnesHutCoulomb();
+        
+        //! cell of the octree; its elements are [Begin,End) in the tree order
+        struct Cell {
+            
+            Scalar Center[3];
+            Scalar HalfSize;
+            size_t Begin, End;
+            size_t FirstChild;       //!< children are contiguous
+            size_t nChildren;        //!< 0 for a leaf
+            
+            Scalar Charge;           //!< monopole
+            Scalar Dipole[3];
+            Scalar Quadrupole[6];    //!< traceless: xx, yy, zz, xy, xz, yz
+        };
+        
+        //! sort the elements and build the tree
+        void buildTree(const ConstPositions& coors) const;
+        
+        //! fill the cell 'slot' of 'cells' (elements [begin,end)) and its subtree
+        void buildCell(std::vector<Cell>& cells, size_t slot, size_t begin, size_t end,
+                       const Scalar center[3], Scalar halfSize, size_t depth) const;
+        
+        //! sort the elements [begin,end) by octant of center; return the 9 bounds of the octants
+        void partition(size_t begin, size_t end, const Scalar center[3], size_t bounds[9]) const;
+        
+        //! multipole moments of a cell, from its elements
+        void computeMoments(Cell& cell) const;
+        
+        //! potential (without k) at the element of tree index i
+        Scalar potential(size_t i) const;
+        
+        static const size_t _MaxDepth = 40;
+        
+        std::vector<Scalar> _Charges;
+        Scalar _Theta;
+        size_t _Order;
+        size_t _LeafSize;
+        Scalar _K;
+        
+        std::shared_ptr<ThreadPool> _Pool;      //!< 0 if the evaluation is serial
+        
+        mutable std::mutex          _Mutex;     //!< the tree is shared by the evaluations
+        mutable std::vector<Cell>   _Cells;
+        mutable std::vector<size_t> _Order0;    //!< element of each tree index
+        mutable std::vector<size_t> _Buffer;
+        mutable std::vector<Scalar> _X, _Y, _Z, _Q;   //!< positions and charges in the tree order
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::BarnesHutCoulomb( std::shared_ptr<const TheEntity> entity ,
+                        std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                        const std::vector<Scalar>& charges,
+                        Scalar theta, size_t order)
+    : Base(entity,resource), _Charges(charges), _Theta(0), _Order(0), _LeafSize(8), _K(8.9875517923e9) {
+        
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return entity->noOfElements();},
+                                [&](){return charges.size();} );
+        setTheta(theta);
+        setOrder(order);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setTheta(Scalar theta) {
+        
+        // theta < 1 ensures that an accepted cell does not contain the target
+        ATOMISM_EXCEPT_IF( [&](){ return !( theta >= 0 ) || !( theta < 1 ); } );
+        _Theta = theta;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setOrder(size_t order) {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return order > 2; } );
+        _Order = order;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setNoOfThreads(size_t n) {
+        
+        ATOMISM_LOG();
+        
+        std::lock_guard<std::mutex> lock(_Mutex);
+        
+        if( n <= 1 ) _Pool.reset();
+        else if( !_Pool || _Pool->noOfWorkers() != n ) _Pool = std::make_shared<ThreadPool>(n);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        
+        size_t n = n_elements( std::get<0>(coors) );
+        ATOMISM_VALUE_MISMATCH( [&](){return _Charges.size();}, [&](){return n;} );
+        
+        if( n < 2 ) return 0;
+        
+        std::lock_guard<std::mutex> lock(_Mutex);
+        
+        buildTree(coors);
+        
+        // tiles of contiguous elements in the tree order, summed in a fixed order
+        size_t nTiles = _Pool ? std::min( n, 4*_Pool->noOfWorkers() ) : 1;
+        std::vector<Scalar> energies(nTiles,0);
+        
+        auto tile = [&](size_t t, size_t) {
+            
+            Scalar sum = 0;
+            for( size_t i = t*n/nTiles; i < (t+1)*n/nTiles; i++) sum += _Q[i] * potential(i);
+            energies[t] = sum;
+        };
+        
+        if( _Pool ) _Pool->parallelFor( nTiles, tile );
+        else        tile(0,0);
+        
+        Scalar sum = 0;
+        for( size_t t=0; t<nTiles; t++) sum += energies[t];
+        
+        return _K * sum / 2;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateDirect(const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+        size_t n = n_elements(x);
+        
+        Scalar sum = 0;
+        for( size_t i=0; i<n; i++)
+            for( size_t j=i+1; j<n; j++) {
+                
+                Scalar dx = x[j]-x[i], dy = y[j]-y[i], dz = z[j]-z[i];
+                sum += _Charges[i] * _Charges[j] / std::sqrt( dx*dx + dy*dy + dz*dz );
+            }
+        return _K * sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::buildTree(const ConstPositions& coors) const {
+        
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+        size_t n = n_elements(x);
+        
+        // bounding cube
+        Scalar min[3] = { x[0], y[0], z[0] }, max[3] = { x[0], y[0], z[0] };
+        for( size_t i=1; i<n; i++) {
+            
+            min[0] = std::min( min[0], x[i] ); max[0] = std::max( max[0], x[i] );
+            min[1] = std::min( min[1], y[i] ); max[1] = std::max( max[1], y[i] );
+            min[2] = std::min( min[2], z[i] ); max[2] = std::max( max[2], z[i] );
+        }
+        Scalar center[3] = { ( min[0]+max[0] )/2, ( min[1]+max[1] )/2, ( min[2]+max[2] )/2 };
+        Scalar halfSize  = std::max( { max[0]-min[0], max[1]-min[1], max[2]-min[2] } ) / 2;
+        halfSize = halfSize > 0 ? halfSize * ( 1 + 1e-12 ) : 1;
+        
+        _X.assign( x.begin(), x.begin()+n );
+        _Y.assign( y.begin(), y.begin()+n );
+        _Z.assign( z.begin(), z.begin()+n );
+        _Q = _Charges;
+        _Order0.resize(n);
+        _Buffer.resize(n);
+        for( size_t i=0; i<n; i++) _Order0[i] = i;
+        
+        _Cells.assign( 1, Cell() );
+        
+        if( !_Pool || n <= _LeafSize ) {
+            
+            buildCell( _Cells, 0, 0, n, center, halfSize, 0 );
+        }
+        else {
+            
+            // root and octants here, the subtrees of the octants in parallel
+            Cell& root = _Cells[0];
+            std::copy( center, center+3, root.Center );
+            root.HalfSize = halfSize;
+            root.Begin = 0; root.End = n;
+            
+            size_t bounds[9];
+            partition( 0, n, center, bounds );
+            
+            std::vector<size_t> octants;
+            for( size_t o=0; o<8; o++) if( bounds[o+1] > bounds[o] ) octants.push_back(o);
+            
+            root.FirstChild = 1;
+            root.nChildren  = octants.size();
+            
+            std::vector< std::vector<Cell> > subtrees( octants.size(), std::vector<Cell>(1) );
+            
+            _Pool->parallelFor( octants.size(), [&](size_t c, size_t) {
+                
+                size_t o = octants[c];
+                Scalar h = halfSize/2;
+                Scalar sub[3] = { center[0] + ( o&1 ? h : -h ), center[1] + ( o&2 ? h : -h ), center[2] + ( o&4 ? h : -h ) };
+                buildCell( subtrees[c], 0, bounds[o], bounds[o+1], sub, h, 1 );
+            });
+            
+            // the root of a subtree goes to its child slot, the rest is appended
+            _Cells.resize( 1 + octants.size() );
+            
+            for( size_t c=0; c<subtrees.size(); c++) {
+                
+                size_t base = _Cells.size();
+                std::vector<Cell>& cells = subtrees[c];
+                
+                for( Cell& cell : cells ) if( cell.nChildren ) cell.FirstChild += base-1;
+                
+                _Cells[1+c] = cells[0];
+                _Cells.insert( _Cells.end(), cells.begin()+1, cells.end() );
+            }
+            computeMoments( _Cells[0] );
+        }
+        
+        // positions and charges in the tree order (the build reads them in the original order)
+        for( size_t k=0; k<n; k++) {
+            
+            size_t i = _Order0[k];
+            _X[k] = x[i]; _Y[k] = y[i]; _Z[k] = z[i]; _Q[k] = _Charges[i];
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::partition(size_t begin, size_t end, const Scalar center[3], size_t bounds[9]) const {
+        
+        size_t count[8] = {0,0,0,0,0,0,0,0};
+        
+        auto octant = [&](size_t i) {
+            return size_t( _X[i] > center[0] ) | ( size_t( _Y[i] > center[1] ) << 1 ) | ( size_t( _Z[i] > center[2] ) << 2 );
+        };
+        
+        for( size_t k=begin; k<end; k++) count[ octant(_Order0[k]) ]++;
+        
+        bounds[0] = begin;
+        for( size_t o=0; o<8; o++) bounds[o+1] = bounds[o] + count[o];
+        
+        size_t fill[8];
+        std::copy( bounds, bounds+8, fill );
+        for( size_t k=begin; k<end; k++) _Buffer[ fill[ octant(_Order0[k]) ]++ ] = _Order0[k];
+        
+        std::copy( _Buffer.begin()+begin, _Buffer.begin()+end, _Order0.begin()+begin );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::buildCell(std::vector<Cell>& cells, size_t slot, size_t begin, size_t end,
+                const Scalar center[3], Scalar halfSize, size_t depth) const {
+        
+        {   Cell& cell = cells[slot];
+            std::copy( center, center+3, cell.Center );
+            cell.HalfSize   = halfSize;
+            cell.Begin      = begin;
+            cell.End        = end;
+            cell.FirstChild = 0;
+            cell.nChildren  = 0;
+        }
+        
+        if( end-begin > _LeafSize && depth < _MaxDepth ) {
+            
+            size_t bounds[9];
+            partition( begin, end, center, bounds );
+            
+            size_t first = cells.size(), nChildren = 0;
+            for( size_t o=0; o<8; o++) if( bounds[o+1] > bounds[o] ) nChildren++;
+            
+            cells[slot].FirstChild = first;
+            cells[slot].nChildren  = nChildren;
+            cells.resize( first + nChildren );
+            
+            Scalar h = halfSize/2;
+            for( size_t o=0, c=0; o<8; o++) {
+                
+                if( bounds[o+1] == bounds[o] ) continue;
+                
+                Scalar sub[3] = { center[0] + ( o&1 ? h : -h ), center[1] + ( o&2 ? h : -h ), center[2] + ( o&4 ? h : -h ) };
+                buildCell( cells, first + c++, bounds[o], bounds[o+1], sub, h, depth+1 );
+            }
+        }
+        computeMoments( cells[slot] );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeMoments(Cell& cell) const {
+        
+        Scalar Q = 0, P[3] = {0,0,0}, M[6] = {0,0,0,0,0,0};
+        
+        for( size_t k=cell.Begin; k<cell.End; k++) {
+            
+            size_t i = _Order0[k];
+            Scalar q = _Charges[i];
+            Scalar d[3] = { _X[i]-cell.Center[0], _Y[i]-cell.Center[1], _Z[i]-cell.Center[2] };
+            Scalar d2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+            
+            Q += q;
+            for( int a=0; a<3; a++) P[a] += q*d[a];
+            
+            M[0] += q*( 3*d[0]*d[0] - d2 );
+            M[1] += q*( 3*d[1]*d[1] - d2 );
+            M[2] += q*( 3*d[2]*d[2] - d2 );
+            M[3] += q*3*d[0]*d[1];
+            M[4] += q*3*d[0]*d[2];
+            M[5] += q*3*d[1]*d[2];
+        }
+        cell.Charge = Q;
+        std::copy( P, P+3, cell.Dipole );
+        std::copy( M, M+6, cell.Quadrupole );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BarnesHutCoulomb<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::potential(size_t i) const {
+        
+        Scalar X = _X[i], Y = _Y[i], Z = _Z[i];
+        Scalar theta2 = _Theta * _Theta;
+        Scalar phi = 0;
+        
+        size_t stack[8*_MaxDepth+8];
+        size_t top = 0;
+        stack[top++] = 0;
+        
+        while( top ) {
+            
+            const Cell& cell = _Cells[ stack[--top] ];
+            
+            Scalar rx = X-cell.Center[0], ry = Y-cell.Center[1], rz = Z-cell.Center[2];
+            Scalar r2 = rx*rx + ry*ry + rz*rz;
+            Scalar s  = 2*cell.HalfSize;
+            
+            // far enough: multipole expansion (theta < 1: the cell does not contain i)
+            if( s*s < theta2*r2 ) {
+                
+                Scalar inv  = 1 / std::sqrt(r2);
+                Scalar inv2 = inv*inv;
+                Scalar p    = cell.Charge;
+                
+                if( _Order >= 1 )
+                    p += ( cell.Dipole[0]*rx + cell.Dipole[1]*ry + cell.Dipole[2]*rz ) * inv2;
+                
+                if( _Order >= 2 ) {
+                    
+                    const Scalar* m = cell.Quadrupole;
+                    Scalar quad = m[0]*rx*rx + m[1]*ry*ry + m[2]*rz*rz + 2*( m[3]*rx*ry + m[4]*rx*rz + m[5]*ry*rz );
+                    p += quad * inv2 * inv2 / 2;
+                }
+                phi += p * inv;
+                continue;
+            }
+            
+            if( cell.nChildren ) {
+                
+                for( size_t c=0; c<cell.nChildren; c++) stack[top++] = cell.FirstChild + c;
+                continue;
+            }
+            
+            // leaf: direct sum
+            for( size_t j=cell.Begin; j<cell.End; j++) {
+                
+                if( j == i ) continue;
+                Scalar dx = _X[j]-X, dy = _Y[j]-Y, dz = _Z[j]-Z;
+                phi += _Q[j] / std::sqrt( dx*dx + dy*dy + dz*dz );
+            }
+        }
+        return phi;
+    }
+}
+#endif // BARNESHUTCOULOMB_H
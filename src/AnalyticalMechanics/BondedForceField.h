@@ -0,0 +1,754 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file BondedForceField.h Bonded force field: bonds, angles and torsions
+
+#ifndef BONDEDFORCEFIELD_H
+#define BONDEDFORCEFIELD_H
+
+#include <PotentialEnergySurface.h>
+#include <PairKernel.h>
+#include <ThreadPool.h>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+
+namespace atomism {
+    
+    /** \class BondedForceField
+     *
+     * \brief Classical bonded force field
+     *
+     * Sum of terms over lists of elements:
+     *  - harmonic bonds  \f$ \frac{1}{2} k (r-r_0)^2 \f$
+     *  - Morse bonds     \f$ D (1-e^{-\alpha(r-r_0)})^2 \f$
+     *  - harmonic angles \f$ \frac{1}{2} k (\theta-\theta_0)^2 \f$, \f$ \theta \f$ angle i-j-k at j
+     *  - Fourier torsions \f$ K (1+\cos(n\phi-\delta)) \f$, \f$ \phi \f$ dihedral angle i-j-k-l
+     *
+     * Each kind of term is stored as a structure of arrays (indices and parameters), and
+     * evaluated by a branch free loop over its terms: the energy and the forces of the
+     * elements of each term are first computed in contiguous buffers, and then added to the
+     * elements. With setNoOfThreads(n), the terms of a kind are split in tiles computed in
+     * parallel; the energies of the tiles are summed, and the forces added, in a fixed order. \n
+     * In double precision, the harmonic bonds are computed 4 at a time with AVX2 (contiguous
+     * loads of the parameters and stores of the forces, the differences of the positions being
+     * loaded lane by lane), selected at run time with the instruction set of PairKernel: PairKernel::setIsa(Generic) restores the
+     * plain loop, the lanes being summed in a different order (see PairKernel). The other
+     * kinds call exp, acos, atan2 and cos, which have no vector version without a vector math
+     * library: they remain scalar loops. \n
+     * evaluateWithForces gives the energy and the generalized forces (minus the gradient)
+     * together, the cartesian forces being projected through the jacobian of the entity.
+     */
+    template<
+    typename TheEntity,
+    typename Scalar      = double,
+    typename Vector      = std::vector<Scalar>,
+    typename Matrix      = std::vector< std::vector<Scalar> >,
+    typename Positions   = std::tuple<Vector&,Vector&,Vector&>
+    >
+    class BondedForceField : public PotentialEnergySurface<
+    TheEntity, BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>,
+    Scalar, Vector, Matrix, Positions > {
+        
+        typedef PotentialEnergySurface<
+        TheEntity, BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>,
+        Scalar, Vector, Matrix, Positions >  Base;
+        
+    public:
+        
+        typedef typename Base::ConstPositions ConstPositions;
+        
+        BondedForceField( std::shared_ptr<const TheEntity> entity ,
+                          std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource
+                         );
+        
+        //! @name terms
+        //@{
+        //! harmonic bond i-j, stiffness k [J/m^2], length r0 [m]
+        void addHarmonicBond(size_t i, size_t j, Scalar stiffness, Scalar length);
+        
+        //! Morse bond i-j, depth D [J], width alpha [1/m], length r0 [m]
+        void addMorseBond(size_t i, size_t j, Scalar depth, Scalar alpha, Scalar length);
+        
+        //! harmonic angle i-j-k, stiffness k [J/rad^2], angle theta0 [rad]
+        void addAngle(size_t i, size_t j, size_t k, Scalar stiffness, Scalar angle);
+        
+        //! Fourier torsion i-j-k-l, amplitude K [J], multiplicity n, phase delta [rad]
+        void addTorsion(size_t i, size_t j, size_t k, size_t l, Scalar amplitude, unsigned multiplicity, Scalar phase);
+        
+        size_t noOfHarmonicBonds() const { return _Bonds.I.size(); }
+        size_t noOfMorseBonds()    const { return _Morse.I.size(); }
+        size_t noOfAngles()        const { return _Angles.I.size(); }
+        size_t noOfTorsions()      const { return _Torsions.I.size(); }
+        //@}
+        
+        using Base::evaluate;
+        
+        //! energy at the positions coors of the coordinates q
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const ConstPositions& coors) const;
+        
+        /** \brief energy and generalized forces in one pass
+         *
+         * \param q generalized coordinates
+         * \param coors positions of the elements at q
+         * \param forces output: generalized forces, -dU/dq (size noOfDofs, 0 for the frozen DoFs)
+         * \return potential energy
+         */
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  const ConstPositions& coors,
+                                  Vector& forces) const;
+        
+        //! same as above, the positions being computed by the entity
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  Vector& forces) const;
+        
+        //! energy and cartesian forces on the elements in one pass
+        Scalar computeCartesianForces(const ConstPositions& coors, Positions& forces) const;
+        
+        /** \brief compute the terms with n threads
+         *
+         * The Logger must not be active during the evaluations (see ThreadPool).
+         * \param n number of threads, including the calling one; 1 for a serial evaluation
+         */
+        void setNoOfThreads(size_t n);
+        
+    private:
+        
+        BondedForceField();
+        
+        struct BondTable    { std::vector<size_t> I, J;       std::vector<Scalar> Stiffness, Length; };
+        struct MorseTable   { std::vector<size_t> I, J;       std::vector<Scalar> Depth, Alpha, Length; };
+        struct AngleTable   { std::vector<size_t> I, J, K;    std::vector<Scalar> Stiffness, Angle; };
+        struct TorsionTable { std::vector<size_t> I, J, K, L; std::vector<Scalar> Amplitude, Multiplicity, Phase; };
+        
+        /** @name kernels
+         *
+         * Energy of the terms [first,last). If WithForces, the forces of the term t on its
+         * elements are written to f[c*count+t], c = 3*element+component (the last element of
+         * each term gets minus the sum of the others).
+         */
+        //@{
+        template<bool WithForces>
+        Scalar harmonicBonds(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const;
+        
+        template<bool WithForces>
+        Scalar morseBonds(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const;
+        
+        template<bool WithForces>
+        Scalar angles(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const;
+        
+        template<bool WithForces>
+        Scalar torsions(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const;
+        
+#ifdef ATOMISM_SIMD_DISPATCH
+        //! harmonic bonds 4 at a time from first, added to sum; returns the first term left
+        template<bool WithForces>
+        __attribute__((target("avx2,fma")))
+        size_t harmonicBondsAVX2(size_t first, size_t last, const double* x, const double* y, const double* z,
+                                 double* f, double& sum) const;
+        
+        //! no vector version for the other scalar types
+        template<bool WithForces, typename T>
+        size_t harmonicBondsAVX2(size_t first, size_t, const T*, const T*, const T*, T*, T&) const { return first; }
+#endif
+        //@}
+        
+        //! kernel(first,last) over tiles of [0,count), summed in order
+        template<typename Kernel>
+        Scalar reduce(size_t count, const Kernel& kernel) const;
+        
+        //! add the forces of the terms (nElements per term) to fx, fy, fz
+        void scatter(const std::vector<const std::vector<size_t>*>& indices,
+                     Scalar* fx, Scalar* fy, Scalar* fz) const;
+        
+        //! energy, and forces if fx != 0, of all the terms
+        Scalar accumulate(const ConstPositions& coors, Scalar* fx, Scalar* fy, Scalar* fz) const;
+        
+        void checkIndex(size_t i) const;
+        
+        BondTable    _Bonds;
+        MorseTable   _Morse;
+        AngleTable   _Angles;
+        TorsionTable _Torsions;
+        
+        std::shared_ptr<ThreadPool> _Pool;     //!< 0 if the evaluation is serial
+        mutable std::mutex          _Mutex;    //!< protects _Work
+        mutable std::vector<Scalar> _Work;     //!< forces of the terms
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::BondedForceField( std::shared_ptr<const TheEntity> entity ,
+                        std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource)
+    : Base(entity,resource) {
+        
+        ATOMISM_LOG();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::checkIndex(size_t i) const {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return i >= this->getEntity()->noOfElements(); } );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::addHarmonicBond(size_t i, size_t j, Scalar stiffness, Scalar length) {
+        
+        checkIndex(i); checkIndex(j);
+        _Bonds.I.push_back(i); _Bonds.J.push_back(j);
+        _Bonds.Stiffness.push_back(stiffness); _Bonds.Length.push_back(length);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::addMorseBond(size_t i, size_t j, Scalar depth, Scalar alpha, Scalar length) {
+        
+        checkIndex(i); checkIndex(j);
+        _Morse.I.push_back(i); _Morse.J.push_back(j);
+        _Morse.Depth.push_back(depth); _Morse.Alpha.push_back(alpha); _Morse.Length.push_back(length);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::addAngle(size_t i, size_t j, size_t k, Scalar stiffness, Scalar angle) {
+        
+        checkIndex(i); checkIndex(j); checkIndex(k);
+        _Angles.I.push_back(i); _Angles.J.push_back(j); _Angles.K.push_back(k);
+        _Angles.Stiffness.push_back(stiffness); _Angles.Angle.push_back(angle);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::addTorsion(size_t i, size_t j, size_t k, size_t l, Scalar amplitude, unsigned multiplicity, Scalar phase) {
+        
+        checkIndex(i); checkIndex(j); checkIndex(k); checkIndex(l);
+        _Torsions.I.push_back(i); _Torsions.J.push_back(j); _Torsions.K.push_back(k); _Torsions.L.push_back(l);
+        _Torsions.Amplitude.push_back(amplitude);
+        _Torsions.Multiplicity.push_back(multiplicity);
+        _Torsions.Phase.push_back(phase);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setNoOfThreads(size_t n) {
+        
+        ATOMISM_LOG();
+        
+        std::lock_guard<std::mutex> lock(_Mutex);
+        
+        if( n <= 1 ) _Pool.reset();
+        else if( !_Pool || _Pool->noOfWorkers() != n ) _Pool = std::make_shared<ThreadPool>(n);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        return accumulate( coors, 0, 0, 0 );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeCartesianForces(const ConstPositions& coors, Positions& forces) const {
+        
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return n_elements(std::get<0>(coors));},
+                                [&](){return n_elements(std::get<0>(forces));});
+        
+        if( n_elements(std::get<0>(coors)) == 0 ) return 0;
+        
+        return accumulate( coors, &std::get<0>(forces)[0], &std::get<1>(forces)[0], &std::get<2>(forces)[0] );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                         const ConstPositions& coors,
+                         Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        auto cartesian = this->_ResourceMngr->requestPositions( this->getEntity()->noOfElements() );
+        Scalar energy  = computeCartesianForces( coors, *cartesian );
+        
+        this->projectForces( q, coors, *cartesian, forces );
+        return energy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q, Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        auto coordinates = this->getEntity()->getCoordinates(q);
+        return evaluateWithForces(q,coordinates->getPositions(),forces);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::accumulate(const ConstPositions& coors, Scalar* fx, Scalar* fy, Scalar* fz) const {
+        
+        const Scalar* x = &std::get<0>(coors)[0];
+        const Scalar* y = &std::get<1>(coors)[0];
+        const Scalar* z = &std::get<2>(coors)[0];
+        size_t n = n_elements( std::get<0>(coors) );
+        
+        std::lock_guard<std::mutex> lock(_Mutex);
+        
+        Scalar energy = 0;
+        
+        if( !fx ) {
+            
+            energy += reduce( noOfHarmonicBonds(), [&](size_t a, size_t b){ return harmonicBonds<false>(a,b,x,y,z,0); } );
+            energy += reduce( noOfMorseBonds(),    [&](size_t a, size_t b){ return morseBonds<false>(a,b,x,y,z,0); } );
+            energy += reduce( noOfAngles(),        [&](size_t a, size_t b){ return angles<false>(a,b,x,y,z,0); } );
+            energy += reduce( noOfTorsions(),      [&](size_t a, size_t b){ return torsions<false>(a,b,x,y,z,0); } );
+            return energy;
+        }
+        
+        std::fill( fx, fx+n, Scalar(0) );
+        std::fill( fy, fy+n, Scalar(0) );
+        std::fill( fz, fz+n, Scalar(0) );
+        
+        _Work.resize( std::max( { 3*noOfHarmonicBonds(), 3*noOfMorseBonds(), 6*noOfAngles(), 9*noOfTorsions() } ) );
+        Scalar* f = _Work.data();
+        
+        energy += reduce( noOfHarmonicBonds(), [&](size_t a, size_t b){ return harmonicBonds<true>(a,b,x,y,z,f); } );
+        scatter( { &_Bonds.I, &_Bonds.J }, fx, fy, fz );
+        
+        energy += reduce( noOfMorseBonds(), [&](size_t a, size_t b){ return morseBonds<true>(a,b,x,y,z,f); } );
+        scatter( { &_Morse.I, &_Morse.J }, fx, fy, fz );
+        
+        energy += reduce( noOfAngles(), [&](size_t a, size_t b){ return angles<true>(a,b,x,y,z,f); } );
+        scatter( { &_Angles.I, &_Angles.K, &_Angles.J }, fx, fy, fz );
+        
+        energy += reduce( noOfTorsions(), [&](size_t a, size_t b){ return torsions<true>(a,b,x,y,z,f); } );
+        scatter( { &_Torsions.I, &_Torsions.J, &_Torsions.K, &_Torsions.L }, fx, fy, fz );
+        
+        return energy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<typename Kernel>
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::reduce(size_t count, const Kernel& kernel) const {
+        
+        // below ~1000 terms per thread, the serial loop is faster
+        size_t nTiles = _Pool ? std::max<size_t>( 1, std::min( _Pool->noOfWorkers(), count/1024 ) ) : 1;
+        
+        if( nTiles == 1 ) return count ? kernel(0,count) : Scalar(0);
+        
+        std::vector<Scalar> energies(nTiles);
+        
+        _Pool->parallelFor( nTiles, [&](size_t t, size_t) {
+            energies[t] = kernel( t*count/nTiles, (t+1)*count/nTiles );
+        });
+        
+        Scalar sum = 0;
+        for( size_t t=0; t<nTiles; t++) sum += energies[t];
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::scatter(const std::vector<const std::vector<size_t>*>& indices,
+              Scalar* fx, Scalar* fy, Scalar* fz) const {
+        
+        size_t count = indices[0]->size();
+        size_t last  = indices.size()-1;
+        const Scalar* f = _Work.data();
+        
+        for( size_t t=0; t<count; t++) {
+            
+            Scalar sx = 0, sy = 0, sz = 0;
+            
+            for( size_t e=0; e<last; e++) {
+                
+                size_t i  = (*indices[e])[t];
+                Scalar gx = f[(3*e)*count+t], gy = f[(3*e+1)*count+t], gz = f[(3*e+2)*count+t];
+                
+                fx[i] += gx; fy[i] += gy; fz[i] += gz;
+                sx += gx; sy += gy; sz += gz;
+            }
+            
+            // no net force
+            size_t i = (*indices[last])[t];
+            fx[i] -= sx; fy[i] -= sy; fz[i] -= sz;
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces>
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::harmonicBonds(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const {
+        
+        const size_t* I = _Bonds.I.data();
+        const size_t* J = _Bonds.J.data();
+        const Scalar* k = _Bonds.Stiffness.data();
+        const Scalar* l = _Bonds.Length.data();
+        size_t count = noOfHarmonicBonds();
+        
+        Scalar sum = 0;
+        size_t t   = first;
+        
+#ifdef ATOMISM_SIMD_DISPATCH
+        if( PairKernel::getIsa() != PairKernel::Generic ) t = harmonicBondsAVX2<WithForces>( first, last, x, y, z, f, sum );
+#endif
+        
+        for( ; t<last; t++) {
+            
+            Scalar dx = x[J[t]]-x[I[t]], dy = y[J[t]]-y[I[t]], dz = z[J[t]]-z[I[t]];
+            Scalar r  = std::sqrt( dx*dx + dy*dy + dz*dz );
+            Scalar dr = r - l[t];
+            
+            sum += k[t]*dr*dr/2;
+            
+            if( WithForces ) {
+                
+                // F_i = dU/dr (r_j-r_i)/r
+                Scalar g = k[t]*dr/r;
+                f[t] = g*dx; f[count+t] = g*dy; f[2*count+t] = g*dz;
+            }
+        }
+        return sum;
+    }
+    
+#ifdef ATOMISM_SIMD_DISPATCH
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces>
+    __attribute__((target("avx2,fma")))
+    inline
+    size_t BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::harmonicBondsAVX2(size_t first, size_t last, const double* x, const double* y, const double* z,
+                        double* f, double& sum) const {
+        
+        const size_t* I = _Bonds.I.data();
+        const size_t* J = _Bonds.J.data();
+        const double* k = _Bonds.Stiffness.data();
+        const double* l = _Bonds.Length.data();
+        size_t count = noOfHarmonicBonds();
+        
+        // the positions are loaded one by one: with two gathers per difference, the gather
+        // instructions were slower than the scalar loop
+        const __m256d half = _mm256_set1_pd(0.5);
+        
+        __m256d s = _mm256_setzero_pd();
+        size_t t  = first;
+        
+        for( ; t+4<=last; t+=4) {
+            
+            __m256d dx = _mm256_set_pd( x[J[t+3]]-x[I[t+3]], x[J[t+2]]-x[I[t+2]], x[J[t+1]]-x[I[t+1]], x[J[t]]-x[I[t]] );
+            __m256d dy = _mm256_set_pd( y[J[t+3]]-y[I[t+3]], y[J[t+2]]-y[I[t+2]], y[J[t+1]]-y[I[t+1]], y[J[t]]-y[I[t]] );
+            __m256d dz = _mm256_set_pd( z[J[t+3]]-z[I[t+3]], z[J[t+2]]-z[I[t+2]], z[J[t+1]]-z[I[t+1]], z[J[t]]-z[I[t]] );
+            
+            __m256d r  = _mm256_sqrt_pd( _mm256_fmadd_pd( dz, dz, _mm256_fmadd_pd( dy, dy, _mm256_mul_pd( dx, dx ) ) ) );
+            __m256d dr = _mm256_sub_pd( r, _mm256_loadu_pd( l+t ) );
+            __m256d kd = _mm256_mul_pd( _mm256_loadu_pd( k+t ), dr );
+            
+            s = _mm256_fmadd_pd( _mm256_mul_pd( kd, dr ), half, s );
+            
+            if( WithForces ) {
+                
+                __m256d g = _mm256_div_pd( kd, r );
+                _mm256_storeu_pd( f+t,         _mm256_mul_pd( g, dx ) );
+                _mm256_storeu_pd( f+count+t,   _mm256_mul_pd( g, dy ) );
+                _mm256_storeu_pd( f+2*count+t, _mm256_mul_pd( g, dz ) );
+            }
+        }
+        
+        alignas(32) double h[4];
+        _mm256_store_pd( h, s );
+        sum += ( h[0] + h[1] ) + ( h[2] + h[3] );
+        return t;
+    }
+    
+#endif
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces>
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::morseBonds(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const {
+        
+        const size_t* I = _Morse.I.data();
+        const size_t* J = _Morse.J.data();
+        const Scalar* D = _Morse.Depth.data();
+        const Scalar* a = _Morse.Alpha.data();
+        const Scalar* l = _Morse.Length.data();
+        size_t count = noOfMorseBonds();
+        
+        Scalar sum = 0;
+        
+        for( size_t t=first; t<last; t++) {
+            
+            Scalar dx = x[J[t]]-x[I[t]], dy = y[J[t]]-y[I[t]], dz = z[J[t]]-z[I[t]];
+            Scalar r  = std::sqrt( dx*dx + dy*dy + dz*dz );
+            Scalar e  = std::exp( -a[t]*( r - l[t] ) );
+            
+            sum += D[t]*( 1-e )*( 1-e );
+            
+            if( WithForces ) {
+                
+                // dU/dr = 2 D alpha e (1-e)
+                Scalar g = 2*D[t]*a[t]*e*( 1-e )/r;
+                f[t] = g*dx; f[count+t] = g*dy; f[2*count+t] = g*dz;
+            }
+        }
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces>
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::angles(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const {
+        
+        const size_t* I  = _Angles.I.data();
+        const size_t* J  = _Angles.J.data();
+        const size_t* K  = _Angles.K.data();
+        const Scalar* k  = _Angles.Stiffness.data();
+        const Scalar* t0 = _Angles.Angle.data();
+        size_t count = noOfAngles();
+        
+        Scalar sum = 0;
+        
+        for( size_t t=first; t<last; t++) {
+            
+            // a = r_i - r_j, b = r_k - r_j
+            Scalar ax = x[I[t]]-x[J[t]], ay = y[I[t]]-y[J[t]], az = z[I[t]]-z[J[t]];
+            Scalar bx = x[K[t]]-x[J[t]], by = y[K[t]]-y[J[t]], bz = z[K[t]]-z[J[t]];
+            
+            Scalar ia  = 1/std::sqrt( ax*ax + ay*ay + az*az );
+            Scalar ib  = 1/std::sqrt( bx*bx + by*by + bz*bz );
+            Scalar cos = std::min( Scalar(1), std::max( Scalar(-1), ( ax*bx + ay*by + az*bz )*ia*ib ) );
+            Scalar dt  = std::acos(cos) - t0[t];
+            
+            sum += k[t]*dt*dt/2;
+            
+            if( WithForces ) {
+                
+                // F_i = dU/dtheta / sin(theta) (b/(|a||b|) - cos a/|a|^2), F_k likewise
+                Scalar sin = std::max( std::sqrt( 1 - cos*cos ), Scalar(1e-12) );
+                Scalar g   = k[t]*dt/sin;
+                Scalar gab = g*ia*ib, gaa = g*cos*ia*ia, gbb = g*cos*ib*ib;
+                
+                f[t]         = gab*bx - gaa*ax; f[count+t]   = gab*by - gaa*ay; f[2*count+t] = gab*bz - gaa*az;
+                f[3*count+t] = gab*ax - gbb*bx; f[4*count+t] = gab*ay - gbb*by; f[5*count+t] = gab*az - gbb*bz;
+            }
+        }
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces>
+    inline
+    Scalar BondedForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::torsions(size_t first, size_t last, const Scalar* x, const Scalar* y, const Scalar* z, Scalar* f) const {
+        
+        const size_t* I  = _Torsions.I.data();
+        const size_t* J  = _Torsions.J.data();
+        const size_t* K  = _Torsions.K.data();
+        const size_t* L  = _Torsions.L.data();
+        const Scalar* A  = _Torsions.Amplitude.data();
+        const Scalar* N  = _Torsions.Multiplicity.data();
+        const Scalar* P  = _Torsions.Phase.data();
+        size_t count = noOfTorsions();
+        
+        Scalar sum = 0;
+        
+        for( size_t t=first; t<last; t++) {
+            
+            // b1 = r_j - r_i, b2 = r_k - r_j, b3 = r_l - r_k
+            Scalar b1x = x[J[t]]-x[I[t]], b1y = y[J[t]]-y[I[t]], b1z = z[J[t]]-z[I[t]];
+            Scalar b2x = x[K[t]]-x[J[t]], b2y = y[K[t]]-y[J[t]], b2z = z[K[t]]-z[J[t]];
+            Scalar b3x = x[L[t]]-x[K[t]], b3y = y[L[t]]-y[K[t]], b3z = z[L[t]]-z[K[t]];
+            
+            // normals m = b1 x b2, n = b2 x b3
+            Scalar mx = b1y*b2z - b1z*b2y, my = b1z*b2x - b1x*b2z, mz = b1x*b2y - b1y*b2x;
+            Scalar nx = b2y*b3z - b2z*b3y, ny = b2z*b3x - b2x*b3z, nz = b2x*b3y - b2y*b3x;
+            
+            Scalar b2 = std::sqrt( b2x*b2x + b2y*b2y + b2z*b2z );
+            Scalar phi = std::atan2( b2*( b1x*nx + b1y*ny + b1z*nz ), mx*nx + my*ny + mz*nz );
+            Scalar arg = N[t]*phi - P[t];
+            
+            sum += A[t]*( 1 + std::cos(arg) );
+            
+            if( WithForces ) {
+                
+                // dU/dphi, and the gradients of phi (Blondel and Karplus)
+                Scalar g   = -A[t]*N[t]*std::sin(arg);
+                Scalar m2  = mx*mx + my*my + mz*mz, n2 = nx*nx + ny*ny + nz*nz;
+                Scalar ib2 = 1/( b2*b2 );
+                Scalar s1  = ( b1x*b2x + b1y*b2y + b1z*b2z )*ib2;
+                Scalar s3  = ( b3x*b2x + b3y*b2y + b3z*b2z )*ib2;
+                
+                // F = -dU/dphi dphi/dr
+                Scalar ci = g*b2/m2, cl = -g*b2/n2;
+                Scalar fix = ci*mx, fiy = ci*my, fiz = ci*mz;
+                Scalar flx = cl*nx, fly = cl*ny, flz = cl*nz;
+                
+                f[t]         = fix; f[count+t]   = fiy; f[2*count+t] = fiz;
+                f[3*count+t] = s3*flx - ( 1+s1 )*fix;
+                f[4*count+t] = s3*fly - ( 1+s1 )*fiy;
+                f[5*count+t] = s3*flz - ( 1+s1 )*fiz;
+                f[6*count+t] = s1*fix - ( 1+s3 )*flx;
+                f[7*count+t] = s1*fiy - ( 1+s3 )*fly;
+                f[8*count+t] = s1*fiz - ( 1+s3 )*flz;
+            }
+        }
+        return sum;
+    }
+}
+#endif // BONDEDFORCEFIELD_H
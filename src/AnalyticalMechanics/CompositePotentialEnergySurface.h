@@ -0,0 +1,567 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file CompositePotentialEnergySurface.h Potential energy surface defined as a sum of terms evaluated on shared positions
+
+#ifndef COMPOSITEPOTENTIALENERGYSURFACE_H
+#define COMPOSITEPOTENTIALENERGYSURFACE_H
+
+#include <PotentialEnergySurface.h>
+#include <array>
+#include <chrono>
+#include <type_traits>
+
+namespace atomism {
+    
+    /** \class CompositePotentialEnergySurface
+     *
+     * \brief Potential energy surface defined as a sum of terms evaluated on shared positions
+     *
+     * \f$ U = \sum_t U_t \f$, e.g. bonded + pair + correction terms. The positions of the
+     * elements are computed once from q, and all the terms are evaluated on them; the loop
+     * over the terms is unrolled at compile time, so that the calls are inlined. \n
+     * evaluateWithForces sums the cartesian forces of the terms providing
+     * computeCartesianForces (e.g. PairForceField, BondedForceField) in one buffer,
+     * projected once on the generalized coordinates. The gradient of the other terms is
+     * computed by central finite differences over the active DoFs, as computeGradient, but
+     * once for all of them: the positions at each displaced q are computed once and shared
+     * by these terms. \n
+     * All the terms must be defined on the entity of the composite surface. \n
+     * With setTiming(true), the wall time spent in each term and the number of calls are
+     * accumulated (getTiming, getNoOfCalls); the evaluations at the displaced coordinates of
+     * the finite differences are counted apart (getFallbackTiming, getNoOfFallbackCalls).
+     * The counters are not protected against concurrent evaluations.
+     */
+    template<
+    typename TheEntity,
+    typename Scalar,
+    typename Vector,
+    typename Matrix,
+    typename Positions,
+    typename... Terms
+    >
+    class CompositePotentialEnergySurface : public PotentialEnergySurface<
+    TheEntity, CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>,
+    Scalar, Vector, Matrix, Positions > {
+        
+        typedef PotentialEnergySurface<
+        TheEntity, CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>,
+        Scalar, Vector, Matrix, Positions >  Base;
+        
+        static const size_t NoOfTerms = sizeof...(Terms);
+        
+    public:
+        
+        typedef typename Base::ConstPositions ConstPositions;
+        
+        CompositePotentialEnergySurface( std::shared_ptr<const TheEntity> entity ,
+                                         std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                                         std::shared_ptr<const Terms>... terms
+                                        );
+        
+        using Base::evaluate;
+        
+        //! \f$ \sum_t U_t \f$ at the positions coors of the coordinates q
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const ConstPositions& coors) const;
+        
+        /** \brief energy and generalized forces in one pass
+         *
+         * \param q generalized coordinates
+         * \param coors positions of the elements at q
+         * \param forces output: generalized forces, -dU/dq (size noOfDofs, 0 for the frozen DoFs)
+         * \return potential energy
+         */
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  const ConstPositions& coors,
+                                  Vector& forces) const;
+        
+        //! same as above, the positions being computed by the entity
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  Vector& forces) const;
+        
+        //! term I
+        template<size_t I>
+        typename std::tuple_element< I, std::tuple<std::shared_ptr<const Terms>...> >::type
+        getTerm() const { return std::get<I>(_Terms); }
+        
+        static constexpr size_t noOfTerms() { return NoOfTerms; }
+        
+        //! @name timing
+        //@{
+        //! enable (and reset) or disable the timing of the terms
+        void setTiming(bool timing);
+        
+        bool isTiming() const { return _Timing; }
+        
+        //! wall time spent in term i since setTiming(true) [s]
+        double getTiming(size_t i) const;
+        
+        //! number of evaluations of term i since setTiming(true)
+        size_t getNoOfCalls(size_t i) const;
+        
+        //! wall time spent in term i by the finite differences of evaluateWithForces [s]
+        double getFallbackTiming(size_t i) const;
+        
+        //! number of evaluations of term i by the finite differences of evaluateWithForces
+        size_t getNoOfFallbackCalls(size_t i) const;
+        //@}
+        
+    private:
+        
+        CompositePotentialEnergySurface();
+        
+        typedef std::chrono::steady_clock Clock;
+        
+        //! true if Term has computeCartesianForces(const ConstPositions&, Positions&)
+        template<typename Term>
+        class HasCartesianForces {
+            
+            template<typename T>
+            static auto test(int) -> decltype( std::declval<const T&>().computeCartesianForces(
+                                               std::declval<const ConstPositions&>(), std::declval<Positions&>() ),
+                                               std::true_type() );
+            template<typename T>
+            static std::false_type test(...);
+            
+        public:
+            
+            static const bool value = decltype( test<Term>(0) )::value;
+        };
+        
+        template<size_t I>
+        using Index = std::integral_constant<size_t,I>;
+        
+        //! @name compile time loops over the terms
+        //@{
+        template<size_t I>
+        Scalar evaluateTerms(const GeneralizedCoordinates<Scalar,Vector>& q,
+                             const ConstPositions& coors, Index<I>) const;
+        
+        Scalar evaluateTerms(const GeneralizedCoordinates<Scalar,Vector>&,
+                             const ConstPositions&, Index<NoOfTerms>) const { return 0; }
+        
+        template<size_t I>
+        Scalar forceTerms(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors,
+                          Positions& cartesian, Positions& buffer, Index<I>) const;
+        
+        Scalar forceTerms(const GeneralizedCoordinates<Scalar,Vector>&, const ConstPositions&,
+                          Positions&, Positions&, Index<NoOfTerms>) const { return 0; }
+        
+        //! energy of the terms without computeCartesianForces
+        template<size_t I>
+        Scalar fallbackTerms(const GeneralizedCoordinates<Scalar,Vector>& q,
+                             const ConstPositions& coors, Index<I>) const;
+        
+        Scalar fallbackTerms(const GeneralizedCoordinates<Scalar,Vector>&,
+                             const ConstPositions&, Index<NoOfTerms>) const { return 0; }
+        //@}
+        
+        //! @name energy of one term, its cartesian forces being added to 'cartesian' if provided
+        //@{
+        template<typename Term>
+        Scalar forceTerm(const Term& term, const GeneralizedCoordinates<Scalar,Vector>& q,
+                         const ConstPositions& coors, Positions& cartesian, Positions& buffer,
+                         std::true_type) const;
+        
+        template<typename Term>
+        Scalar forceTerm(const Term& term, const GeneralizedCoordinates<Scalar,Vector>& q,
+                         const ConstPositions& coors, Positions& cartesian, Positions& buffer,
+                         std::false_type) const { return term.evaluate( q, coors ); }
+        //@}
+        
+        /** \brief gradient of the terms without computeCartesianForces
+         *
+         * Central finite differences over the active DoFs, with the steps q.getdqs(): the
+         * positions at each displaced q are computed once for all these terms.
+         */
+        void fallbackGradient(const GeneralizedCoordinates<Scalar,Vector>& q, Vector& gradient) const;
+        
+        //! true if a term has no computeCartesianForces
+        static bool hasFallbackTerms() {
+            bool fallback = 0;
+            for( bool b : { !HasCartesianForces<Terms>::value..., false } ) fallback = fallback || b;
+            return fallback;
+        }
+        
+        //! adds the time since start to term i, to the finite differences counters if fallback
+        void addTiming(size_t i, Clock::time_point start, bool fallback = 0) const;
+        
+        std::tuple<std::shared_ptr<const Terms>...> _Terms;
+        
+        bool                                   _Timing;
+        mutable std::array<double,NoOfTerms>   _Seconds;
+        mutable std::array<size_t,NoOfTerms>   _Calls;
+        mutable std::array<double,NoOfTerms>   _FallbackSeconds;
+        mutable std::array<size_t,NoOfTerms>   _FallbackCalls;
+    };
+    
+    //! composite surface with the default scalar and container types
+    template<typename TheEntity, typename... Terms>
+    using CompositePES = CompositePotentialEnergySurface<
+    TheEntity, double, std::vector<double>, std::vector< std::vector<double> >,
+    std::tuple<std::vector<double>&,std::vector<double>&,std::vector<double>&>, Terms...>;
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::CompositePotentialEnergySurface( std::shared_ptr<const TheEntity> entity ,
+                                       std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                                       std::shared_ptr<const Terms>... terms)
+    : Base(entity,resource), _Terms(terms...), _Timing(0) {
+        
+        ATOMISM_LOG();
+        
+        bool null = 0;
+        for( bool b : { !terms..., false } ) null = null || b;
+        ATOMISM_EXCEPT_IF( [&](){ return null; } );
+        
+        // the positions computed by the composite surface are those of its entity
+        bool other = 0;
+        for( bool b : { static_cast<const void*>( terms->getEntity().get() ) != static_cast<const void*>( entity.get() )..., false } )
+            other = other || b;
+        ATOMISM_EXCEPT_IF( [&](){ return other; } );
+        
+        _Seconds.fill(0);
+        _Calls.fill(0);
+        _FallbackSeconds.fill(0);
+        _FallbackCalls.fill(0);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        return evaluateTerms( q, coors, Index<0>() );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                         const ConstPositions& coors,
+                         Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        size_t n  = this->getEntity()->noOfElements();
+        size_t nq = n_elements(forces);
+        
+        auto cartesian = this->_ResourceMngr->requestPositions(n);
+        auto buffer    = this->_ResourceMngr->requestPositions(n);
+        
+        init_constant( std::get<0>(*cartesian), 0. );
+        init_constant( std::get<1>(*cartesian), 0. );
+        init_constant( std::get<2>(*cartesian), 0. );
+        
+        Scalar energy = forceTerms( q, coors, *cartesian, *buffer, Index<0>() );
+        
+        this->projectForces( q, coors, *cartesian, forces );
+        
+        if( hasFallbackTerms() ) {
+            
+            auto gradient = this->_ResourceMngr->requestVector(nq);
+            fallbackGradient( q, *gradient );
+            for( size_t i=0; i<nq; i++) forces[i] -= (*gradient)[i];
+        }
+        return energy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q, Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        auto coordinates = this->getEntity()->getCoordinates(q);
+        return evaluateWithForces(q,coordinates->getPositions(),forces);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    template<size_t I>
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::evaluateTerms(const GeneralizedCoordinates<Scalar,Vector>& q,
+                    const ConstPositions& coors, Index<I>) const {
+        
+        Scalar energy;
+        
+        if( _Timing ) {
+            
+            Clock::time_point start = Clock::now();
+            energy = std::get<I>(_Terms)->evaluate(q,coors);
+            addTiming(I,start);
+        }
+        else energy = std::get<I>(_Terms)->evaluate(q,coors);
+        
+        return energy + evaluateTerms( q, coors, Index<I+1>() );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    template<size_t I>
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::forceTerms(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors,
+                 Positions& cartesian, Positions& buffer, Index<I>) const {
+        
+        typedef typename std::tuple_element< I, std::tuple<Terms...> >::type Term;
+        
+        Clock::time_point start;
+        if( _Timing ) start = Clock::now();
+        
+        Scalar energy = forceTerm( *std::get<I>(_Terms), q, coors, cartesian, buffer,
+                                   std::integral_constant<bool,HasCartesianForces<Term>::value>() );
+        
+        if( _Timing ) addTiming(I,start);
+        
+        return energy + forceTerms( q, coors, cartesian, buffer, Index<I+1>() );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    template<typename Term>
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::forceTerm(const Term& term, const GeneralizedCoordinates<Scalar,Vector>&,
+                const ConstPositions& coors, Positions& cartesian, Positions& buffer,
+                std::true_type) const {
+        
+        Scalar energy = term.computeCartesianForces( coors, buffer );
+        
+        for( size_t c=0; c<3; c++) {
+            
+            Vector&       f = c==0 ? std::get<0>(cartesian) : c==1 ? std::get<1>(cartesian) : std::get<2>(cartesian);
+            const Vector& g = c==0 ? std::get<0>(buffer)    : c==1 ? std::get<1>(buffer)    : std::get<2>(buffer);
+            
+            size_t n = n_elements(f);
+            for( size_t i=0; i<n; i++) f[i] += g[i];
+        }
+        return energy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    template<size_t I>
+    inline
+    Scalar CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::fallbackTerms(const GeneralizedCoordinates<Scalar,Vector>& q,
+                    const ConstPositions& coors, Index<I>) const {
+        
+        typedef typename std::tuple_element< I, std::tuple<Terms...> >::type Term;
+        
+        Scalar energy = 0;
+        
+        if( !HasCartesianForces<Term>::value ) {
+            
+            Clock::time_point start;
+            if( _Timing ) start = Clock::now();
+            
+            energy = std::get<I>(_Terms)->evaluate(q,coors);
+            
+            if( _Timing ) addTiming(I,start,1);
+        }
+        return energy + fallbackTerms( q, coors, Index<I+1>() );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    void CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::fallbackGradient(const GeneralizedCoordinates<Scalar,Vector>& q, Vector& gradient) const {
+        
+        ATOMISM_LOG();
+        
+        auto snapshot = q.getSnapshot();
+        const Vector& dq = q.getdqs();
+        
+        ATOMISM_VALUE_MISMATCH( [&](){return n_elements(snapshot->Values);} ,
+                                [&](){return n_elements(gradient);});
+        
+        auto values = this->_ResourceMngr->requestVector(n_elements(snapshot->Values));
+        auto coors  = this->_ResourceMngr->requestPositions(this->getEntity()->noOfElements());
+        
+        init_clone(*values,snapshot->Values);
+        init_constant(gradient,0.);
+        
+        for( size_t i : *snapshot->Active ) {
+            
+            Scalar q0 = (*values)[i];
+            
+            (*values)[i] = q0 + dq[i];
+            this->getEntity()->computeCoordinates(*values,*coors);
+            Scalar up = fallbackTerms( q, *coors, Index<0>() );
+            
+            (*values)[i] = q0 - dq[i];
+            this->getEntity()->computeCoordinates(*values,*coors);
+            Scalar um = fallbackTerms( q, *coors, Index<0>() );
+            
+            (*values)[i] = q0;
+            gradient[i] = (up-um)/(2*dq[i]);
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    void CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::addTiming(size_t i, Clock::time_point start, bool fallback) const {
+        
+        double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+        
+        if( fallback ) { _FallbackSeconds[i] += seconds; _FallbackCalls[i]++; }
+        else           { _Seconds[i] += seconds;         _Calls[i]++; }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    void CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::setTiming(bool timing) {
+        
+        ATOMISM_LOG();
+        
+        _Timing = timing;
+        if( timing ) { _Seconds.fill(0); _Calls.fill(0); _FallbackSeconds.fill(0); _FallbackCalls.fill(0); }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    double CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::getTiming(size_t i) const {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return i >= NoOfTerms; } );
+        return _Seconds[i];
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    size_t CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::getNoOfCalls(size_t i) const {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return i >= NoOfTerms; } );
+        return _Calls[i];
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    double CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::getFallbackTiming(size_t i) const {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return i >= NoOfTerms; } );
+        return _FallbackSeconds[i];
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions, typename... Terms
+    >
+    inline
+    size_t CompositePotentialEnergySurface<TheEntity,Scalar,Vector,Matrix,Positions,Terms...>
+    ::getNoOfFallbackCalls(size_t i) const {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return i >= NoOfTerms; } );
+        return _FallbackCalls[i];
+    }
+}
+#endif // COMPOSITEPOTENTIALENERGYSURFACE_H
@@ -23,6 +23,8 @@
 #define ENTITY_H
 
 #include <ResourceManager.h>
+#include <mutex>
+#include <cstdint>
 
 namespace atomism {
     
@@ -39,6 +41,14 @@ namespace atomism {
      * conserve the linear and angular momentum. Hence, derived class just have to ensure
      * the correct computation of the relative position of the elements (see Entity::updatePositions).
      *
+     * The coordinates computed from generalized coordinates (see getCoordinates) are kept in a
+     * small cache, keyed on the version stamp of the generalized coordinates: the positions of
+     * unchanged coordinates requested by the PES, the jacobian and the Lagrangian are computed
+     * once. The cached positions are shared with the callers as read-only positions (see
+     * ConstPositions), a hit copies no position; the least recently used entry is replaced.
+     * The vectors of the positions are taken from the pool of the resource manager and go
+     * back to it when the last copy of the snapshot is released.
+     *
      * The class obeys to the curiously recurring template pattern to avoid virtual method calls.
      */
     template<
@@ -53,6 +63,9 @@ namespace atomism {
     class Entity {
         
     public:
+        
+        //! read-only positions, the positions of the cache and the inputs of the computations
+        typedef typename const_positions<Positions>::type ConstPositions;
            
         //! number of elements
         size_t noOfElements()     const { return static_cast<const DerivedClass*>(this)->noOfElements(); };
@@ -87,6 +100,58 @@ namespace atomism {
 	     */
         void computeCoordinates( const Vector& dofsValues, 
 				 Positions& positions)   const;
+	
+	//! cartesian coordinates of a version of generalized coordinates, never modified once computed
+	class CoordinatesSnapshot {
+	    
+	    friend Entity;
+	    
+	    typedef ResourceManager<Scalar,Vector,Matrix>                    Pool;
+	    typedef typename Pool::template Resource<Vector>                 PooledVector;
+	    
+	    std::shared_ptr<Pool> _Pool;        //!< outlives the vectors it holds
+	    uint64_t              _Version;
+	    PooledVector          _X, _Y, _Z;
+	    
+	public:
+	    
+	    //! vectors of n elements from the pool, filled by Entity::getCoordinates
+	    CoordinatesSnapshot(std::shared_ptr<Pool> pool, uint64_t version, size_t n)
+	    : _Pool(pool), _Version(version),
+	      _X(pool->requestVector(n)), _Y(pool->requestVector(n)), _Z(pool->requestVector(n)) {}
+	    
+	    uint64_t       getVersion()   const { return _Version; }
+	    
+	    const Vector&  getX()         const { return *_X; }
+	    const Vector&  getY()         const { return *_Y; }
+	    const Vector&  getZ()         const { return *_Z; }
+	    
+	    ConstPositions getPositions() const { return ConstPositions(*_X,*_Y,*_Z); }
+	};
+	
+	    /** \brief cartesian coordinates of generalized coordinates, with caching
+	     *
+	     * If the positions of the version of 'q' (see GeneralizedCoordinates::getVersion)
+	     * are in the cache, they are returned without copy; otherwise they are computed
+	     * from a snapshot of 'q' (values and version consistent) and stored in the cache.
+	     * The snapshot returned stays valid after its eviction from the cache. Thread safe.
+	     * \param q generalized coordinates
+	     */
+	template<typename Coordinates>
+	std::shared_ptr<const CoordinatesSnapshot> getCoordinates( const Coordinates& q ) const;
+	
+	    /** \brief computes the cartesian coordinates of generalized coordinates, with caching
+	     *
+	     * Same as getCoordinates, the positions being copied to 'positions'.
+	     * \param q generalized coordinates
+	     * \param positions output: coordinates of the elements
+	     */
+	template<typename Coordinates>
+        void computeCoordinates( const Coordinates& q, 
+				 Positions& positions)   const;
+	
+	//! number of position sets kept in the cache (0 disables the cache)
+	void setCoordinatesCacheSize(size_t n);
 
 	    /** \brief computes the element's displacments to reach new Dofs 
 	     *
@@ -94,7 +159,7 @@ namespace atomism {
 	     * \param dofsNew 'new' degrees of freedom
 	     * \param displacments output: displacments
 	     */
-	void computeDisplacments(const Positions& coors0,
+	void computeDisplacments(const ConstPositions& coors0,
 				 const Vector& dofsNew,
 			         Positions& displacments) const;
 	
@@ -115,6 +180,43 @@ namespace atomism {
 		             Matrix&       jacOfDisplY,
 		             Matrix&       jacOfDisplZ
 		             ) const;
+	
+	    /** \brief compute the jacobian of the displacments from known positions
+	     *
+	     * Same as above, the coordinates of the elements at 'dofsValues' being
+	     * given (e.g. shared with the potential energy surface, see Lagrangian::evaluate).
+             *
+	     * \param dofsValues values of the degrees of freedom
+	     * \param dq steps of the degrees of freedom
+	     * \param positions coordinates of the elements at dofsValues
+	     */
+        void computeJacobian(const Vector&    dofsValues,
+                             const Vector&    dq,
+                             const ConstPositions& positions,
+		             Matrix&          jacOfDisplX,
+		             Matrix&          jacOfDisplY,
+		             Matrix&          jacOfDisplZ
+		             ) const;
+	
+	    /** \brief compute the jacobian of the displacments w/ the active DoFs only
+	     *
+	     * The row k of the matrices 'jacOfDisplX/Y/Z' (active.size() x noOfElements())
+	     * holds the displacments generated by the DoF active[k]: the displacments
+	     * of the frozen DoFs are not computed.
+             *
+	     * \param dofsValues values of the degrees of freedom
+	     * \param dq steps of the degrees of freedom
+	     * \param active indices of the active DoFs
+	     * \param positions coordinates of the elements at dofsValues
+	     */
+        void computeActiveJacobian(const Vector&              dofsValues,
+                                   const Vector&              dq,
+                                   const std::vector<size_t>& active,
+                                   const ConstPositions&      positions,
+		                   Matrix&                    jacOfDisplX,
+		                   Matrix&                    jacOfDisplY,
+		                   Matrix&                    jacOfDisplZ
+		                   ) const;
        //@}
         
     protected:
@@ -140,11 +242,23 @@ namespace atomism {
         Scalar _Mass; 	      //!< total mass in kg
 	
         //! \brief Apply a translation to 'Pos1' so that no linear momentum is generated by the displacments from Pos0 to Pos1
-        void annihilLinearMomentum(const Positions& Pos0, Positions& Pos1) const;
+        void annihilLinearMomentum(const ConstPositions& Pos0, Positions& Pos1) const;
         
         //! \brief Apply a rotation to 'Pos1' so that no angular momentum is generated by the displacments from Pos0 to Pos1
-        void annihilAngularMomentum(const Positions& Pos0, Positions& Pos1) const;
+        void annihilAngularMomentum(const ConstPositions& Pos0, Positions& Pos1) const;
+	    
 	    
+        //! entry of the cache of positions
+        struct CachedPositions {
+	    
+	    std::shared_ptr<const CoordinatesSnapshot> Coordinates;
+	    uint64_t                                   LastUse;
+	};
+	
+	mutable std::vector<CachedPositions> _PositionsCache;
+	mutable uint64_t                     _CacheClock = 0;
+	mutable std::mutex                   _CacheMutex;
+	size_t                               _CacheSize  = 4;
 	    
         double dteta   = 0.01;
         double epsRel  = 1e-10 ;
@@ -200,9 +314,93 @@ namespace atomism {
     
     template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
     typename Vector3d,typename Matrix3d>
+    template<typename Coordinates>
+    inline
+    std::shared_ptr<const typename Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::CoordinatesSnapshot>
+    Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
+    getCoordinates(const Coordinates& q) const {
+        
+        ATOMISM_LOG();
+	
+	// the snapshot holds consistent values and version, whatever the concurrent updates
+	auto     snapshot = q.getSnapshot();
+	uint64_t version  = snapshot->Version;
+	
+	// the lock only covers the lookup: the positions are shared, not copied
+	{ std::lock_guard<std::mutex> lock(_CacheMutex);
+	  
+	    for( auto& entry : _PositionsCache )
+	        if( entry.Coordinates->getVersion() == version ) {
+		  
+		    entry.LastUse = ++_CacheClock;
+		    return entry.Coordinates;
+		}
+	}
+	
+	// the vectors come from the pool: no allocation once the pool holds released snapshots
+	auto coordinates = std::make_shared<CoordinatesSnapshot>( _ResourceMngr, version, noOfElements() );
+	
+	Positions positions( *coordinates->_X, *coordinates->_Y, *coordinates->_Z );
+	computeCoordinates( snapshot->Values, positions );
+	
+	std::lock_guard<std::mutex> lock(_CacheMutex);
+	
+	if( _CacheSize == 0 ) return coordinates;
+	if( _PositionsCache.size() < _CacheSize ) _PositionsCache.push_back( CachedPositions() );
+	else {
+	    auto lru = std::min_element( _PositionsCache.begin(), _PositionsCache.end(),
+				         [](const CachedPositions& a, const CachedPositions& b){ return a.LastUse < b.LastUse; } );
+	    std::swap( *lru, _PositionsCache.back() );
+	}
+	
+	CachedPositions& entry = _PositionsCache.back();
+	entry.Coordinates = coordinates;
+	entry.LastUse     = ++_CacheClock;
+	return coordinates;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
+    typename Vector3d,typename Matrix3d>
+    template<typename Coordinates>
     inline
     void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
-    computeDisplacments(const Positions& coors0,
+    computeCoordinates(const Coordinates& q, 
+		       Positions& positions) const {
+        
+        ATOMISM_LOG();
+	
+	auto coordinates = getCoordinates(q);
+	
+	std::get<0>(positions) = coordinates->getX();
+	std::get<1>(positions) = coordinates->getY();
+	std::get<2>(positions) = coordinates->getZ();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
+    typename Vector3d,typename Matrix3d>
+    inline
+    void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
+    setCoordinatesCacheSize(size_t n) {
+        
+        std::lock_guard<std::mutex> lock(_CacheMutex);
+	_CacheSize = n;
+	if( _PositionsCache.size() > n ) _PositionsCache.resize(n);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
+    typename Vector3d,typename Matrix3d>
+    inline
+    void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
+    computeDisplacments(const ConstPositions& coors0,
                         const Vector& DofsNew,
                         Positions& displacments) const {
         
@@ -215,7 +413,12 @@ namespace atomism {
             annihilAngularMomentum( coors0 , displacments );
 	}
 	
-        displacments -= coors0;
+        for( size_t i=0; i<noOfElements(); i++) {
+	  
+	    std::get<0>(displacments)[i] -= std::get<0>(coors0)[i];
+	    std::get<1>(displacments)[i] -= std::get<1>(coors0)[i];
+	    std::get<2>(displacments)[i] -= std::get<2>(coors0)[i];
+	}
     }
     
     
@@ -226,13 +429,32 @@ namespace atomism {
     typename Vector3d,typename Matrix3d>
     inline
     void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
-    annihilLinearMomentum(const Positions& coors0,
+    annihilLinearMomentum(const ConstPositions& coors0,
                           Positions& coors1) const {
         
         ATOMISM_LOG();
         
-        Vector3d Momentum = totalLinearMomentum<Vector,Vector3d,Positions>( coors0, coors1, _MassElements);
-        translate( coors1, -1. * Momentum);
+        ATOMISM_VALUE_MISMATCH( [&](){return n_elements(coors0);},
+	                        [&](){return _MassElements.size();});
+	
+        // shift of the center of mass, removed from all the elements
+        Vector3d Momentum = {0,0,0};
+        Scalar   mass     = 0;
+        for( size_t i=0; i<_MassElements.size(); i++) {
+	  
+	    Momentum[0] += _MassElements[i] * ( std::get<0>(coors1)[i] - std::get<0>(coors0)[i] );
+	    Momentum[1] += _MassElements[i] * ( std::get<1>(coors1)[i] - std::get<1>(coors0)[i] );
+	    Momentum[2] += _MassElements[i] * ( std::get<2>(coors1)[i] - std::get<2>(coors0)[i] );
+	    mass        += _MassElements[i];
+	}
+        for( size_t j=0; j<3; j++) Momentum[j] /= mass;
+	
+        for( size_t i=0; i<_MassElements.size(); i++) {
+	  
+	    std::get<0>(coors1)[i] -= Momentum[0];
+	    std::get<1>(coors1)[i] -= Momentum[1];
+	    std::get<2>(coors1)[i] -= Momentum[2];
+	}
         
         LOGGER_WRITE(Logger::DEBUG,stringstream("Delta CDG: ")
                      <<-Momentum[0]<<" "<<-Momentum[1]<<" "<<-Momentum[2]);
@@ -246,8 +468,8 @@ namespace atomism {
     typename Vector3d,typename Matrix3d>
     inline
     void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
-    annihilAngularMomentum(const Positions& coors0,
-                           Positions&       coors1) const {
+    annihilAngularMomentum(const ConstPositions& coors0,
+                           Positions&            coors1) const {
         
         ATOMISM_LOG();
         ATOMISM_VALUE_MISMATCH( [&](){return n_elements(coors0);},
@@ -296,6 +518,30 @@ namespace atomism {
 		    Matrix&       jacOfDisplZ
 		    ) const {
     
+        ATOMISM_LOG();
+	
+	auto positions = _ResourceMngr->requestPositions(noOfElements());
+	
+        computeCoordinates(dofsValues, *positions);
+	
+	computeJacobian( dofsValues, dq, *positions, jacOfDisplX, jacOfDisplY, jacOfDisplZ );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
+    typename Vector3d,typename Matrix3d>
+    inline 
+    void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
+    computeJacobian(const Vector&    dofsValues,
+                    const Vector&    dq,
+                    const ConstPositions& positions,
+		    Matrix&          jacOfDisplX,
+		    Matrix&          jacOfDisplY,
+		    Matrix&          jacOfDisplZ
+		    ) const {
+    
         ATOMISM_LOG();
         ATOMISM_VALUE_MISMATCH( [&](){return atomism::n_elements(dq);},
 	                        [&](){return atomism::n_elements(dofsValues);});
@@ -309,11 +555,8 @@ namespace atomism {
 	ATOMISM_VALUE_MISMATCH( [&](){return atomism::n_elements(jacOfDisplX);},
 	                        [&](){return atomism::n_elements(jacOfDisplZ);});
 	
-	auto positions = _ResourceMngr->requestPositions(noOfElements());
 	auto jacOfDofs = _ResourceMngr->requestMatrix(noOfDofs(),noOfDofs());
 	
-        computeCoordinates(dofsValues, *positions);
-	
 	replicate_vector( dofsValues , *jacOfDofs );
 	increment_diagonal( dq       , *jacOfDofs );
 	
@@ -323,11 +566,56 @@ namespace atomism {
 	    auto tuple = std::tie(slice(i,jacOfDisplX),
 	  	                  slice(i,jacOfDisplY),
 				  slice(i,jacOfDisplZ));
-	    computeDisplacments( *positions , slice(i,*jacOfDofs) , tuple);
+	    computeDisplacments( positions , slice(i,*jacOfDofs) , tuple);
 	}
 
     }
 
     
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template< typename DerivedClass, typename Scalar, typename Vector, typename Matrix, typename Positions,
+    typename Vector3d,typename Matrix3d>
+    inline 
+    void Entity<DerivedClass,Scalar,Vector,Matrix,Positions,Vector3d,Matrix3d>::
+    computeActiveJacobian(const Vector&              dofsValues,
+                          const Vector&              dq,
+                          const std::vector<size_t>& active,
+                          const ConstPositions&      positions,
+		          Matrix&                    jacOfDisplX,
+		          Matrix&                    jacOfDisplY,
+		          Matrix&                    jacOfDisplZ
+		          ) const {
+    
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return atomism::n_elements(dq);},
+	                        [&](){return atomism::n_elements(dofsValues);});
+	
+	ATOMISM_VALUE_MISMATCH( [&](){return active.size()*noOfElements();},
+	                        [&](){return atomism::n_elements(jacOfDisplX);});
+	
+	ATOMISM_VALUE_MISMATCH( [&](){return atomism::n_elements(jacOfDisplX);},
+	                        [&](){return atomism::n_elements(jacOfDisplY);});
+	
+	ATOMISM_VALUE_MISMATCH( [&](){return atomism::n_elements(jacOfDisplX);},
+	                        [&](){return atomism::n_elements(jacOfDisplZ);});
+	
+	// a single displaced vector of DoFs: the storage is O(noOfDofs), not O(noOfDofs^2)
+	auto dofs = _ResourceMngr->requestVector(noOfDofs());
+	for(int i = 0; i < noOfDofs() ; ++i) (*dofs)[i] = dofsValues[i];
+	
+        for(size_t k = 0; k < active.size() ; ++k) {
+            
+	    size_t i = active[k];
+	    auto tuple = std::tie(slice(k,jacOfDisplX),
+	  	                  slice(k,jacOfDisplY),
+				  slice(k,jacOfDisplZ));
+	    (*dofs)[i] += dq[i];
+	    computeDisplacments( positions , *dofs , tuple);
+	    (*dofs)[i]  = dofsValues[i];
+	}
+    }
 }
 #endif // MSENTITY_H
@@ -23,11 +23,47 @@
 
 #include <Entity.h>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
 
 namespace atomism {
     
+    //! new version stamp of generalized coordinates, unique over all the instances (never 0)
+    inline uint64_t newCoordinatesVersion() {
+        
+        static std::atomic<uint64_t> counter(0);
+        return ++counter;
+    }
+    
     /*! \class GeneralizedCoordinates
      * \brief Container fo generalized coordinates
+     *
+     * Each modification of the values gives a new version stamp (see getVersion),
+     * unique over all the instances: two coordinates with the same version have the
+     * same values. It is used to cache the quantities computed from the values
+     * (e.g. Entity::computeCoordinates).
+     *
+     * The values are published as immutable snapshots (read-copy-update): setValues
+     * builds a new Snapshot and publishes it with std::atomic_store, getSnapshot returns
+     * the current one with std::atomic_load. Readers never lock _Mutex, but these atomic
+     * operations on shared_ptr are not lock free: libstdc++ implements them with a pool
+     * of mutexes indexed by the address of the pointer (std::atomic_is_lock_free is
+     * false), so each getSnapshot locks and unlocks one mutex of the pool, shared with
+     * the writer. The cost is that of an uncontended mutex as long as the snapshot is
+     * taken once per evaluation, as the entity, the PES and the kinetic operator do;
+     * readers must not call getSnapshot in inner loops. \n
+     * A snapshot holds the values and their version, which are always consistent, and
+     * shares the steps and bounds: these are set once by the constructor, in a single
+     * immutable block (Limits) shared by all the snapshots, separate from the values.
+     * Concurrent readers should use getSnapshot, and keep the snapshot as long as they
+     * use its values; getValues returns a copy of the current values.
+     *
+     * DoFs can be frozen (see freeze, or setActiveMask for several DoFs at once): the
+     * snapshot holds the sorted indices of the active DoFs, on which the reduced
+     * computations operate (Entity::computeActiveJacobian,
+     * KineticOperator::computeActiveKineticMatrix, PotentialEnergySurface::computeGradient).
+     * The velocities of the frozen DoFs are zero.
      */
     template<
     typename Scalar=double,
@@ -50,28 +86,79 @@ namespace atomism {
 			       std::shared_ptr<ResourceManager<Scalar,Vector>> resourcemngr
 			      );*/
 	
-	const Vector& getValues() const  {return _Values;};
+	//! steps and bounds, immutable
+	struct Limits {
+	  
+	    Vector dqs;
+	    Vector Dqs;
+	    Vector Mins;
+	    Vector Maxs;
+	};
+	
+	//! consistent view of the coordinates
+	struct Snapshot {
+	  
+	    uint64_t                      Version;
+	    Vector                        Values;
+	    std::shared_ptr<const Limits> Bounds;
+	    std::shared_ptr<const std::vector<size_t>> Active;   //!< indices of the active DoFs
+	};
+	
+	//! current snapshot, kept alive by the returned pointer (atomic_load: locks a mutex of the pool)
+	std::shared_ptr<const Snapshot> getSnapshot() const { return std::atomic_load(&_Snapshot); }
+	
+	//! copy of the current values, see getSnapshot to avoid the copy
+	Vector getValues() const  {return getSnapshot()->Values;};
+	
+	const Vector& getdqs()    const  {return _Limits->dqs; };
+	
+	const Vector& getDqs()    const  {return _Limits->Dqs; };
+	
+	const Vector& getMins()   const  {return _Limits->Mins;};
+	
+	const Vector& getMaxs()   const  {return _Limits->Maxs;};	
 	
-	const Vector& getdqs()    const  {return _dqs;   };
+	//! version stamp of the values
+	uint64_t getVersion()     const  {return getSnapshot()->Version;};
 	
-	const Vector& getDqs()    const  {return _Dqs;   };
+	void setValues(const Vector& values);
 	
-	const Vector& getMins()   const  {return _Mins;  };
+	//! @name Active DoFs
+	//@{
+	void freeze(size_t i)   { setActive(i,0); }
 	
-	const Vector& getMaxs()   const  {return _Maxs;  };	
+	void unfreeze(size_t i) { setActive(i,1); }
+	
+	bool isFrozen(size_t i) const;
+	
+	/** \brief set the active DoFs at once
+	 *
+	 * A single snapshot is published: readers see the previous or the new active DoFs,
+	 * never a part of the change.
+	 * \param active true for the active DoFs (size: number of DoFs)
+	 */
+	void setActiveMask(const std::vector<bool>& active);
+	
+	size_t noOfActive()     const {return getSnapshot()->Active->size();};
+	
+	//! sorted indices of the active DoFs
+	std::shared_ptr<const std::vector<size_t>> getActiveIndices() const {return getSnapshot()->Active;};
+	//@}
 	
-	void setValues(Vector& values)   { std::lock_guard<std::mutex> guard(_Mutex);
-					   init_clone(_Values,values);
-	                                  }
     private:
         
-        Vector _Values;
-        Vector _dqs;
-        Vector _Dqs;
-        Vector _Mins;
-        Vector _Maxs;
+        void setActive(size_t i, bool active);
+        
+        //! publish a new snapshot, _Mutex being locked
+        void publish(std::shared_ptr<Snapshot> snapshot);
         
+        std::shared_ptr<const Limits>    _Limits;
+        std::shared_ptr<const Snapshot>  _Snapshot;   //!< accessed with atomic_load/atomic_store
+        
+        //! @name writers only, protected by _Mutex
+        //@{
 	std::mutex _Mutex;
+        //@}
     };
     
     //-----------------------------------------------------------------------------
@@ -88,12 +175,115 @@ namespace atomism {
         
         ATOMISM_LOG();
 	
-	auto v=resourcemngr->requestVector(n);
-	_Values=constant_clone(*v,values);
-	_Dqs   =constant_clone(*v,Dqs);
-	_dqs   =constant_clone(*v,dqs);
-	_Mins  =constant_clone(*v,mins);
-	_Maxs  =constant_clone(*v,maxs);
+	auto v = resourcemngr->requestVector(n);
+	
+	auto limits = std::make_shared<Limits>();
+	limits->Dqs  = constant_clone(*v,Dqs);
+	limits->dqs  = constant_clone(*v,dqs);
+	limits->Mins = constant_clone(*v,mins);
+	limits->Maxs = constant_clone(*v,maxs);
+	_Limits = limits;
+	
+	auto snapshot = std::make_shared<Snapshot>();
+	snapshot->Version = newCoordinatesVersion();
+	snapshot->Values  = constant_clone(*v,values);
+	snapshot->Bounds  = _Limits;
+	
+	auto active = std::make_shared<std::vector<size_t>>(n);
+	for( size_t i=0; i<n; i++) (*active)[i] = i;
+	snapshot->Active  = active;
+	_Snapshot = snapshot;
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename Scalar,typename Vector>
+    inline
+    void GeneralizedCoordinates<Scalar,Vector>::setValues(const Vector& values) {
+        
+        auto snapshot = std::make_shared<Snapshot>();
+	init_clone(snapshot->Values,values);
+	snapshot->Bounds = _Limits;
+	
+	std::lock_guard<std::mutex> guard(_Mutex);
+	
+	snapshot->Version = newCoordinatesVersion();
+	snapshot->Active  = _Snapshot->Active;
+	publish(snapshot);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename Scalar,typename Vector>
+    inline
+    bool GeneralizedCoordinates<Scalar,Vector>::isFrozen(size_t i) const {
+        
+        auto active = getActiveIndices();
+	return !std::binary_search( active->begin(), active->end(), i );
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename Scalar,typename Vector>
+    inline
+    void GeneralizedCoordinates<Scalar,Vector>::setActive(size_t i, bool active) {
+        
+        ATOMISM_LOG();
+	
+	std::lock_guard<std::mutex> guard(_Mutex);
+	
+	ATOMISM_EXCEPT_IF( [&](){ return i >= n_elements(_Snapshot->Values); } );
+	
+	const std::vector<size_t>& current = *_Snapshot->Active;
+	auto it = std::lower_bound( current.begin(), current.end(), i );
+	if( ( it != current.end() && *it == i ) == active ) return;
+	
+	auto indices = std::make_shared<std::vector<size_t>>(current);
+	if( active ) indices->insert( indices->begin() + ( it - current.begin() ), i );
+	else         indices->erase(  indices->begin() + ( it - current.begin() ) );
+	
+	// same values, same version
+	auto snapshot = std::make_shared<Snapshot>( *_Snapshot );
+	snapshot->Active = indices;
+	publish(snapshot);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename Scalar,typename Vector>
+    inline
+    void GeneralizedCoordinates<Scalar,Vector>::setActiveMask(const std::vector<bool>& active) {
+        
+        ATOMISM_LOG();
+	
+	std::lock_guard<std::mutex> guard(_Mutex);
+	
+	ATOMISM_VALUE_MISMATCH( [&](){ return n_elements(_Snapshot->Values); },
+				[&](){ return active.size(); } );
+	
+	auto indices = std::make_shared<std::vector<size_t>>();
+	for( size_t i=0; i<active.size(); i++) if( active[i] ) indices->push_back(i);
+	
+	if( *indices == *_Snapshot->Active ) return;
+	
+	// same values, same version
+	auto snapshot = std::make_shared<Snapshot>( *_Snapshot );
+	snapshot->Active = indices;
+	publish(snapshot);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename Scalar,typename Vector>
+    inline
+    void GeneralizedCoordinates<Scalar,Vector>::publish(std::shared_ptr<Snapshot> snapshot) {
+        
+	std::atomic_store( &_Snapshot, std::shared_ptr<const Snapshot>(snapshot) );
     };
     
     //-----------------------------------------------------------------------------
@@ -35,12 +35,15 @@ namespace atomism {
     typename TheEntity,  
     typename Scalar           = double,
     typename Vector           = std::vector<Scalar>,
-    typename Matrix 	      = std::vector<std::vector<Scalar>>         
+    typename Matrix 	      = std::vector<std::vector<Scalar>>,
+    typename Positions        = std::tuple<Vector&,Vector&,Vector&>
     >
     class KineticOperator {
         
     public:
         
+        typedef typename const_positions<Positions>::type ConstPositions;
+        
 	KineticOperator(std::shared_ptr<const TheEntity> entity,
 	                std::shared_ptr<ResourceManager<Scalar,Vector,Matrix> >  resource
 	                );
@@ -62,9 +65,48 @@ namespace atomism {
          */
         double computeKineticEnergy(const GeneralizedCoordinates<Scalar,Vector>& q,
 				    const GeneralizedCoordinates<Scalar,Vector>& qp ) const;
+	
+	/*! \brief compute the kinetic matrix from known positions
+         *
+         * \param q  generalized coordinates
+	 * \param positions coordinates of the elements at q
+	 * \param KMatrix output: kinetic matrix 
+         */
+        void computeKineticMatrix(const GeneralizedCoordinates<Scalar,Vector>& q,
+				  const ConstPositions& positions,
+				  Matrix& KMatrix ) const;
+	
+	/*! \brief compute the kinetic energy from known positions
+         *
+         * The coordinates of the elements are not recomputed by the jacobian
+         * (see Lagrangian::evaluate). If DoFs of q are frozen, their velocities are
+         * zero and only the reduced kinetic matrix is computed (see computeActiveKineticMatrix).
+         * \param q  generalized coordinates
+         * \param qp generalized velocities
+	 * \param positions coordinates of the elements at q
+         */
+        double computeKineticEnergy(const GeneralizedCoordinates<Scalar,Vector>& q,
+				    const GeneralizedCoordinates<Scalar,Vector>& qp,
+				    const ConstPositions& positions ) const;
+	
+	/*! \brief compute the kinetic matrix of the active DoFs
+         *
+         * The element (k,l) of 'KMatrix' (noOfActive x noOfActive) couples the DoFs
+         * active[k] and active[l]: only the jacobian of the active DoFs is computed.
+         * \param q  generalized coordinates
+	 * \param positions coordinates of the elements at q
+	 * \param KMatrix output: reduced kinetic matrix 
+         */
+        void computeActiveKineticMatrix(const GeneralizedCoordinates<Scalar,Vector>& q,
+					const ConstPositions& positions,
+					Matrix& KMatrix ) const;
 				    
     private:
         
+        //! K = sum over x,y,z of Jac^T.M.Jac
+        void assembleKineticMatrix(const Matrix& JacX, const Matrix& JacY, const Matrix& JacZ,
+				   Matrix& KMatrix) const;
+        
         std::shared_ptr<const TheEntity > _Entity;
 	
         //! This is used to create/obtain new elements within thread safety.
@@ -76,17 +118,17 @@ namespace atomism {
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
 	
-    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix>
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
-    KineticOperator<TheEntity,Scalar,Vector,Matrix>::KineticOperator() { }
+    KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>::KineticOperator() { }
 	
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
 	
     template<
-    typename TheEntity,typename Scalar,typename Vector,typename Matrix>
+    typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
-    KineticOperator<TheEntity,Scalar,Vector,Matrix>
+    KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
     ::KineticOperator(std::shared_ptr<const TheEntity > entity,
                       std::shared_ptr<ResourceManager<Scalar,Vector,Matrix> >  resource ) 
     :_Entity(entity),_ResourceMngr(resource) {
@@ -95,32 +137,50 @@ namespace atomism {
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
 	
-    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix>
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
-    double KineticOperator<TheEntity,Scalar,Vector,Matrix>
+    double KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
     ::computeKineticEnergy(const GeneralizedCoordinates<Scalar,Vector>& q,
 			   const GeneralizedCoordinates<Scalar,Vector>& qp) const {
         
          ATOMISM_LOG();    
 	 
-	 size_t n     = _Entity->noOfDofs();
-	 auto kmatrix = _ResourceMngr->requestMatrix(n,n);
-	 computeKineticMatrix(q,*kmatrix);
+	 auto coordinates = _Entity->getCoordinates(q);
 	 	 	   
-	 return evaluate(qp,*kmatrix,qp);	
+	 return computeKineticEnergy(q,qp,coordinates->getPositions());	
     };
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
 	
-    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix>
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
-    void KineticOperator<TheEntity,Scalar,Vector,Matrix>
+    void KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
     ::computeKineticMatrix(const GeneralizedCoordinates<Scalar,Vector>& q,
 			   Matrix& KMatrix )  const {
         
          ATOMISM_LOG();   
-	 ATOMISM_VALUE_MISMATCH( [&](){return pow(n_elements(q.getValues()),2);},
+	 ATOMISM_VALUE_MISMATCH( [&](){return pow(n_elements(q.getSnapshot()->Values),2);},
+	                         [&](){return n_elements(KMatrix);});
+	 
+	 // the reference positions of the jacobian are taken from the cache of the entity
+	 auto coordinates = _Entity->getCoordinates(q);
+	 
+	 computeKineticMatrix(q,coordinates->getPositions(),KMatrix);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    void KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeKineticMatrix(const GeneralizedCoordinates<Scalar,Vector>& q,
+			   const ConstPositions& positions,
+			   Matrix& KMatrix )  const {
+        
+         ATOMISM_LOG();   
+	 ATOMISM_VALUE_MISMATCH( [&](){return pow(n_elements(q.getSnapshot()->Values),2);},
 	                         [&](){return n_elements(KMatrix);});
 	 
 	 size_t n  = _Entity->noOfDofs();
@@ -130,13 +190,88 @@ namespace atomism {
 	 auto JacY = _ResourceMngr->requestMatrix(n,n2);
 	 auto JacZ = _ResourceMngr->requestMatrix(n,n2);
 	 
-         _Entity->computeJacobian(q.getValues(),q.getdqs(),*JacX,*JacY,*JacZ);
+         _Entity->computeJacobian(q.getSnapshot()->Values,q.getdqs(),positions,*JacX,*JacY,*JacZ);
 	
+	 assembleKineticMatrix(*JacX,*JacY,*JacZ,KMatrix);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    double KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeKineticEnergy(const GeneralizedCoordinates<Scalar,Vector>& q,
+			   const GeneralizedCoordinates<Scalar,Vector>& qp,
+			   const ConstPositions& positions) const {
+        
+         ATOMISM_LOG();    
+	 
+	 size_t n      = _Entity->noOfDofs();
+	 auto   active = q.getActiveIndices();
+	 size_t na     = active->size();
+	 
+	 if( na == n ) {
+	     
+	     auto kmatrix = _ResourceMngr->requestMatrix(n,n);
+	     computeKineticMatrix(q,positions,*kmatrix);
+	     return evaluate(qp,*kmatrix,qp);
+	 }
+	 
+	 // T = qp_a^T.K_aa.qp_a, the velocities of the frozen DoFs being zero
+	 auto kmatrix = _ResourceMngr->requestMatrix(na,na);
+	 auto qpa     = _ResourceMngr->requestVector(na);
+	 computeActiveKineticMatrix(q,positions,*kmatrix);
+	 
+	 auto velocities = qp.getSnapshot();
+	 const Vector& values = velocities->Values;
+	 for( size_t k=0; k<na; k++) (*qpa)[k] = values[(*active)[k]];
+	 	 	   
+	 return evaluate(*qpa,*kmatrix,*qpa);	
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    void KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeActiveKineticMatrix(const GeneralizedCoordinates<Scalar,Vector>& q,
+				 const ConstPositions& positions,
+				 Matrix& KMatrix )  const {
+        
+         ATOMISM_LOG();   
+	 
+	 auto   snapshot = q.getSnapshot();
+	 size_t na = snapshot->Active->size();
+	 size_t n2 = _Entity->noOfElements();
+	 
+	 ATOMISM_VALUE_MISMATCH( [&](){return na*na;},
+	                         [&](){return n_elements(KMatrix);});
+	 
+	 auto JacX = _ResourceMngr->requestMatrix(na,n2);
+	 auto JacY = _ResourceMngr->requestMatrix(na,n2);
+	 auto JacZ = _ResourceMngr->requestMatrix(na,n2);
+	 
+         _Entity->computeActiveJacobian(snapshot->Values,q.getdqs(),*snapshot->Active,positions,*JacX,*JacY,*JacZ);
+	
+	 assembleKineticMatrix(*JacX,*JacY,*JacZ,KMatrix);
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+    template<typename TheEntity,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    void KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::assembleKineticMatrix(const Matrix& JacX, const Matrix& JacY, const Matrix& JacZ,
+			    Matrix& KMatrix) const {
+        
 	 init_constant(KMatrix,0.);
 	 
-	 KMatrix =  multiplyByTransposeAndWeigth( *JacX, _Entity->getMasses() )
-	         +  multiplyByTransposeAndWeigth( *JacY, _Entity->getMasses() )
-	         +  multiplyByTransposeAndWeigth( *JacZ, _Entity->getMasses() );
+	 KMatrix =  multiplyByTransposeAndWeigth( JacX, _Entity->getMasses() )
+	         +  multiplyByTransposeAndWeigth( JacY, _Entity->getMasses() )
+	         +  multiplyByTransposeAndWeigth( JacZ, _Entity->getMasses() );
     };
     
     //-----------------------------------------------------------------------------
@@ -24,6 +24,7 @@
 #include <KineticOperator.h>
 #include <PotentialEnergySurface.h>
 #include <Environment.h>
+#include <ThreadPool.h>
 
 
 namespace atomism {
@@ -31,35 +32,57 @@ namespace atomism {
     /*! \class Lagrangian
      *  \brief Lagrangian of a system defined by a kinetic operator and a potential energy surface
      *
+     * evaluate() computes the coordinates of the elements once and shares them between
+     * the kinetic energy (through the jacobian of the entity) and the potential energy,
+     * instead of one computation by T and one by U. \n
+     * If setConcurrent(true) is called, the kinetic and the potential energies are computed
+     * concurrently by evaluate(). The positions are then only read, but the kinetic operator
+     * (and its entity) and the PES must use distinct ResourceManagers, and the Logger must
+     * not be active (see ThreadPool).
      */
     template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
+    typename TheEntity,
+    typename ThePes,
     typename Scalar             = double,
     typename Vector             = std::vector<Scalar>,
     typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
+    typename Positions          = std::tuple<Vector&,Vector&,Vector&>
     >
     class Lagrangian
     {
         
     public:
         
-	Lagrangian(std::shared_ptr<
-	           const KineticOperator<TheEntity, Scalar,Vector,Matrix,Positions>> kin,
-                   std::shared_ptr<
-                   const PotentialEnergySurface<ThePes, Scalar,Vector,Matrix,Positions>> pot,
+        typedef KineticOperator<TheEntity,Scalar,Vector,Matrix,Positions> KineticOperatorType;
+        
+	Lagrangian(std::shared_ptr<const KineticOperatorType> kin,
+                   std::shared_ptr<const ThePes> pot,
 		   std::shared_ptr<
 		   ResourceManager< Scalar, Vector, Matrix, Positions>> ressource
 		   );
         
-        Scalar L(const GeneralizedCoordinates& q,
-                 const GeneralizedCoordinates& qp ) const;
+        Scalar L(const GeneralizedCoordinates<Scalar,Vector>& q,
+                 const GeneralizedCoordinates<Scalar,Vector>& qp ) const;
+        
+        Scalar T(const GeneralizedCoordinates<Scalar,Vector>& q,
+                 const GeneralizedCoordinates<Scalar,Vector>& qp ) const;
         
-        Scalar T(const GeneralizedCoordinates& q,
-                 const GeneralizedCoordinates& qp ) const;
+        Scalar U(const GeneralizedCoordinates<Scalar,Vector>& q )  const;
         
-        Scalar U(const GeneralizedCoordinates& q )  const;
+        /*! \brief compute the Lagrangian, the kinetic and the potential energies in one pass
+         *
+         * \param q generalized coordinates
+         * \param qp generalized velocities
+         * \param t output: kinetic energy
+         * \param u output: potential energy
+         * \return L = t - u
+         */
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const GeneralizedCoordinates<Scalar,Vector>& qp,
+                        Scalar& t, Scalar& u ) const;
+        
+        //! compute the kinetic and potential energies concurrently in evaluate()
+        void setConcurrent(bool concurrent);
         
     private:
         
@@ -67,13 +90,11 @@ namespace atomism {
         ResourceManager< Scalar, Vector, Matrix, Positions >
         > _ResourceMngr;
 	
-        std::shared_ptr<
-        const KineticOperator<TheEntity, Scalar,Vector,Matrix,Positions>
-        > _KineticOperator;
+        std::shared_ptr<const KineticOperatorType> _KineticOperator;
+        
+        std::shared_ptr<const ThePes> _PES;
         
-        std::shared_ptr<
-        const PotentialEnergySurface<ThePes, Scalar,Vector,Matrix,Positions>
-        > _PES;
+        std::shared_ptr<ThreadPool> _Pool;   //!< 0 if evaluate() is serial
         
         Lagrangian();
     };
@@ -81,16 +102,10 @@ namespace atomism {
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-    template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
-    typename Scalar             = double,
-    typename Vector             = std::vector<Scalar>,
-    typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
-    >
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
-    Lagrangian::Lagrangian() const {
+    Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
+    ::Lagrangian() {
         
         ATOMISM_LOG();
     };
@@ -98,84 +113,98 @@ namespace atomism {
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-    template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
-    typename Scalar             = double,
-    typename Vector             = std::vector<Scalar>,
-    typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
-    >
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
     Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
-    ::Lagrangian(std::shared_ptr<
-                 const KineticOperator<TheEntity, Scalar,Vector,Matrix,Positions>> kin,
-                 std::shared_ptr<
-                 const PotentialEnergySurface<ThePes, Scalar,Vector,Matrix,Positions>> pot,
+    ::Lagrangian(std::shared_ptr<const KineticOperatorType> kin,
+                 std::shared_ptr<const ThePes> pot,
 		 std::shared_ptr<
 		 ResourceManager< Scalar, Vector, Matrix, Positions>> resource
 		 )
-    : _PES(pot), _KineticOperator(kin), _ResourceMngr(resource){ ATOMISM_LOG(); }
+    : _ResourceMngr(resource), _KineticOperator(kin), _PES(pot) { ATOMISM_LOG(); }
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-    template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
-    typename Scalar             = double,
-    typename Vector             = std::vector<Scalar>,
-    typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
-    >
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
     Scalar Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
-    ::L(const GeneralizedCoordinates& q,
-                             const GeneralizedCoordinates& qp ) const {
+    ::L(const GeneralizedCoordinates<Scalar,Vector>& q,
+        const GeneralizedCoordinates<Scalar,Vector>& qp ) const {
+        
         ATOMISM_LOG();
-        return T( q, qp ) - U( q );
+        Scalar t, u;
+        return evaluate( q, qp, t, u );
     }
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-    template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
-    typename Scalar             = double,
-    typename Vector             = std::vector<Scalar>,
-    typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
-    >
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
     Scalar Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
-    ::T(const GeneralizedCoordinates& q,
-                             const GeneralizedCoordinates& qp,
-                             PositionVectorType& positions ) const {
-        ATOMISM_LOGIN();
-        return T = _KineticOperator->computeKineticEnergy( q, qp );
+    ::T(const GeneralizedCoordinates<Scalar,Vector>& q,
+        const GeneralizedCoordinates<Scalar,Vector>& qp ) const {
+        
+        ATOMISM_LOG();
+        return _KineticOperator->computeKineticEnergy( q, qp );
     }
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-    template<
-    typename TheEntity          = Entity,
-    typename ThePes             = PotentialEnergySurface,
-    typename Scalar             = double,
-    typename Vector             = std::vector<Scalar>,
-    typename Matrix             = std::vector< std::vector<Scalar> >,
-    typename Positions          = std::array< std::vector<Scalar>, 3 >
-    >
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
     Scalar Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
-    ::U(const GeneralizedCoordinates& q,
-                             Environment& Environment) const {
+    ::U(const GeneralizedCoordinates<Scalar,Vector>& q ) const {
         
-        ATOMISM_LOGIN();
+        ATOMISM_LOG();
         return _PES->evaluate( q );
     }
     
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    Scalar Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+               const GeneralizedCoordinates<Scalar,Vector>& qp,
+               Scalar& t, Scalar& u ) const {
+        
+        ATOMISM_LOG();
+        
+        // shared with the cache of the entity, not copied
+        auto coordinates = _PES->getEntity()->getCoordinates( q );
+        auto positions   = coordinates->getPositions();
+        
+        if( !_Pool ) {
+            
+            t = _KineticOperator->computeKineticEnergy( q, qp, positions );
+            u = _PES->evaluate( q, positions );
+            return t - u;
+        }
+        
+        _Pool->parallelFor( 2, [&](size_t task, size_t) {
+            
+            if( task == 0 ) t = _KineticOperator->computeKineticEnergy( q, qp, positions );
+            else            u = _PES->evaluate( q, positions );
+        });
+        return t - u;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
     
+    template<typename TheEntity,typename ThePes,typename Scalar,typename Vector,typename Matrix,typename Positions>
+    inline
+    void Lagrangian<TheEntity,ThePes,Scalar,Vector,Matrix,Positions>
+    ::setConcurrent(bool concurrent) {
+        
+        ATOMISM_LOG();
+        
+        if( !concurrent ) _Pool.reset();
+        else if( !_Pool ) _Pool = std::make_shared<ThreadPool>(2);
+    }
 }
 #endif // MSLagrangian_H
@@ -0,0 +1,369 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file NeighborList.h Neighbor search: linked cell grid and Verlet list
+
+#ifndef NEIGHBORLIST_H
+#define NEIGHBORLIST_H
+
+#include <Exceptions.h>
+#include <vector>
+#include <tuple>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+
+namespace atomism {
+
+    /** \class CellList
+     *
+     * \brief Linked cell grid over the bounding box of a set of elements
+     *
+     * The bounding box of the elements is divided in cubic cells of size at least
+     * 'cellSize'; two elements closer than cellSize are then in the same or in
+     * adjacent cells. The cells are stored compactly: the elements of the cell c are
+     * getSorted()[getCellStart()[c] .. getCellStart()[c+1]). The number of cells is
+     * limited to a few times the number of elements, the cells being enlarged for
+     * sparse systems. \n
+     * forEachPair visits each unordered pair of elements of the same or adjacent
+     * cells once (half shell of 13 neighbor cells), in O(N) for homogeneous systems.
+     */
+    template<
+    typename Scalar    = double,
+    typename Vector    = std::vector<Scalar>,
+    typename Positions = std::tuple<Vector&,Vector&,Vector&>
+    >
+    class CellList {
+
+    public:
+
+        CellList() : _CellSize(0) { _Dims.fill(0); _Min.fill(0); }
+
+        /** \brief sort the elements in the cells
+         *
+         * \param coors coordinates of the elements
+         * \param n number of elements
+         * \param cellSize minimum size of the cells
+         */
+        void build(const Positions& coors, size_t n, Scalar cellSize);
+
+        //! call f(i,j) once for each unordered pair of elements in the same or adjacent cells
+        template<typename Func>
+        void forEachPair(Func f) const;
+
+        size_t noOfCells() const { return _CellStart.empty() ? 0 : _CellStart.size()-1; }
+
+        const std::array<int,3>&   getDimensions() const { return _Dims; }
+
+        Scalar                     getCellSize()   const { return _CellSize; }
+
+        const std::vector<size_t>& getCellStart()  const { return _CellStart; }
+
+        const std::vector<size_t>& getSorted()     const { return _Sorted; }
+
+    private:
+
+        size_t cellIndex(int ix, int iy, int iz) const { return ( size_t(iz)*_Dims[1] + iy )*_Dims[0] + ix; }
+
+        std::array<Scalar,3> _Min;
+        Scalar               _CellSize;
+        std::array<int,3>    _Dims;
+
+        std::vector<size_t>  _CellStart;   //!< first element of each cell in _Sorted (noOfCells+1)
+        std::vector<size_t>  _Sorted;      //!< elements sorted by cell
+        std::vector<size_t>  _CellOf;      //!< cell of each element
+    };
+
+    /** \class VerletList
+     *
+     * \brief Verlet list of the pairs closer than cutoff+skin
+     *
+     * The list is built from a CellList with cells of size cutoff+skin, and stored as a
+     * half list: each unordered pair (i,j), i<j, is stored once, in the neighbors of i
+     * (getNeighbors()[getOffsets()[i] .. getOffsets()[i+1])). \n
+     * update() rebuilds the list only when the elements have moved enough for a pair
+     * initially farther than cutoff+skin to be closer than cutoff: the sum of the two
+     * largest displacements since the last build exceeds the skin.
+     */
+    template<
+    typename Scalar    = double,
+    typename Vector    = std::vector<Scalar>,
+    typename Positions = std::tuple<Vector&,Vector&,Vector&>
+    >
+    class VerletList {
+
+    public:
+
+        /** \brief constructor
+         *
+         * \param cutoff interaction cutoff
+         * \param skin additional distance covered by the list
+         */
+        VerletList(Scalar cutoff, Scalar skin);
+
+        //! rebuild the list if needed, return true if rebuilt
+        bool update(const Positions& coors, size_t n);
+
+        //! rebuild the list
+        void build(const Positions& coors, size_t n);
+
+        //! true if the elements have moved by more than the skin since the last build
+        bool needsRebuild(const Positions& coors, size_t n) const;
+
+        void setCutoff(Scalar cutoff, Scalar skin) { _Cutoff = cutoff; _Skin = skin; _X0.clear(); }
+
+        Scalar getCutoff() const { return _Cutoff; }
+
+        Scalar getSkin()   const { return _Skin; }
+
+        size_t noOfElements() const { return _X0.size(); }
+
+        size_t noOfPairs()    const { return _Neighbors.size(); }
+
+        size_t noOfBuilds()   const { return _nBuilds; }
+
+        //! squared distance of the position (x,y,z) of the element i to its position at the last build
+        Scalar displacement2(size_t i, Scalar x, Scalar y, Scalar z) const {
+            Scalar dx = x-_X0[i], dy = y-_Y0[i], dz = z-_Z0[i];
+            return dx*dx + dy*dy + dz*dz;
+        }
+
+        const std::vector<size_t>& getOffsets()   const { return _Offsets; }
+
+        const std::vector<size_t>& getNeighbors() const { return _Neighbors; }
+
+    private:
+
+        VerletList();
+
+        Scalar _Cutoff;
+        Scalar _Skin;
+        size_t _nBuilds;
+
+        CellList<Scalar,Vector,Positions> _Cells;
+
+        std::vector<Scalar> _X0, _Y0, _Z0;     //!< positions at the last build
+
+        std::vector<size_t> _Offsets;           //!< first neighbor of each element (n+1)
+        std::vector<size_t> _Neighbors;
+        std::vector<std::pair<size_t,size_t>> _Pairs;
+    };
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    inline
+    void CellList<Scalar,Vector,Positions>::build(const Positions& coors, size_t n, Scalar cellSize) {
+
+        ATOMISM_EXCEPT_IF( [&](){ return !( cellSize > 0 ); } );
+
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+
+        std::array<Scalar,3> max;
+        _Min.fill(0); max.fill(0);
+        if( n ) { _Min = {{ x[0], y[0], z[0] }}; max = _Min; }
+
+        bool finite = true;
+        for( size_t i=0; i<n; i++) {
+
+            finite = finite && std::isfinite(x[i]) && std::isfinite(y[i]) && std::isfinite(z[i]);
+            _Min[0] = std::min( _Min[0], x[i] ); max[0] = std::max( max[0], x[i] );
+            _Min[1] = std::min( _Min[1], y[i] ); max[1] = std::max( max[1], y[i] );
+            _Min[2] = std::min( _Min[2], z[i] ); max[2] = std::max( max[2], z[i] );
+        }
+        // NaN or infinite positions, or a bounding box too large to be represented
+        ATOMISM_EXCEPT_IF( [&](){ return !finite; } );
+        ATOMISM_EXCEPT_IF( [&](){ return !std::isfinite( max[0]-_Min[0] ) || !std::isfinite( max[1]-_Min[1] )
+                                      || !std::isfinite( max[2]-_Min[2] ); } );
+
+        // enlarge the cells of sparse systems: at most ~8 cells per element. The numbers
+        // of cells are computed in double, and converted to int once bounded by maxCells
+        _CellSize = cellSize;
+        double maxCells = 8. * std::max<size_t>( n, 1 );
+        std::array<double,3> dims;
+
+        while( 1 ) {
+
+            double nCells = 1;
+            for( int k=0; k<3; k++) {
+
+                dims[k] = std::max( 1., std::floor( ( max[k]-_Min[k] ) / _CellSize ) );
+                nCells *= dims[k];
+            }
+            if( nCells <= maxCells ) break;
+            _CellSize *= std::max( 1.01, std::cbrt( nCells / maxCells ) );
+        }
+        for( int k=0; k<3; k++) _Dims[k] = int( dims[k] );
+
+        // counting sort of the elements by cell
+        size_t nCells = size_t(_Dims[0]) * _Dims[1] * _Dims[2];
+
+        _CellStart.assign( nCells+1, 0 );
+        _CellOf.resize(n);
+        _Sorted.resize(n);
+
+        for( size_t i=0; i<n; i++) {
+
+            // the last cell of each direction extends to the bounding box
+            int ix = int( std::min( dims[0]-1, ( x[i]-_Min[0] ) / _CellSize ) );
+            int iy = int( std::min( dims[1]-1, ( y[i]-_Min[1] ) / _CellSize ) );
+            int iz = int( std::min( dims[2]-1, ( z[i]-_Min[2] ) / _CellSize ) );
+
+            _CellOf[i] = cellIndex(ix,iy,iz);
+            _CellStart[ _CellOf[i]+1 ]++;
+        }
+        for( size_t c=0; c<nCells; c++) _CellStart[c+1] += _CellStart[c];
+
+        std::vector<size_t> fill( _CellStart.begin(), _CellStart.end()-1 );
+        for( size_t i=0; i<n; i++) _Sorted[ fill[_CellOf[i]]++ ] = i;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    template<typename Func>
+    inline
+    void CellList<Scalar,Vector,Positions>::forEachPair(Func f) const {
+
+        // half shell: the 13 neighbor cells 'after' the current one, and the cell itself
+        static const int shell[13][3] = {
+            {1,0,0}, {-1,1,0}, {0,1,0}, {1,1,0},
+            {-1,-1,1}, {0,-1,1}, {1,-1,1}, {-1,0,1}, {0,0,1}, {1,0,1}, {-1,1,1}, {0,1,1}, {1,1,1} };
+
+        for( int iz=0; iz<_Dims[2]; iz++)
+            for( int iy=0; iy<_Dims[1]; iy++)
+                for( int ix=0; ix<_Dims[0]; ix++) {
+
+                    size_t c = cellIndex(ix,iy,iz);
+                    size_t begin = _CellStart[c], end = _CellStart[c+1];
+
+                    for( size_t a=begin; a<end; a++)
+                        for( size_t b=a+1; b<end; b++) f( _Sorted[a], _Sorted[b] );
+
+                    for( int s=0; s<13; s++) {
+
+                        int jx = ix+shell[s][0], jy = iy+shell[s][1], jz = iz+shell[s][2];
+                        if( jx<0 || jy<0 || jx>=_Dims[0] || jy>=_Dims[1] || jz>=_Dims[2] ) continue;
+
+                        size_t d = cellIndex(jx,jy,jz);
+                        for( size_t a=begin; a<end; a++)
+                            for( size_t b=_CellStart[d]; b<_CellStart[d+1]; b++) f( _Sorted[a], _Sorted[b] );
+                    }
+                }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    inline
+    VerletList<Scalar,Vector,Positions>::VerletList(Scalar cutoff, Scalar skin)
+    : _Cutoff(cutoff), _Skin(skin), _nBuilds(0) {
+
+        ATOMISM_EXCEPT_IF( [&](){ return !( cutoff > 0 ) || ( skin < 0 ); } );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    inline
+    bool VerletList<Scalar,Vector,Positions>::update(const Positions& coors, size_t n) {
+
+        if( !needsRebuild(coors,n) ) return 0;
+
+        build(coors,n);
+        return 1;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    inline
+    bool VerletList<Scalar,Vector,Positions>::needsRebuild(const Positions& coors, size_t n) const {
+
+        if( n != _X0.size() || _Offsets.size() != n+1 ) return 1;
+
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+
+        // two largest displacements: a pair can not have approached by more than their sum
+        Scalar d1 = 0, d2 = 0;
+        for( size_t i=0; i<n; i++) {
+
+            Scalar dx = x[i]-_X0[i], dy = y[i]-_Y0[i], dz = z[i]-_Z0[i];
+            Scalar d  = dx*dx + dy*dy + dz*dz;
+
+            if( d > d1 )      { d2 = d1; d1 = d; }
+            else if( d > d2 ) d2 = d;
+        }
+        return std::sqrt(d1) + std::sqrt(d2) > _Skin;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<typename Scalar, typename Vector, typename Positions>
+    inline
+    void VerletList<Scalar,Vector,Positions>::build(const Positions& coors, size_t n) {
+
+        ATOMISM_LOG();
+
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+
+        Scalar rlist  = _Cutoff + _Skin;
+        Scalar rlist2 = rlist * rlist;
+
+        _Cells.build(coors, n, rlist);
+
+        _Pairs.clear();
+        _Cells.forEachPair( [&](size_t i, size_t j) {
+
+            Scalar dx = x[i]-x[j], dy = y[i]-y[j], dz = z[i]-z[j];
+            if( dx*dx + dy*dy + dz*dz < rlist2 ) _Pairs.push_back( std::make_pair( std::min(i,j), std::max(i,j) ) );
+        });
+
+        // compressed rows, sorted by first element
+        _Offsets.assign( n+1, 0 );
+        for( auto& p : _Pairs ) _Offsets[p.first+1]++;
+        for( size_t i=0; i<n; i++) _Offsets[i+1] += _Offsets[i];
+
+        _Neighbors.resize( _Pairs.size() );
+        std::vector<size_t> fill( _Offsets.begin(), _Offsets.end()-1 );
+        for( auto& p : _Pairs ) _Neighbors[ fill[p.first]++ ] = p.second;
+
+        // neighbors in increasing order, for a better locality of the evaluation
+        for( size_t i=0; i<n; i++) std::sort( _Neighbors.begin()+_Offsets[i], _Neighbors.begin()+_Offsets[i+1] );
+
+        _X0.assign( x.begin(), x.begin()+n );
+        _Y0.assign( y.begin(), y.begin()+n );
+        _Z0.assign( z.begin(), z.begin()+n );
+        _nBuilds++;
+    }
+}
+#endif // NEIGHBORLIST_H
@@ -17,97 +17,1006 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-//! \file Entity.h definition of the class Entity, msVectorOfDofs, and msVectorOfPtrDof and msKineticWork
+//! \file PairForceField.h Potential energy surface defined by a pair interaction between the elements
 
-#ifndef SCALARFUNCTION_H
-#define SCALARFUNCTION_H
+#ifndef PAIRFORCEFIELD_H
+#define PAIRFORCEFIELD_H
 
+#include <PotentialEnergySurface.h>
+#include <NeighborList.h>
+#include <PairParameters.h>
+#include <PairTable.h>
+#include <PairKernel.h>
+#include <ThreadPool.h>
+#include <mutex>
+
+#ifdef ATOMISM_USE_VEXCL
+#include <vexcl/vexcl.hpp>
+#endif
 
 namespace atomism {
     
-    /** \class Balls
+    /** \class PairForceField
+     *
+     * \brief Lennard-Jones interaction between the elements of an entity
+     *
+     * \f$ U = \sum_{i<j, r_{ij}<r_c} 4\epsilon_{ij} \left[ (\sigma_{ij}/r_{ij})^{12} - (\sigma_{ij}/r_{ij})^6 \right] \f$
      *
-     * \brief An assembly of elements that move on the surface of a sphere.
+     * Each element has a type; the coefficients \f$ 4\epsilon\sigma^{12} \f$ and
+     * \f$ 4\epsilon\sigma^6 \f$ of each pair of types are taken from a PairParameters
+     * table, so the pair loop computes \f$ C_{12} r^{-12} - C_6 r^{-6} \f$ from \f$ 1/r^2 \f$ only;
+     * the loop over the neighbors of an element is done by PairKernel (AVX2/AVX-512 in double
+     * precision, selected at run time). The last bits of the energy and of the forces depend
+     * on the instruction set; PairKernel::setIsa(PairKernel::Generic) gives the same results
+     * on all the processors. \n
+     * In the tabulated mode (see tabulate and setTable), the potential of each pair of types
+     * is read from a PairTable indexed by \f$ r^2 \f$: any radial potential (Buckingham, Morse,
+     * numerical data) then costs the same as the Lennard-Jones one. \n
+     * The pairs closer than the cutoff are found with a Verlet list (see VerletList):
+     * the list covers the distance cutoff+skin and is rebuilt, from a linked cell grid,
+     * only when the elements have moved by more than the skin since the last build.
+     * Successive evaluations at close configurations (time steps, finite differences)
+     * reuse the same list, and each evaluation is O(N). \n
+     * The list holds each unordered pair once (third law of Newton). With setNoOfThreads(n),
+     * the pairs are split in n tiles of contiguous rows holding the same number of pairs;
+     * each tile is reduced in its own accumulator, and the accumulators are combined in
+     * the order of the tiles: the result does not depend on the scheduling of the threads. \n
+     * evaluateWithForces accumulates the cartesian forces in the same pair loop as the
+     * energy (per tile buffers, combined in the same order), and projects them on the
+     * active DoFs through the jacobian of the entity. \n
+     * For Monte Carlo, beginMoves / trialMove / commitMove / rejectMove give the energy change
+     * of a displacement of a few elements: only the pairs of the moved elements are recomputed,
+     * from a full neighbor list derived from the Verlet list (O(1) per moved element). \n
+     * The list is shared by the evaluations and protected by a mutex.
      */
-	template<
-    typename ScalarType         = double,
-    typename StateType          = std::vector<ScalarType>
+    template<
+    typename TheEntity,
+    typename Scalar      = double,
+    typename Vector      = std::vector<Scalar>,
+    typename Matrix      = std::vector< std::vector<Scalar> >,
+    typename Positions   = std::tuple<Vector&,Vector&,Vector&>
     >
-    class PairForceField : public PotentialEnergySurface<ScalarType,StateType,PairForceField> {
+    class PairForceField : public PotentialEnergySurface<
+    TheEntity, PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>,
+    Scalar, Vector, Matrix, Positions > {
         
+        typedef PotentialEnergySurface<
+        TheEntity, PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>,
+        Scalar, Vector, Matrix, Positions >  Base;
         
     public:
         
-        ScalarType evaluate(const StateType& q, const Environment& env) const;
+        typedef typename Base::ConstPositions ConstPositions;
+        
+        /** \brief constructor, all the elements being of the same type
+         *
+         * \param entity entity
+         * \param resource resource manager
+         * \param cutoff cutoff of the interaction [m]
+         * \param skin skin of the Verlet list [m]
+         * \param epsilon depth of the potential well [J]
+         * \param sigma distance of zero potential [m]
+         */
+        PairForceField( std::shared_ptr<const TheEntity> entity ,
+                        std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                        Scalar cutoff  = 1e-9,
+                        Scalar skin    = 0.1e-9,
+                        Scalar epsilon = 1.08e-21,
+                        Scalar sigma   = 0.32e-9
+                       );
+        
+        /** \brief constructor, for typed elements
+         *
+         * \param entity entity
+         * \param resource resource manager
+         * \param parameters parameters of the pairs of types
+         * \param types type of each element (size noOfElements)
+         * \param cutoff cutoff of the interaction [m]
+         * \param skin skin of the Verlet list [m]
+         */
+        PairForceField( std::shared_ptr<const TheEntity> entity ,
+                        std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                        const PairParameters<Scalar>& parameters,
+                        const std::vector<size_t>& types,
+                        Scalar cutoff  = 1e-9,
+                        Scalar skin    = 0.1e-9
+                       );
+        
+        using Base::evaluate;
+        
+        //! interaction energy at the positions coors of the coordinates q
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const ConstPositions& coors) const;
+        
+        /** \brief energy and generalized forces in one pass
+         *
+         * \f$ Q_k = -\partial U/\partial q_k = \sum_i \vec F_i . \partial \vec r_i/\partial q_k \f$,
+         * the derivatives of the positions being the rows of the jacobian of the entity
+         * (steps q.getdqs()). The forces of the frozen DoFs are set to 0.
+         * \param q generalized coordinates
+         * \param coors positions of the elements at q
+         * \param forces output: generalized forces (size noOfDofs)
+         * \return potential energy
+         */
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  const ConstPositions& coors,
+                                  Vector& forces) const;
+        
+        //! same as above, the positions being computed by the entity
+        Scalar evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                                  Vector& forces) const;
+        
+        /** \brief energy and cartesian forces on the elements in one pass
+         *
+         * \param coors positions of the elements
+         * \param forces output: force on each element (size noOfElements)
+         * \return potential energy
+         */
+        Scalar computeCartesianForces(const ConstPositions& coors, Positions& forces) const;
+        
+#ifdef ATOMISM_USE_VEXCL
+        //! interaction energy computed on the device (analytical potential), all the pairs being tested (O(N^2))
+        Scalar evaluateDevice(const vex::vector<double>& x,
+                              const vex::vector<double>& y,
+                              const vex::vector<double>& z) const;
+#endif
+        
+        Scalar getCutoff()  const { return _Cutoff; }
+        
+        const PairParameters<Scalar>& getParameters() const { return _Parameters; }
+        
+        const std::vector<unsigned>& getTypes() const { return _Types; }
+        
+        /** \brief switch to the tabulated mode
+         *
+         * The Lennard-Jones potential of each pair of types is tabulated from rmin to the cutoff.
+         * \param rmin smallest distance of the tables
+         * \param nPoints number of points of the tables
+         */
+        void tabulate(Scalar rmin, size_t nPoints = 4096);
+        
+        /** \brief set the table of the pair of types (a,b), in the tabulated mode
+         *
+         * The table has to cover the distances up to the cutoff.
+         */
+        void setTable(size_t a, size_t b, std::shared_ptr<const PairTable<Scalar>> table);
+        
+        //! back to the analytical Lennard-Jones potential
+        void clearTables() {
+            std::lock_guard<std::mutex> lock(_NeighborsMutex);
+            _Tables.clear();
+        }
+        
+        bool isTabulated() const { return !_Tables.empty(); }
+        
+        //! number of builds of the Verlet list
+        size_t noOfNeighborBuilds() const { return _Neighbors.noOfBuilds(); }
+        
+        /** \brief distribute the pairs over n threads
+         *
+         * The Logger must not be active during the evaluations (see ThreadPool).
+         * \param n number of threads, including the calling one; 1 for a serial evaluation
+         */
+        void setNoOfThreads(size_t n);
+        
+        size_t getNoOfThreads() const { return _Pool ? _Pool->noOfWorkers() : 1; }
+        
+        //! @name incremental evaluation
+        //@{
+            /** \brief start a sequence of moves from the positions coors
+             *
+             * \return energy of the reference state
+             */
+        Scalar beginMoves(const ConstPositions& coors);
+        
+            /** \brief energy change of a trial move
+             *
+             * The elements 'moved' go to their positions in 'trial' (the positions of the
+             * other elements are not read). Only the pairs involving a moved element are
+             * computed; if a moved element leaves the range of the Verlet list, its pairs
+             * are computed against all the elements.
+             * \param moved indices of the moved elements
+             * \param trial trial positions
+             * \return energy(trial) - energy(reference)
+             */
+        Scalar trialMove(const std::vector<size_t>& moved, const ConstPositions& trial);
+        
+            /** \brief energy change of a trial move in generalized coordinates
+             *
+             * The positions of q are computed by the entity. The entity gives no dependency
+             * pattern of its DoFs: the caller, which knows the DoFs it changed, gives the
+             * elements they move (the positions of the other elements are not read).
+             * \param moved indices of the moved elements
+             * \param q trial generalized coordinates
+             */
+        Scalar trialMove(const std::vector<size_t>& moved,
+                         const GeneralizedCoordinates<Scalar,Vector>& q);
+        
+        //! the trial state becomes the reference
+        void commitMove();
+        
+        //! discard the trial state
+        void rejectMove();
+        
+        //! energy of the reference state
+        Scalar getReferenceEnergy() const { return _RefEnergy; }
+        //@}
         
     private:
         
         PairForceField();
         
-        boost::shared_ptr<Entity> _Entity;
+        /** \brief energy of the pairs of the rows [first,last) of the Verlet list
+         *
+         * If WithForces, the forces are added to fx, fy, fz.
+         */
+        template<bool WithForces, bool Tabulated>
+        Scalar computePairs(size_t first, size_t last, const ConstPositions& coors,
+                            Scalar* fx, Scalar* fy, Scalar* fz) const;
+        
+        //! computePairs in the analytical or the tabulated mode
+        template<bool WithForces>
+        Scalar computeRows(size_t first, size_t last, const ConstPositions& coors,
+                           Scalar* fx, Scalar* fy, Scalar* fz) const {
+            return _Tables.empty() ? computePairs<WithForces,false>( first, last, coors, fx, fy, fz )
+                                   : computePairs<WithForces,true>( first, last, coors, fx, fy, fz );
+        }
+        
+        //! energy, and forces if fx != 0, of all the pairs (see computePairs)
+        Scalar accumulate(const ConstPositions& coors, Scalar* fx, Scalar* fy, Scalar* fz) const;
+        
+        //! split the rows of the Verlet list in tiles of the same number of pairs
+        void computeTiles() const;
+        
+        //! energy of the pair (i,j) at the squared distance r2
+        Scalar pairEnergy(size_t i, size_t j, Scalar r2) const;
+        
+        //! energy of the pairs involving a moved element, at the reference or at the trial positions
+        Scalar movedEnergy(bool trial, bool allPairs) const;
+        
+        //! full neighbor list (both directions) of the Verlet list, built at the reference positions
+        void buildAdjacency();
+        
+        //! below this number of pairs, the evaluation is serial
+        static const size_t _MinPairsPerThread = 2048;
+        
+        Scalar _Cutoff;
+        
+        PairParameters<Scalar> _Parameters;
+        std::vector<unsigned>  _Types;       //!< type of each element
+        
+        //! table of each pair of types (noOfTypes^2), empty in the analytical mode
+        std::vector<std::shared_ptr<const PairTable<Scalar>>> _Tables;
+        
+        mutable VerletList<Scalar,Vector,ConstPositions> _Neighbors;
+        mutable std::mutex                          _NeighborsMutex;
+        
+        std::shared_ptr<ThreadPool> _Pool;          //!< 0 if the evaluation is serial
+        mutable std::vector<size_t> _Tiles;         //!< first row of each tile (noOfTiles+1)
+        mutable size_t              _TilesBuild;    //!< build of the Verlet list of the tiles
+        mutable std::vector<Scalar> _TileEnergies;  //!< accumulator of each tile
+        mutable std::vector<Scalar> _TileForces;    //!< forces of the tiles 1..noOfTiles-1 (3n each)
+        
+        Vector              _RefX, _RefY, _RefZ;    //!< reference positions of the incremental evaluation
+        Scalar              _RefEnergy;
+        std::vector<size_t> _AdjacencyOffsets;
+        std::vector<size_t> _Adjacency;
+        size_t              _AdjacencyBuild;        //!< build of the Verlet list of the adjacency
+        
+        std::vector<size_t> _MovedList;             //!< elements moved by the trial move
+        std::vector<size_t> _MovedIndex;            //!< 1 + index in _MovedList, 0 if not moved
+        std::vector<Scalar> _TrialX, _TrialY, _TrialZ;
+        Scalar              _TrialDelta;
     };
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
-	template<
-    typename ScalarType         = double,
-    typename StateType          = std::vector<ScalarType>,
-    class DerivedClass
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::PairForceField( std::shared_ptr<const TheEntity> entity ,
+                      std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                      Scalar cutoff, Scalar skin, Scalar epsilon, Scalar sigma)
+    : Base(entity,resource), _Cutoff(cutoff), _Types(entity->noOfElements(),0), _Neighbors(cutoff,skin),
+      _TilesBuild(0), _RefEnergy(0), _AdjacencyBuild(0), _TrialDelta(0) {
+        
+        ATOMISM_LOG();
+        _Parameters.addType(epsilon,sigma);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::PairForceField( std::shared_ptr<const TheEntity> entity ,
+                      std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource,
+                      const PairParameters<Scalar>& parameters,
+                      const std::vector<size_t>& types,
+                      Scalar cutoff, Scalar skin)
+    : Base(entity,resource), _Cutoff(cutoff), _Parameters(parameters), _Types(types.begin(),types.end()),
+      _Neighbors(cutoff,skin), _TilesBuild(0), _RefEnergy(0), _AdjacencyBuild(0), _TrialDelta(0) {
+        
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return entity->noOfElements();},
+                                [&](){return types.size();} );
+        ATOMISM_EXCEPT_IF( [&](){
+            for( size_t type : types ) if( type >= parameters.noOfTypes() ) return true;
+            return false;
+        } );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        
+        return accumulate( coors, 0, 0, 0 );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeCartesianForces(const ConstPositions& coors, Positions& forces) const {
+        
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return n_elements(std::get<0>(coors));},
+                                [&](){return n_elements(std::get<0>(forces));});
+        
+        if( n_elements(std::get<0>(coors)) == 0 ) return 0;
+        
+        return accumulate( coors, &std::get<0>(forces)[0], &std::get<1>(forces)[0], &std::get<2>(forces)[0] );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
     >
     inline
-    PairForceField::PairForceField( boost::shared_ptr<Entity> entity)
-        , PotentialEnergySurface(entity) {
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+                         const ConstPositions& coors,
+                         Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        auto cartesian = this->_ResourceMngr->requestPositions( this->getEntity()->noOfElements() );
+        Scalar energy  = computeCartesianForces( coors, *cartesian );
+        
+        this->projectForces( q, coors, *cartesian, forces );
+        return energy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
     
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateWithForces(const GeneralizedCoordinates<Scalar,Vector>& q, Vector& forces) const {
+        
+        ATOMISM_LOG();
+        
+        auto coordinates = this->getEntity()->getCoordinates(q);
+        return evaluateWithForces(q,coordinates->getPositions(),forces);
     }
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
     
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::accumulate(const ConstPositions& coors, Scalar* fx, Scalar* fy, Scalar* fz) const {
+        
+        size_t n = n_elements( std::get<0>(coors) );
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        // the list may also have been rebuilt by the incremental evaluation (see beginMoves)
+        _Neighbors.update(coors,n);
+        if( _Tiles.empty() || _TilesBuild != _Neighbors.noOfBuilds() ) computeTiles();
+        
+        size_t nTiles = _Tiles.size()-1;
+        
+        if( fx ) {
+            
+            std::fill( fx, fx+n, Scalar(0) );
+            std::fill( fy, fy+n, Scalar(0) );
+            std::fill( fz, fz+n, Scalar(0) );
+        }
+        
+        Scalar sum = 0;
+        
+        if( nTiles == 1 ) {
+            
+            sum = fx ? computeRows<true>( 0, n, coors, fx, fy, fz )
+                     : computeRows<false>( 0, n, coors, 0, 0, 0 );
+        }
+        else {
+            
+            // the tile 0 writes in the output, the others in their own buffers
+            if( fx ) _TileForces.assign( 3*n*(nTiles-1), Scalar(0) );
+            
+            _Pool->parallelFor( nTiles, [&](size_t tile, size_t) {
+                
+                if( !fx ) {
+                    _TileEnergies[tile] = computeRows<false>( _Tiles[tile], _Tiles[tile+1], coors, 0, 0, 0 );
+                    return;
+                }
+                Scalar* f = tile ? &_TileForces[3*n*(tile-1)] : 0;
+                
+                _TileEnergies[tile] = tile ? computeRows<true>( _Tiles[tile], _Tiles[tile+1], coors, f, f+n, f+2*n )
+                                           : computeRows<true>( _Tiles[tile], _Tiles[tile+1], coors, fx, fy, fz );
+            });
+            
+            for( size_t tile=0; tile<nTiles; tile++) sum += _TileEnergies[tile];
+            
+            if( fx ) {
+                
+                for( size_t tile=1; tile<nTiles; tile++) {
+                    
+                    const Scalar* f = &_TileForces[3*n*(tile-1)];
+                    for( size_t i=0; i<n; i++) { fx[i] += f[i]; fy[i] += f[n+i]; fz[i] += f[2*n+i]; }
+                }
+            }
+        }
+        
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    template<bool WithForces, bool Tabulated>
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computePairs(size_t first, size_t last, const ConstPositions& coors,
+                   Scalar* fx, Scalar* fy, Scalar* fz) const {
+        
+        const Vector& x = std::get<0>(coors);
+        const Vector& y = std::get<1>(coors);
+        const Vector& z = std::get<2>(coors);
+        
+        const std::vector<size_t>& offsets   = _Neighbors.getOffsets();
+        const std::vector<size_t>& neighbors = _Neighbors.getNeighbors();
+        
+        size_t         nTypes = _Parameters.noOfTypes();
+        const Scalar*  C12    = &_Parameters.getC12()[0];
+        const Scalar*  C6     = &_Parameters.getC6()[0];
+        const unsigned* types = &_Types[0];
+        
+        Scalar rc2 = _Cutoff * _Cutoff;
+        Scalar sum = 0;
+        
+        for( size_t i=first; i<last; i++) {
+            
+            Scalar X = x[i], Y = y[i], Z = z[i];
+            Scalar FX = 0, FY = 0, FZ = 0;
+            
+            // coefficients of the type of i with all the types
+            const Scalar* c12 = C12 + types[i]*nTypes;
+            const Scalar* c6  = C6  + types[i]*nTypes;
+            
+            if( !Tabulated ) {
+                
+                sum += PairKernel::row( &x[0], &y[0], &z[0], neighbors.data()+offsets[i], offsets[i+1]-offsets[i],
+                                        X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ );
+                
+                if( WithForces ) { fx[i] += FX; fy[i] += FY; fz[i] += FZ; }
+                continue;
+            }
+            
+            const std::shared_ptr<const PairTable<Scalar>>* tables = &_Tables[types[i]*nTypes];
+            
+            for( size_t k=offsets[i]; k<offsets[i+1]; k++) {
+                
+                size_t j  = neighbors[k];
+                Scalar dx = x[j]-X, dy = y[j]-Y, dz = z[j]-Z;
+                Scalar r2 = dx*dx + dy*dy + dz*dz;
+                
+                if( r2 >= rc2 ) continue;
+                
+                // F_i = -dU/dr_i = f (r_j - r_i), f = 2 dU/dr^2, F_j = -F_i
+                Scalar f = 0;
+                
+                const PairTable<Scalar>& table = *tables[types[j]];
+                sum += WithForces ? table.evaluate(r2,f) : table.energy(r2);
+                
+                if( WithForces ) {
+                    
+                    FX += f*dx; FY += f*dy; FZ += f*dz;
+                    fx[j] -= f*dx; fy[j] -= f*dy; fz[j] -= f*dz;
+                }
+            }
+            if( WithForces ) { fx[i] += FX; fy[i] += FY; fz[i] += FZ; }
+        }
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::computeTiles() const {
+        
+        const std::vector<size_t>& offsets = _Neighbors.getOffsets();
+        
+        size_t n      = offsets.size()-1;
+        size_t nPairs = offsets.back();
+        size_t nTiles = std::max<size_t>( 1, std::min( getNoOfThreads(), nPairs / _MinPairsPerThread ) );
+        
+        // the tile t starts at the first row holding the pair t*nPairs/nTiles
+        _Tiles.assign( nTiles+1, n );
+        _Tiles[0] = 0;
+        for( size_t t=1; t<nTiles; t++)
+            _Tiles[t] = std::upper_bound( offsets.begin(), offsets.end(), t*nPairs/nTiles ) - offsets.begin() - 1;
+        
+        _TileEnergies.assign( nTiles, 0 );
+        _TileForces.clear();
+        _TilesBuild = _Neighbors.noOfBuilds();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::beginMoves(const ConstPositions& coors) {
+        
+        ATOMISM_LOG();
+        
+        size_t n = n_elements( std::get<0>(coors) );
+        
+        _RefEnergy = n ? accumulate( coors, 0, 0, 0 ) : 0;
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        _RefX = std::get<0>(coors);
+        _RefY = std::get<1>(coors);
+        _RefZ = std::get<2>(coors);
+        
+        _MovedList.clear();
+        _MovedIndex.assign( n, 0 );
+        _TrialDelta = 0;
+        
+        // trialMove and commitMove need every element within skin/2 of the positions of the
+        // build, which the displacement criterion of the evaluation does not ensure
+        Scalar halfSkin2 = _Neighbors.getSkin() * _Neighbors.getSkin() / 4;
+        bool   rebuild   = _Neighbors.needsRebuild(coors,n);
+        
+        for( size_t i=0; i<n && !rebuild; i++)
+            if( _Neighbors.displacement2(i,_RefX[i],_RefY[i],_RefZ[i]) > halfSkin2 ) rebuild = true;
+        
+        if( rebuild ) _Neighbors.build(coors,n);
+        
+        buildAdjacency();
+        return _RefEnergy;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::trialMove(const std::vector<size_t>& moved, const ConstPositions& trial) {
+        
+        ATOMISM_LOG();
+        
+        size_t n = n_elements(_RefX);
+        
+        ATOMISM_EXCEPT_IF( [&](){ return _MovedIndex.size() != n; } );   // beginMoves not called
+        ATOMISM_EXCEPT_IF( [&](){ for( size_t i : moved ) if( i >= n ) return true; return false; } );
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        // the Verlet list has been rebuilt by an evaluation at other positions
+        if( _Neighbors.noOfBuilds() != _AdjacencyBuild ) {
+            
+            ConstPositions ref(_RefX,_RefY,_RefZ);
+            _Neighbors.build(ref,n);
+            buildAdjacency();
+        }
+        
+        for( size_t i : _MovedList ) _MovedIndex[i] = 0;
+        _MovedList.clear(); _TrialX.clear(); _TrialY.clear(); _TrialZ.clear();
+        
+        Scalar halfSkin2 = _Neighbors.getSkin() * _Neighbors.getSkin() / 4;
+        bool   allPairs  = false;
+        
+        for( size_t i : moved ) {
+            
+            if( _MovedIndex[i] ) continue;
+            
+            Scalar x = std::get<0>(trial)[i], y = std::get<1>(trial)[i], z = std::get<2>(trial)[i];
+            
+            _MovedList.push_back(i);
+            _MovedIndex[i] = _MovedList.size();
+            _TrialX.push_back(x); _TrialY.push_back(y); _TrialZ.push_back(z);
+            
+            if( _Neighbors.displacement2(i,x,y,z) > halfSkin2 ) allPairs = true;
+        }
+        
+        _TrialDelta = movedEnergy(true,allPairs) - movedEnergy(false,false);
+        return _TrialDelta;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::trialMove(const std::vector<size_t>& moved,
+                const GeneralizedCoordinates<Scalar,Vector>& q) {
+        
+        ATOMISM_LOG();
+        
+        auto coordinates = this->getEntity()->getCoordinates(q);
+        ConstPositions coors = coordinates->getPositions();
+        
+        return trialMove(moved,coors);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::commitMove() {
+        
+        ATOMISM_LOG();
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        Scalar halfSkin2 = _Neighbors.getSkin() * _Neighbors.getSkin() / 4;
+        bool   rebuild   = false;
+        
+        for( size_t k=0; k<_MovedList.size(); k++) {
+            
+            size_t i = _MovedList[k];
+            
+            _RefX[i] = _TrialX[k]; _RefY[i] = _TrialY[k]; _RefZ[i] = _TrialZ[k];
+            _MovedIndex[i] = 0;
+            
+            if( _Neighbors.displacement2(i,_RefX[i],_RefY[i],_RefZ[i]) > halfSkin2 ) rebuild = true;
+        }
+        _RefEnergy += _TrialDelta;
+        _TrialDelta = 0;
+        _MovedList.clear();
+        
+        // all the reference positions stay within skin/2 of the positions of the build
+        if( rebuild ) {
+            
+            ConstPositions ref(_RefX,_RefY,_RefZ);
+            _Neighbors.build( ref, n_elements(_RefX) );
+            buildAdjacency();
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::rejectMove() {
+        
+        ATOMISM_LOG();
+        
+        for( size_t i : _MovedList ) _MovedIndex[i] = 0;
+        _MovedList.clear();
+        _TrialDelta = 0;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::pairEnergy(size_t i, size_t j, Scalar r2) const {
+        
+        if( r2 >= _Cutoff*_Cutoff ) return 0;
+        
+        size_t nTypes = _Parameters.noOfTypes();
+        size_t pair   = _Types[i]*nTypes + _Types[j];
+        
+        if( !_Tables.empty() ) return _Tables[pair]->energy(r2);
+        
+        Scalar i2 = 1 / r2;
+        Scalar i6 = i2*i2*i2;
+        return ( _Parameters.getC12()[pair]*i6 - _Parameters.getC6()[pair] ) * i6;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::movedEnergy(bool trial, bool allPairs) const {
+        
+        size_t n   = n_elements(_RefX);
+        Scalar sum = 0;
+        
+        for( size_t k=0; k<_MovedList.size(); k++) {
+            
+            size_t i = _MovedList[k];
+            
+            Scalar X = trial ? _TrialX[k] : _RefX[i];
+            Scalar Y = trial ? _TrialY[k] : _RefY[i];
+            Scalar Z = trial ? _TrialZ[k] : _RefZ[i];
+            
+            size_t first = allPairs ? 0 : _AdjacencyOffsets[i];
+            size_t last  = allPairs ? n : _AdjacencyOffsets[i+1];
+            
+            for( size_t l=first; l<last; l++) {
+                
+                size_t j = allPairs ? l : _Adjacency[l];
+                size_t m = _MovedIndex[j];
+                
+                // the pairs of two moved elements are counted once
+                if( j == i || ( m && j < i ) ) continue;
+                
+                Scalar dx, dy, dz;
+                if( trial && m ) { dx = _TrialX[m-1]-X; dy = _TrialY[m-1]-Y; dz = _TrialZ[m-1]-Z; }
+                else             { dx = _RefX[j]-X;     dy = _RefY[j]-Y;     dz = _RefZ[j]-Z; }
+                
+                sum += pairEnergy( i, j, dx*dx + dy*dy + dz*dz );
+            }
+        }
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::buildAdjacency() {
+        
+        const std::vector<size_t>& offsets   = _Neighbors.getOffsets();
+        const std::vector<size_t>& neighbors = _Neighbors.getNeighbors();
+        
+        size_t n = offsets.empty() ? 0 : offsets.size()-1;
+        
+        _AdjacencyOffsets.assign( n+1, 0 );
+        for( size_t i=0; i<n; i++) {
+            
+            _AdjacencyOffsets[i+1] += offsets[i+1]-offsets[i];
+            for( size_t k=offsets[i]; k<offsets[i+1]; k++) _AdjacencyOffsets[ neighbors[k]+1 ]++;
+        }
+        for( size_t i=0; i<n; i++) _AdjacencyOffsets[i+1] += _AdjacencyOffsets[i];
+        
+        _Adjacency.resize( _AdjacencyOffsets[n] );
+        std::vector<size_t> fill( _AdjacencyOffsets.begin(), _AdjacencyOffsets.end()-1 );
+        
+        for( size_t i=0; i<n; i++)
+            for( size_t k=offsets[i]; k<offsets[i+1]; k++) {
+                
+                _Adjacency[ fill[i]++ ] = neighbors[k];
+                _Adjacency[ fill[neighbors[k]]++ ] = i;
+            }
+        _AdjacencyBuild = _Neighbors.noOfBuilds();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::tabulate(Scalar rmin, size_t nPoints) {
+        
+        ATOMISM_LOG();
+        
+        size_t nTypes = _Parameters.noOfTypes();
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        _Tables.assign( nTypes*nTypes, std::shared_ptr<const PairTable<Scalar>>() );
+        
+        for( size_t a=0; a<nTypes; a++)
+            for( size_t b=a; b<nTypes; b++) {
+                
+                Scalar c12 = _Parameters.getC12(a,b), c6 = _Parameters.getC6(a,b);
+                
+                auto table = std::make_shared<const PairTable<Scalar>>(
+                    [&](Scalar r){ Scalar i6 = 1/std::pow(r,6); return ( c12*i6 - c6 ) * i6; },
+                    rmin, _Cutoff, nPoints );
+                
+                _Tables[a*nTypes+b] = _Tables[b*nTypes+a] = table;
+            }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setTable(size_t a, size_t b, std::shared_ptr<const PairTable<Scalar>> table) {
+        
+        ATOMISM_LOG();
+        
+        size_t nTypes = _Parameters.noOfTypes();
+        
+        if( _Tables.empty() ) ATOMISM_THROW( "setTable: call tabulate first" );
+        
+        ATOMISM_EXCEPT_IF( [&](){ return !table || ( a >= nTypes ) || ( b >= nTypes ); } );
+        ATOMISM_EXCEPT_IF( [&](){ return table->getMaxDistance2() < _Cutoff*_Cutoff*( 1-1e-12 ); } );
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        _Tables[a*nTypes+b] = _Tables[b*nTypes+a] = table;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::setNoOfThreads(size_t n) {
+        
+        ATOMISM_LOG();
+        
+        std::lock_guard<std::mutex> lock(_NeighborsMutex);
+        
+        if( n <= 1 ) _Pool.reset();
+        else if( !_Pool || _Pool->noOfWorkers() != n ) _Pool = std::make_shared<ThreadPool>(n);
+        _Tiles.clear();
+    }
+    
+#ifdef ATOMISM_USE_VEXCL
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
     VEX_FUNCTION(computeInteractionEnergy,
-                 // size of the vector, index of the current element, x, y, z positions of the elements, and cutoff separation
-                 double(size_t, size_t, double*, double*, double*),
+                 // number of elements, index of the current element, x, y, z positions of the elements,
+                 // cutoff separation, types of the elements, C12 and C6 tables, number of types
+                 double(size_t, size_t, double*, double*, double*, double, unsigned*, double*, double*, size_t),
                  VEX_STRINGIZE_SOURCE(
                                       double sum = 0;
                                       double X = prm3[prm2];
                                       double Y = prm4[prm2];
                                       double Z = prm5[prm2];
+                                      double rc2 = prm6*prm6;
+                                      size_t row = prm7[prm2]*prm10;
                                       for(size_t i = 0; i < prm1; ++i)
                                       
                                       if (i != prm2) {
                                           
-                                          r=sqrt( (prm3[i]-X)^2 + (prm4[i]-Y)^2 + (prm5[i]-Z)^2 );
+                                          double dx = prm3[i]-X, dy = prm4[i]-Y, dz = prm5[i]-Z;
+                                          double r2 = dx*dx + dy*dy + dz*dz;
                                           
-                                          if(r<prm6)
-                                              sum += 4*1.08e-21*( (0.32e-9/r)^12 - (0.32e-9/r)^6 );
+                                          if(r2<rc2) {
+                                              double i2 = 1/r2;
+                                              double i6 = i2*i2*i2;
+                                              sum += ( prm8[row+prm7[i]]*i6 - prm9[row+prm7[i]] )*i6;
+                                          }
                                       }
                                       return sum;
                                       )
                  );
     
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
     
     template<
-    typename ScalarType         = double,
-    typename StateType          = std::vector<ScalarType>
+    typename TheEntity, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
     >
     inline
-    void PairForceField::evaluate(const StateType& q, const Environment& env) const {
+    Scalar PairForceField<TheEntity,Scalar,Vector,Matrix,Positions>
+    ::evaluateDevice(const vex::vector<double>& x,
+                     const vex::vector<double>& y,
+                     const vex::vector<double>& z) const {
+        
+        ATOMISM_LOG();
         
-        IMPACT_LOGIN();
+        const std::vector<vex::command_queue>& queues = x.queue_list();
         
-        const PositionVectorType& positions = env.getPositions();
+        vex::vector<unsigned> types( queues, _Types );
+        vex::vector<double>   c12( queues, _Parameters.getC12() );
+        vex::vector<double>   c6( queues, _Parameters.getC6() );
+        vex::vector<double>   energy( queues, x.size() );
         
-        energy = computeInteractionEnergy( positions.size(),
+        energy = computeInteractionEnergy( x.size(),
                                            vex::element_index(),
-                                           vex::raw_pointer(positions(0)),
-                                           vex::raw_pointer(positions(1)),
-                                           vex::raw_pointer(positions(2)),
-                                           1e-9
+                                           vex::raw_pointer(x),
+                                           vex::raw_pointer(y),
+                                           vex::raw_pointer(z),
+                                           _Cutoff,
+                                           vex::raw_pointer(types),
+                                           vex::raw_pointer(c12),
+                                           vex::raw_pointer(c6),
+                                           _Parameters.noOfTypes()
                                           );
-        double e = sum(energy);
-        IMPACT_LOGOUT();
-        return e;
+        vex::Reductor<double, vex::SUM> sum( queues );
+        
+        // each pair is counted by both of its elements
+        return 0.5 * sum(energy);
     }
-    
+#endif
 }
-#endif // MSENTITY_H
+#endif // PAIRFORCEFIELD_H
@@ -0,0 +1,365 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file PairKernel.h Lennard-Jones pair loop over a row of a neighbor list, with SIMD variants
+
+#ifndef PAIRKERNEL_H
+#define PAIRKERNEL_H
+
+#include <cstddef>
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(ATOMISM_NO_SIMD)
+#define ATOMISM_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace atomism {
+    
+    /** \class PairKernel
+     *
+     * \brief Lennard-Jones interaction of one element with a row of its neighbors
+     *
+     * \f$ U = \sum_j ( C_{12}/r^{12} - C_6/r^6 ) \f$ for \f$ r < r_c \f$, the coefficients being
+     * read from the rows c12, c6 of the type of the element (see PairParameters). The force
+     * on the element is added to FX, FY, FZ, the opposite forces to fx, fy, fz (if fx != 0). \n
+     * The generic version is a plain loop for any scalar type. For double, on x86-64 with
+     * GCC or Clang, the loop is vectorized over the neighbors with AVX2 (4 lanes, gathers
+     * of the positions and of the coefficients) or AVX-512 (8 lanes, masked remainder); the
+     * cutoff is applied by masking the lanes. The instruction set is selected once at run
+     * time from the processor (__builtin_cpu_supports), so the binary needs no -mavx flag.
+     * Defining ATOMISM_NO_SIMD keeps the generic version only. \n
+     * The vector versions sum the lanes in a different order than the generic loop, so the
+     * results differ in the last bits from one instruction set to the other (relative
+     * differences of order 1e-15 on the energy): a trajectory run on an AVX-512 processor is
+     * not bit identical to the same run on an AVX2 one, nor restartable bit for bit on it.
+     * setIsa(Generic) forces the generic loop at run time, whose results do not depend on
+     * the processor.
+     */
+    class PairKernel {
+        
+    public:
+        
+        enum Isa { Generic = 0, AVX2 = 1, AVX512 = 2 };
+        
+        /** \brief energy of the element (X,Y,Z) with its neighbors
+         *
+         * \param x,y,z positions of all the elements
+         * \param neighbors indices of the neighbors
+         * \param count number of neighbors
+         * \param X,Y,Z position of the element
+         * \param types type of all the elements
+         * \param c12,c6 coefficients of the type of the element with all the types
+         * \param rc2 squared cutoff
+         * \param fx,fy,fz forces on all the elements, 0 for the energy only
+         * \param FX,FY,FZ force on the element
+         */
+        template<typename Scalar>
+        static Scalar row(const Scalar* x, const Scalar* y, const Scalar* z,
+                          const size_t* neighbors, size_t count,
+                          Scalar X, Scalar Y, Scalar Z,
+                          const unsigned* types, const Scalar* c12, const Scalar* c6, Scalar rc2,
+                          Scalar* fx, Scalar* fy, Scalar* fz,
+                          Scalar& FX, Scalar& FY, Scalar& FZ);
+        
+        //! double precision: dispatched to the best instruction set
+        static double row(const double* x, const double* y, const double* z,
+                          const size_t* neighbors, size_t count,
+                          double X, double Y, double Z,
+                          const unsigned* types, const double* c12, const double* c6, double rc2,
+                          double* fx, double* fy, double* fz,
+                          double& FX, double& FY, double& FZ);
+        
+        //! instruction set supported by the processor
+        static Isa detectIsa();
+        
+        //! instruction set used by row (at most detectIsa())
+        static Isa getIsa() { return isa(); }
+        
+        //! restrict the instruction set (Generic: results independent of the processor)
+        static void setIsa(Isa value) { isa() = value < detectIsa() ? value : detectIsa(); }
+        
+    private:
+        
+        static Isa& isa() { static Isa value = detectIsa(); return value; }
+        
+        //! sum of 8 lanes in a fixed order
+        static double sum8(const double* h) { return ( ( h[0] + h[1] ) + ( h[2] + h[3] ) ) + ( ( h[4] + h[5] ) + ( h[6] + h[7] ) ); }
+        
+#ifdef ATOMISM_SIMD_DISPATCH
+        template<bool WithForces>
+        __attribute__((target("avx2,fma")))
+        static double rowAVX2(const double* x, const double* y, const double* z,
+                              const size_t* neighbors, size_t count,
+                              double X, double Y, double Z,
+                              const unsigned* types, const double* c12, const double* c6, double rc2,
+                              double* fx, double* fy, double* fz,
+                              double& FX, double& FY, double& FZ);
+        
+        template<bool WithForces>
+        __attribute__((target("avx512f")))
+        static double rowAVX512(const double* x, const double* y, const double* z,
+                                const size_t* neighbors, size_t count,
+                                double X, double Y, double Z,
+                                const unsigned* types, const double* c12, const double* c6, double rc2,
+                                double* fx, double* fy, double* fz,
+                                double& FX, double& FY, double& FZ);
+#endif
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    PairKernel::Isa PairKernel::detectIsa() {
+        
+#ifdef ATOMISM_SIMD_DISPATCH
+        __builtin_cpu_init();
+        if( __builtin_cpu_supports("avx512f") ) return AVX512;
+        if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) return AVX2;
+#endif
+        return Generic;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    Scalar PairKernel::row(const Scalar* x, const Scalar* y, const Scalar* z,
+                           const size_t* neighbors, size_t count,
+                           Scalar X, Scalar Y, Scalar Z,
+                           const unsigned* types, const Scalar* c12, const Scalar* c6, Scalar rc2,
+                           Scalar* fx, Scalar* fy, Scalar* fz,
+                           Scalar& FX, Scalar& FY, Scalar& FZ) {
+        
+        Scalar sum = 0;
+        
+        for( size_t k=0; k<count; k++) {
+            
+            size_t j  = neighbors[k];
+            Scalar dx = x[j]-X, dy = y[j]-Y, dz = z[j]-Z;
+            Scalar r2 = dx*dx + dy*dy + dz*dz;
+            
+            if( r2 >= rc2 ) continue;
+            
+            Scalar a  = c12[types[j]];
+            Scalar b  = c6[types[j]];
+            Scalar i2 = 1 / r2;
+            Scalar i6 = i2*i2*i2;
+            sum += ( a*i6 - b ) * i6;
+            
+            if( fx ) {
+                
+                // F_i = f (r_j - r_i), f = 2 dU/dr^2 = (6 C6/r^6 - 12 C12/r^12)/r^2, F_j = -F_i
+                Scalar f = ( 6*b - 12*a*i6 ) * i6 * i2;
+                FX += f*dx; FY += f*dy; FZ += f*dz;
+                fx[j] -= f*dx; fy[j] -= f*dy; fz[j] -= f*dz;
+            }
+        }
+        return sum;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    double PairKernel::row(const double* x, const double* y, const double* z,
+                           const size_t* neighbors, size_t count,
+                           double X, double Y, double Z,
+                           const unsigned* types, const double* c12, const double* c6, double rc2,
+                           double* fx, double* fy, double* fz,
+                           double& FX, double& FY, double& FZ) {
+        
+#ifdef ATOMISM_SIMD_DISPATCH
+        switch( isa() ) {
+                
+            case AVX512:
+                return fx ? rowAVX512<true>( x, y, z, neighbors, count, X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ )
+                          : rowAVX512<false>( x, y, z, neighbors, count, X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ );
+            case AVX2:
+                return fx ? rowAVX2<true>( x, y, z, neighbors, count, X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ )
+                          : rowAVX2<false>( x, y, z, neighbors, count, X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ );
+            default:
+                break;
+        }
+#endif
+        return row<double>( x, y, z, neighbors, count, X, Y, Z, types, c12, c6, rc2, fx, fy, fz, FX, FY, FZ );
+    }
+    
+#ifdef ATOMISM_SIMD_DISPATCH
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<bool WithForces>
+    __attribute__((target("avx2,fma")))
+    inline
+    double PairKernel::rowAVX2(const double* x, const double* y, const double* z,
+                               const size_t* neighbors, size_t count,
+                               double X, double Y, double Z,
+                               const unsigned* types, const double* c12, const double* c6, double rc2,
+                               double* fx, double* fy, double* fz,
+                               double& FX, double& FY, double& FZ) {
+        
+        const __m256d vX = _mm256_set1_pd(X), vY = _mm256_set1_pd(Y), vZ = _mm256_set1_pd(Z);
+        const __m256d vrc2 = _mm256_set1_pd(rc2), one = _mm256_set1_pd(1.);
+        const __m256d six = _mm256_set1_pd(6.), twelve = _mm256_set1_pd(12.);
+        
+        // the masked gathers take an explicit source: the unmasked ones leave it undefined
+        const __m256d zero = _mm256_setzero_pd(), all = _mm256_castsi256_pd( _mm256_set1_epi64x(-1) );
+        
+        __m256d sum = _mm256_setzero_pd();
+        __m256d sFX = _mm256_setzero_pd(), sFY = _mm256_setzero_pd(), sFZ = _mm256_setzero_pd();
+        
+        size_t k = 0;
+        
+        for( ; k+4<=count; k+=4) {
+            
+            __m256i j = _mm256_loadu_si256( (const __m256i*)( neighbors+k ) );
+            
+            __m256d dx = _mm256_sub_pd( _mm256_mask_i64gather_pd( zero, x, j, all, 8 ), vX );
+            __m256d dy = _mm256_sub_pd( _mm256_mask_i64gather_pd( zero, y, j, all, 8 ), vY );
+            __m256d dz = _mm256_sub_pd( _mm256_mask_i64gather_pd( zero, z, j, all, 8 ), vZ );
+            
+            __m256d r2 = _mm256_fmadd_pd( dz, dz, _mm256_fmadd_pd( dy, dy, _mm256_mul_pd( dx, dx ) ) );
+            __m256d in = _mm256_cmp_pd( r2, vrc2, _CMP_LT_OQ );
+            if( _mm256_movemask_pd(in) == 0 ) continue;
+            
+            // coefficients of the types of the neighbors
+            __m128i t = _mm256_mask_i64gather_epi32( _mm_setzero_si128(), (const int*)types, j, _mm_set1_epi32(-1), 4 );
+            __m256d a = _mm256_mask_i32gather_pd( zero, c12, t, in, 8 );
+            __m256d b = _mm256_mask_i32gather_pd( zero, c6,  t, in, 8 );
+            
+            __m256d i2 = _mm256_div_pd( one, _mm256_blendv_pd( one, r2, in ) );
+            __m256d i6 = _mm256_mul_pd( _mm256_mul_pd( i2, i2 ), i2 );
+            __m256d e  = _mm256_mul_pd( _mm256_fmsub_pd( a, i6, b ), i6 );
+            
+            sum = _mm256_add_pd( sum, _mm256_and_pd( e, in ) );
+            
+            if( WithForces ) {
+                
+                __m256d f = _mm256_mul_pd( _mm256_mul_pd( _mm256_fnmadd_pd( twelve, _mm256_mul_pd( a, i6 ), _mm256_mul_pd( six, b ) ), i6 ), i2 );
+                f = _mm256_and_pd( f, in );
+                
+                __m256d gx = _mm256_mul_pd( f, dx ), gy = _mm256_mul_pd( f, dy ), gz = _mm256_mul_pd( f, dz );
+                sFX = _mm256_add_pd( sFX, gx ); sFY = _mm256_add_pd( sFY, gy ); sFZ = _mm256_add_pd( sFZ, gz );
+                
+                // no scatter in AVX2; the neighbors of a row are distinct
+                alignas(32) double px[4], py[4], pz[4];
+                _mm256_store_pd( px, gx ); _mm256_store_pd( py, gy ); _mm256_store_pd( pz, gz );
+                for( int l=0; l<4; l++) {
+                    
+                    size_t jl = neighbors[k+l];
+                    fx[jl] -= px[l]; fy[jl] -= py[l]; fz[jl] -= pz[l];
+                }
+            }
+        }
+        
+        alignas(32) double h[4];
+        _mm256_store_pd( h, sum );
+        double result = ( h[0] + h[1] ) + ( h[2] + h[3] );
+        
+        if( WithForces ) {
+            
+            _mm256_store_pd( h, sFX ); FX += ( h[0] + h[1] ) + ( h[2] + h[3] );
+            _mm256_store_pd( h, sFY ); FY += ( h[0] + h[1] ) + ( h[2] + h[3] );
+            _mm256_store_pd( h, sFZ ); FZ += ( h[0] + h[1] ) + ( h[2] + h[3] );
+        }
+        
+        // remainder
+        return result + row<double>( x, y, z, neighbors+k, count-k, X, Y, Z, types, c12, c6, rc2,
+                                     WithForces ? fx : 0, fy, fz, FX, FY, FZ );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<bool WithForces>
+    __attribute__((target("avx512f")))
+    inline
+    double PairKernel::rowAVX512(const double* x, const double* y, const double* z,
+                                 const size_t* neighbors, size_t count,
+                                 double X, double Y, double Z,
+                                 const unsigned* types, const double* c12, const double* c6, double rc2,
+                                 double* fx, double* fy, double* fz,
+                                 double& FX, double& FY, double& FZ) {
+        
+        const __m512d vX = _mm512_set1_pd(X), vY = _mm512_set1_pd(Y), vZ = _mm512_set1_pd(Z);
+        const __m512d vrc2 = _mm512_set1_pd(rc2), one = _mm512_set1_pd(1.);
+        const __m512d six = _mm512_set1_pd(6.), twelve = _mm512_set1_pd(12.);
+        
+        __m512d sum = _mm512_setzero_pd();
+        __m512d sFX = _mm512_setzero_pd(), sFY = _mm512_setzero_pd(), sFZ = _mm512_setzero_pd();
+        
+        for( size_t k=0; k<count; k+=8) {
+            
+            // the lanes beyond the end of the row are masked
+            __mmask8 valid = count-k >= 8 ? __mmask8(0xFF) : __mmask8( ( 1u << ( count-k ) ) - 1 );
+            
+            __m512i j = _mm512_maskz_loadu_epi64( valid, neighbors+k );
+            
+            __m512d dx = _mm512_sub_pd( _mm512_mask_i64gather_pd( vX, valid, j, x, 8 ), vX );
+            __m512d dy = _mm512_sub_pd( _mm512_mask_i64gather_pd( vY, valid, j, y, 8 ), vY );
+            __m512d dz = _mm512_sub_pd( _mm512_mask_i64gather_pd( vZ, valid, j, z, 8 ), vZ );
+            
+            __m512d r2 = _mm512_fmadd_pd( dz, dz, _mm512_fmadd_pd( dy, dy, _mm512_mul_pd( dx, dx ) ) );
+            __mmask8 in = _mm512_mask_cmp_pd_mask( valid, r2, vrc2, _CMP_LT_OQ );
+            if( in == 0 ) continue;
+            
+            __m256i t = _mm512_mask_i64gather_epi32( _mm256_setzero_si256(), in, j, (const int*)types, 4 );
+            __m512d a = _mm512_mask_i32gather_pd( _mm512_setzero_pd(), in, t, c12, 8 );
+            __m512d b = _mm512_mask_i32gather_pd( _mm512_setzero_pd(), in, t, c6,  8 );
+            
+            __m512d i2 = _mm512_maskz_div_pd( in, one, r2 );
+            __m512d i6 = _mm512_mul_pd( _mm512_mul_pd( i2, i2 ), i2 );
+            __m512d e  = _mm512_mul_pd( _mm512_fmsub_pd( a, i6, b ), i6 );
+            
+            sum = _mm512_mask_add_pd( sum, in, sum, e );
+            
+            if( WithForces ) {
+                
+                __m512d f = _mm512_mul_pd( _mm512_mul_pd( _mm512_fnmadd_pd( twelve, _mm512_mul_pd( a, i6 ), _mm512_mul_pd( six, b ) ), i6 ), i2 );
+                
+                __m512d gx = _mm512_maskz_mul_pd( in, f, dx );
+                __m512d gy = _mm512_maskz_mul_pd( in, f, dy );
+                __m512d gz = _mm512_maskz_mul_pd( in, f, dz );
+                sFX = _mm512_add_pd( sFX, gx ); sFY = _mm512_add_pd( sFY, gy ); sFZ = _mm512_add_pd( sFZ, gz );
+                
+                // the neighbors of a row are distinct: no conflict in the scatter
+                _mm512_mask_i64scatter_pd( fx, in, j, _mm512_sub_pd( _mm512_mask_i64gather_pd( gx, in, j, fx, 8 ), gx ), 8 );
+                _mm512_mask_i64scatter_pd( fy, in, j, _mm512_sub_pd( _mm512_mask_i64gather_pd( gy, in, j, fy, 8 ), gy ), 8 );
+                _mm512_mask_i64scatter_pd( fz, in, j, _mm512_sub_pd( _mm512_mask_i64gather_pd( gz, in, j, fz, 8 ), gz ), 8 );
+            }
+        }
+        
+        // _mm512_reduce_add_pd reads undefined lanes in its GCC implementation (-Wuninitialized)
+        alignas(64) double h[8];
+        
+        if( WithForces ) {
+            
+            _mm512_store_pd( h, sFX ); FX += sum8(h);
+            _mm512_store_pd( h, sFY ); FY += sum8(h);
+            _mm512_store_pd( h, sFZ ); FZ += sum8(h);
+        }
+        _mm512_store_pd( h, sum );
+        return sum8(h);
+    }
+#endif
+}
+#endif // PAIRKERNEL_H
@@ -0,0 +1,173 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file PairParameters.h Parameters of a pair potential between typed elements
+
+#ifndef PAIRPARAMETERS_H
+#define PAIRPARAMETERS_H
+
+#include <Exceptions.h>
+#include <vector>
+#include <cmath>
+
+namespace atomism {
+    
+    /** \class PairParameters
+     *
+     * \brief Lennard-Jones parameters of the pairs of element types
+     *
+     * Each type is added with its own epsilon and sigma; the parameters of a pair of
+     * types (a,b) are obtained by a mixing rule (Lorentz-Berthelot by default:
+     * \f$ \sigma_{ab} = (\sigma_a+\sigma_b)/2 \f$, \f$ \epsilon_{ab} = \sqrt{\epsilon_a\epsilon_b} \f$),
+     * or set explicitly by setPair / setPairCoefficients. \n
+     * The potential of a pair is stored as its coefficients
+     * \f$ U(r) = C_{12}/r^{12} - C_6/r^6 \f$, \f$ C_{12} = 4\epsilon\sigma^{12} \f$,
+     * \f$ C_6 = 4\epsilon\sigma^6 \f$, in two contiguous tables of noOfTypes()^2 values
+     * (getC12()[a*noOfTypes()+b], symmetric), so that the evaluation of a pair needs no
+     * power of sigma. The tables are rebuilt by each modification of the parameters.
+     */
+    template<typename Scalar = double>
+    class PairParameters {
+        
+    public:
+        
+        enum MixingRule { LorentzBerthelot, Geometric };
+        
+        PairParameters(MixingRule rule = LorentzBerthelot) : _Rule(rule) {}
+        
+        /** \brief add a type of element
+         *
+         * \param epsilon depth of the potential well [J]
+         * \param sigma distance of zero potential [m]
+         * \return index of the type
+         */
+        size_t addType(Scalar epsilon, Scalar sigma);
+        
+        //! set the parameters of the pair (a,b), instead of the mixing rule
+        void setPair(size_t a, size_t b, Scalar epsilon, Scalar sigma);
+        
+        //! set the coefficients of the pair (a,b): U(r) = c12/r^12 - c6/r^6
+        void setPairCoefficients(size_t a, size_t b, Scalar c12, Scalar c6);
+        
+        size_t noOfTypes() const { return _Epsilons.size(); }
+        
+        const std::vector<Scalar>& getC12() const { return _C12; }
+        
+        const std::vector<Scalar>& getC6()  const { return _C6; }
+        
+        Scalar getC12(size_t a, size_t b) const { return _C12[a*noOfTypes()+b]; }
+        
+        Scalar getC6(size_t a, size_t b)  const { return _C6[a*noOfTypes()+b]; }
+        
+    private:
+        
+        //! coefficients of the pair (a,b) from the mixing rule
+        void mix(size_t a, size_t b);
+        
+        MixingRule _Rule;
+        
+        std::vector<Scalar> _Epsilons;
+        std::vector<Scalar> _Sigmas;
+        std::vector<char>   _Explicit;   //!< 1 if the pair has been set explicitly
+        
+        std::vector<Scalar> _C12;
+        std::vector<Scalar> _C6;
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    size_t PairParameters<Scalar>::addType(Scalar epsilon, Scalar sigma) {
+        
+        ATOMISM_LOG();
+        ATOMISM_EXCEPT_IF( [&](){ return ( epsilon < 0 ) || !( sigma > 0 ); } );
+        
+        size_t n = noOfTypes();
+        
+        std::vector<Scalar> c12( (n+1)*(n+1) ), c6( (n+1)*(n+1) );
+        std::vector<char>   expl( (n+1)*(n+1), 0 );
+        
+        for( size_t a=0; a<n; a++)
+            for( size_t b=0; b<n; b++) {
+                
+                c12[a*(n+1)+b]  = _C12[a*n+b];
+                c6[a*(n+1)+b]   = _C6[a*n+b];
+                expl[a*(n+1)+b] = _Explicit[a*n+b];
+            }
+        
+        _Epsilons.push_back(epsilon);
+        _Sigmas.push_back(sigma);
+        _C12.swap(c12); _C6.swap(c6); _Explicit.swap(expl);
+        
+        for( size_t a=0; a<=n; a++) mix(a,n);
+        return n;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    void PairParameters<Scalar>::setPair(size_t a, size_t b, Scalar epsilon, Scalar sigma) {
+        
+        ATOMISM_EXCEPT_IF( [&](){ return ( epsilon < 0 ) || !( sigma > 0 ); } );
+        
+        Scalar s6 = std::pow(sigma,6);
+        setPairCoefficients( a, b, 4*epsilon*s6*s6, 4*epsilon*s6 );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    void PairParameters<Scalar>::setPairCoefficients(size_t a, size_t b, Scalar c12, Scalar c6) {
+        
+        ATOMISM_LOG();
+        ATOMISM_EXCEPT_IF( [&](){ return ( a >= noOfTypes() ) || ( b >= noOfTypes() ); } );
+        
+        size_t n = noOfTypes();
+        
+        _C12[a*n+b] = _C12[b*n+a] = c12;
+        _C6[a*n+b]  = _C6[b*n+a]  = c6;
+        _Explicit[a*n+b] = _Explicit[b*n+a] = 1;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    void PairParameters<Scalar>::mix(size_t a, size_t b) {
+        
+        size_t n = noOfTypes();
+        if( _Explicit[a*n+b] ) return;
+        
+        Scalar epsilon = std::sqrt( _Epsilons[a] * _Epsilons[b] );
+        Scalar sigma   = ( _Rule == LorentzBerthelot ) ? ( _Sigmas[a] + _Sigmas[b] ) / 2
+                                                       : std::sqrt( _Sigmas[a] * _Sigmas[b] );
+        Scalar s6 = std::pow(sigma,6);
+        
+        _C12[a*n+b] = _C12[b*n+a] = 4*epsilon*s6*s6;
+        _C6[a*n+b]  = _C6[b*n+a]  = 4*epsilon*s6;
+    }
+}
+#endif // PAIRPARAMETERS_H
@@ -0,0 +1,257 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file PairTable.h Tabulated radial pair potential, indexed by the squared distance
+
+#ifndef PAIRTABLE_H
+#define PAIRTABLE_H
+
+#include <Exceptions.h>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+namespace atomism {
+    
+    /** \class PairTable
+     *
+     * \brief Radial pair potential U(r) tabulated on a uniform grid of \f$ s = r^2 \f$
+     *
+     * The potential is interpolated by a natural cubic spline in s, so that a lookup
+     * needs neither sqrt nor power: the interval is found from s by one multiplication.
+     * The energy and the force factor \f$ g = 2\,dU/ds \f$ (derivative of the same spline)
+     * are tabulated together, the coefficients of an interval being contiguous:
+     * \f$ U = a+t(b+t(c+td)) \f$ and \f$ g = e_0+t(e_1+te_2) \f$, t in [0,1). The force
+     * on the first element of a pair is \f$ \vec F_i = g\,(\vec r_j-\vec r_i) \f$. \n
+     * The potential is given either as a function of r, or as numerical data (r_k,U_k),
+     * interpolated by a spline in s before the tabulation. Below the first point of the
+     * grid, the first interval is extrapolated.
+     */
+    template<typename Scalar = double>
+    class PairTable {
+        
+    public:
+        
+        /** \brief tabulate a function of the distance
+         *
+         * \param potential U(r)
+         * \param rmin smallest distance of the table
+         * \param rmax largest distance of the table (at least the cutoff)
+         * \param nPoints number of points of the grid
+         */
+        PairTable(const std::function<Scalar(Scalar)>& potential, Scalar rmin, Scalar rmax, size_t nPoints);
+        
+        /** \brief tabulate numerical data
+         *
+         * \param r increasing distances
+         * \param u potential at the distances r
+         * \param nPoints number of points of the grid, from r.front() to r.back()
+         */
+        PairTable(const std::vector<Scalar>& r, const std::vector<Scalar>& u, size_t nPoints);
+        
+        //! potential at the squared distance r2
+        Scalar energy(Scalar r2) const;
+        
+        //! potential at the squared distance r2, and force factor g = 2 dU/ds
+        Scalar evaluate(Scalar r2, Scalar& g) const;
+        
+        Scalar getMinDistance2() const { return _S0; }
+        
+        Scalar getMaxDistance2() const { return _S0 + ( _nIntervals / _InvH ); }
+        
+        size_t noOfPoints() const { return _nIntervals+1; }
+        
+    private:
+        
+        PairTable();
+        
+        //! second derivatives of the natural cubic spline through (x,y)
+        static void naturalSpline(const std::vector<Scalar>& x, const std::vector<Scalar>& y,
+                                  std::vector<Scalar>& m);
+        
+        //! build the table from the values on the uniform grid
+        void build(Scalar s0, Scalar s1, const std::vector<Scalar>& values);
+        
+        size_t locate(Scalar r2, Scalar& t) const;
+        
+        Scalar _S0;                   //!< first point of the grid
+        Scalar _InvH;                 //!< 1/step of the grid
+        size_t _nIntervals;
+        
+        std::vector<Scalar> _Table;   //!< a,b,c,d,e0,e1,e2 (and padding) of each interval
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    PairTable<Scalar>::PairTable(const std::function<Scalar(Scalar)>& potential,
+                                 Scalar rmin, Scalar rmax, size_t nPoints) {
+        
+        ATOMISM_LOG();
+        ATOMISM_EXCEPT_IF( [&](){ return !( rmin > 0 ) || !( rmax > rmin ) || ( nPoints < 3 ); } );
+        
+        Scalar s0 = rmin*rmin, s1 = rmax*rmax;
+        std::vector<Scalar> values(nPoints);
+        
+        for( size_t k=0; k<nPoints; k++)
+            values[k] = potential( std::sqrt( s0 + ( s1-s0 ) * k / ( nPoints-1 ) ) );
+        
+        build(s0,s1,values);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    PairTable<Scalar>::PairTable(const std::vector<Scalar>& r, const std::vector<Scalar>& u, size_t nPoints) {
+        
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return r.size();},
+                                [&](){return u.size();} );
+        ATOMISM_EXCEPT_IF( [&](){
+            if( r.size() < 3 || nPoints < 3 || !( r[0] > 0 ) ) return true;
+            for( size_t k=1; k<r.size(); k++) if( !( r[k] > r[k-1] ) ) return true;
+            return false;
+        } );
+        
+        // spline of the data in s, resampled on the uniform grid
+        std::vector<Scalar> s(r.size()), m;
+        for( size_t k=0; k<r.size(); k++) s[k] = r[k]*r[k];
+        naturalSpline(s,u,m);
+        
+        Scalar s0 = s.front(), s1 = s.back();
+        std::vector<Scalar> values(nPoints);
+        
+        for( size_t k=0; k<nPoints; k++) {
+            
+            Scalar x = ( k+1 == nPoints ) ? s1 : s0 + ( s1-s0 ) * k / ( nPoints-1 );
+            size_t i = std::min<size_t>( std::upper_bound( s.begin(), s.end(), x ) - s.begin(), s.size()-1 );
+            i = std::max<size_t>( i, 1 );
+            
+            Scalar h = s[i]-s[i-1];
+            Scalar A = ( s[i]-x ) / h, B = 1-A;
+            values[k] = A*u[i-1] + B*u[i] + ( (A*A*A-A)*m[i-1] + (B*B*B-B)*m[i] ) * h*h/6;
+        }
+        build(s0,s1,values);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    void PairTable<Scalar>::naturalSpline(const std::vector<Scalar>& x, const std::vector<Scalar>& y,
+                                          std::vector<Scalar>& m) {
+        
+        size_t n = x.size();
+        m.assign(n,0);
+        std::vector<Scalar> c(n,0);
+        
+        // tridiagonal system of the second derivatives, m[0] = m[n-1] = 0 (Thomas algorithm)
+        for( size_t i=1; i+1<n; i++) {
+            
+            Scalar h0 = x[i]-x[i-1], h1 = x[i+1]-x[i];
+            Scalar r  = 6 * ( ( y[i+1]-y[i] )/h1 - ( y[i]-y[i-1] )/h0 );
+            Scalar p  = 2*( h0+h1 ) - h0*c[i-1];
+            
+            c[i] = h1 / p;
+            m[i] = ( r - h0*m[i-1] ) / p;
+        }
+        for( size_t i=n-2; i>0; i--) m[i] -= c[i]*m[i+1];
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    void PairTable<Scalar>::build(Scalar s0, Scalar s1, const std::vector<Scalar>& values) {
+        
+        size_t n = values.size();
+        Scalar h = ( s1-s0 ) / ( n-1 );
+        
+        _S0 = s0;
+        _InvH = 1 / h;
+        _nIntervals = n-1;
+        
+        std::vector<Scalar> x(n), m;
+        for( size_t k=0; k<n; k++) x[k] = s0 + h*k;
+        naturalSpline(x,values,m);
+        
+        _Table.assign( 8*_nIntervals, 0 );
+        
+        for( size_t k=0; k<_nIntervals; k++) {
+            
+            Scalar* p = &_Table[8*k];
+            
+            p[0] = values[k];
+            p[1] = values[k+1] - values[k] - h*h*( 2*m[k] + m[k+1] )/6;
+            p[2] = h*h*m[k]/2;
+            p[3] = h*h*( m[k+1]-m[k] )/6;
+            
+            // g = 2 dU/ds = (2/h) dU/dt
+            p[4] = 2*p[1]/h;
+            p[5] = 4*p[2]/h;
+            p[6] = 6*p[3]/h;
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    size_t PairTable<Scalar>::locate(Scalar r2, Scalar& t) const {
+        
+        Scalar x = ( r2 - _S0 ) * _InvH;
+        size_t k = x > 0 ? std::min( size_t(x), _nIntervals-1 ) : 0;
+        t = x - Scalar(k);
+        return k;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    Scalar PairTable<Scalar>::energy(Scalar r2) const {
+        
+        Scalar t;
+        const Scalar* p = &_Table[ 8*locate(r2,t) ];
+        return p[0] + t*( p[1] + t*( p[2] + t*p[3] ) );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<typename Scalar>
+    inline
+    Scalar PairTable<Scalar>::evaluate(Scalar r2, Scalar& g) const {
+        
+        Scalar t;
+        const Scalar* p = &_Table[ 8*locate(r2,t) ];
+        g = p[4] + t*( p[5] + t*p[6] );
+        return p[0] + t*( p[1] + t*( p[2] + t*p[3] ) );
+    }
+}
+#endif // PAIRTABLE_H
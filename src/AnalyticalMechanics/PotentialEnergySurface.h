@@ -43,6 +43,9 @@ namespace atomism {
         
     public:
         
+        //! read-only positions: the inputs of the evaluations (see Entity::getCoordinates)
+        typedef typename const_positions<Positions>::type ConstPositions;
+        
         PotentialEnergySurface( std::shared_ptr<const TheEntity> entity ,
 				std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> _ResourceMngr
 			       );
@@ -52,7 +55,17 @@ namespace atomism {
         Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q) const;
 	
         Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
-			const Positions& coors) const;
+			const ConstPositions& coors) const;
+	
+	/** \brief gradient of the PES w/ respect to the active DoFs
+	 *
+	 * Central finite differences, with the steps q.getdqs(), over the active
+	 * DoFs of q only; the components of the frozen DoFs are set to 0.
+	 * \param q generalized coordinates
+	 * \param gradient output: dU/dq (size noOfDofs)
+	 */
+	void computeGradient(const GeneralizedCoordinates<Scalar,Vector>& q,
+			     Vector& gradient) const;
 	/*
         void computeJacobian(const GeneralizedCoordinates<Scalar,Vector>& q,
 			       Matrix& jacOfPES) const;
@@ -71,6 +84,21 @@ namespace atomism {
 
     protected:
       
+	/** \brief generalized forces from the cartesian forces on the elements
+	 *
+	 * \f$ Q_k = \sum_i \vec F_i . \partial \vec r_i/\partial q_k \f$ over the active DoFs,
+	 * the derivatives being the rows of the jacobian of the entity (steps q.getdqs());
+	 * the forces of the frozen DoFs are set to 0.
+	 * \param q generalized coordinates
+	 * \param coors positions of the elements at q
+	 * \param cartesian forces on the elements
+	 * \param forces output: generalized forces (size noOfDofs)
+	 */
+	void projectForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+			   const ConstPositions& coors,
+			   const ConstPositions& cartesian,
+			   Vector& forces) const;
+	
 	mutable std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> _ResourceMngr; 
     };
     
@@ -98,7 +126,7 @@ namespace atomism {
     >
     inline
     Scalar PotentialEnergySurface<TheEntity,DerivedClass,Scalar,Vector,Matrix,Positions>
-    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,const Positions& coors) const {
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,const ConstPositions& coors) const {
         
         ATOMISM_LOG();
 	//const DerivedClass* a = static_cast<DerivedClass*>(this);
@@ -117,13 +145,107 @@ namespace atomism {
         
         ATOMISM_LOG();
 	
-	auto coors = _ResourceMngr->requestPositions(_Entity->noOfElements());
+	// shared with the cache of the entity, not copied
+	auto coordinates = _Entity->getCoordinates(q);
+	ConstPositions coors = coordinates->getPositions();
+	
+	ATOMISM_VALUE_MISMATCH( [&](){return _Entity->noOfElements();} ,
+				[&](){return n_elements(coors);});
+	
+        return evaluate(q,coors);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename DerivedClass, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PotentialEnergySurface<TheEntity,DerivedClass,Scalar,Vector,Matrix,Positions>
+    ::computeGradient(const GeneralizedCoordinates<Scalar,Vector>& q,Vector& gradient) const {
+        
+        ATOMISM_LOG();
+	
+	auto snapshot = q.getSnapshot();
+	const Vector& dq = q.getdqs();
 	
-	ATOMISM_VALUE_MISMATCH( [&](){return n_elements(q.getValues());} ,
-				[&](){return n_elements(*coors);});
+	ATOMISM_VALUE_MISMATCH( [&](){return n_elements(snapshot->Values);} ,
+				[&](){return n_elements(gradient);});
 	
-	_Entity->computeCoordinates(q.getValues(),*coors);
-        return evaluate(q,*coors);
+	auto values = _ResourceMngr->requestVector(n_elements(snapshot->Values));
+	auto coors  = _ResourceMngr->requestPositions(_Entity->noOfElements());
+	
+	init_clone(*values,snapshot->Values);
+	init_constant(gradient,0.);
+	
+	for( size_t i : *snapshot->Active ) {
+	    
+	    Scalar q0 = (*values)[i];
+	    
+	    (*values)[i] = q0 + dq[i];
+	    _Entity->computeCoordinates(*values,*coors);
+	    Scalar up = evaluate(q,*coors);
+	    
+	    (*values)[i] = q0 - dq[i];
+	    _Entity->computeCoordinates(*values,*coors);
+	    Scalar um = evaluate(q,*coors);
+	    
+	    (*values)[i] = q0;
+	    gradient[i] = (up-um)/(2*dq[i]);
+	}
+    }
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename DerivedClass, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    void PotentialEnergySurface<TheEntity,DerivedClass,Scalar,Vector,Matrix,Positions>
+    ::projectForces(const GeneralizedCoordinates<Scalar,Vector>& q,
+		    const ConstPositions& coors,
+		    const ConstPositions& cartesian,
+		    Vector& forces) const {
+        
+        ATOMISM_LOG();
+	
+	auto snapshot = q.getSnapshot();
+	
+	ATOMISM_VALUE_MISMATCH( [&](){return n_elements(snapshot->Values);} ,
+				[&](){return n_elements(forces);});
+	
+	size_t n2 = _Entity->noOfElements();
+	size_t na = snapshot->Active->size();
+	
+	auto JacX = _ResourceMngr->requestMatrix(na,n2);
+	auto JacY = _ResourceMngr->requestMatrix(na,n2);
+	auto JacZ = _ResourceMngr->requestMatrix(na,n2);
+	
+	const Vector& dq = q.getdqs();
+	_Entity->computeActiveJacobian( snapshot->Values, dq, *snapshot->Active, coors, *JacX, *JacY, *JacZ );
+	
+	const Vector& fx = std::get<0>(cartesian);
+	const Vector& fy = std::get<1>(cartesian);
+	const Vector& fz = std::get<2>(cartesian);
+	
+	init_constant(forces,0.);
+	
+	for( size_t k=0; k<na; k++) {
+	    
+	    const Vector& jx = slice(k,*JacX);
+	    const Vector& jy = slice(k,*JacY);
+	    const Vector& jz = slice(k,*JacZ);
+	    
+	    Scalar sum = 0;
+	    for( size_t i=0; i<n2; i++)
+		sum += fx[i]*jx[i] + fy[i]*jy[i] + fz[i]*jz[i];
+	    
+	    size_t dof  = (*snapshot->Active)[k];
+	    forces[dof] = sum / dq[dof];
+	}
     }
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
@@ -26,6 +26,9 @@
 #include <iostream>
 #include <algorithm>
 #include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include <boost/concept_check.hpp>
 
 #include <Logger.h>
@@ -49,6 +52,9 @@ namespace atomism {
      * The object pointed to by a resource is locked while the resource stays in the scope (no other
      * thread can use it). When the resource gets out of scope, the object pointed to is unlocked 
      * and another thread can use it.
+     *
+     * The requests are serialized by a mutex and the use counts are atomic: the resources can be
+     * requested, and released, from any thread. The objects are never moved once allocated.
      */
     template<
     typename Scalar       = double,
@@ -71,20 +77,20 @@ namespace atomism {
 	
 	Resource() : _Object(0){};
 				  
-	Resource( T& ptr, size_t& count ) 
+	Resource( T& ptr, std::atomic<size_t>& count ) 
 	: _Object(&ptr) { _Counts.push_back(&count);
 			  count++;
 	};
 	
 	
-	Resource( T& ptr, std::vector<size_t*> counts ) 
+	Resource( T& ptr, std::vector<std::atomic<size_t>*> counts ) 
 	: _Object(&ptr) { _Counts = counts;
 	                   for( auto count: _Counts) (*count)++; 
 			 };
 	
         T*    _Object;
 	
-	std::vector<size_t*> _Counts;
+	std::vector<std::atomic<size_t>*> _Counts;
 	
     public:
       
@@ -92,6 +98,8 @@ namespace atomism {
         
 	T&  operator*(){ return *_Object;}
 	
+	const T&  operator*() const { return *_Object;}
+	
 	~Resource() {
 	    
 	    for( auto count: _Counts) (*count)--;
@@ -111,8 +119,8 @@ namespace atomism {
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
-        typedef std::tuple<Vector,std::size_t,std::size_t>                VectorResource;
-	typedef std::tuple<Matrix,std::size_t,std::size_t,std::size_t>    MatrixResource;
+        typedef std::tuple<Vector,std::atomic<size_t>,std::size_t>               VectorResource;
+	typedef std::tuple<Matrix,std::atomic<size_t>,std::size_t,std::size_t>   MatrixResource;
 	typedef Positions             		  		  	  PositionsResource;
 	
     public:
@@ -127,9 +135,11 @@ namespace atomism {
 	
     //private:
       
-        std::vector<VectorResource>      _Vectors;	
-        std::vector<MatrixResource>      _Matrices;	 
-	std::vector<PositionsResource>   _Positions;	
+        std::deque<VectorResource>       _Vectors;	
+        std::deque<MatrixResource>       _Matrices;	 
+	std::deque<PositionsResource>    _Positions;	
+	
+	std::mutex                       _Mutex;   //!< serializes the requests
 	
     };
     
@@ -139,7 +149,7 @@ namespace atomism {
     template<typename Scalar,typename Vector,typename Matrix,typename Positions>
     inline
     ResourceManager<Scalar,Vector,Matrix,Positions>
-    ::ResourceManager() { ATOMISM_LOG(); _Vectors.reserve(100);}
+    ::ResourceManager() { ATOMISM_LOG(); }
     
     //-----------------------------------------------------------------------------
     //-----------------------------------------------------------------------------
@@ -150,6 +160,7 @@ namespace atomism {
     ResourceManager<Scalar,Vector,Matrix,Positions>::requestVector(size_t n) {
       
         ATOMISM_LOG();
+	std::lock_guard<std::mutex> lock(_Mutex);
 	
 	for(  auto& it : _Vectors )
 	    if( ( get<1>(it) == 0) && ( std::get<2>(it) == n)){
@@ -162,7 +173,7 @@ namespace atomism {
 	    
 	LOGGER_WRITE(Logger::DEBUG,"Vector not available, create a new one.");
 	
-	_Vectors.push_back(VectorResource(Vector(),0,n));
+	_Vectors.emplace_back(Vector(),0,n);
 	
 	allocate(get<0>(_Vectors.back()),n);
 	
@@ -181,8 +192,9 @@ namespace atomism {
     ResourceManager<Scalar,Vector,Matrix,Positions>::requestMatrix(size_t n1,size_t n2) {
       
         ATOMISM_LOG();
-	size_t i=0;
-	for(  auto it : _Matrices ) {
+	std::lock_guard<std::mutex> lock(_Mutex);
+	
+	for(  auto& it : _Matrices ) {
 	  
 	    if( ( get<1>(it) == 0) && ( get<2>(it) == n1) && ( get<3>(it) == n2)){
 	      
@@ -192,7 +204,7 @@ namespace atomism {
 	}
 	LOGGER_WRITE(Logger::DEBUG,"Matrix not available, create a new one.");
 	
-	_Matrices.push_back(MatrixResource(Matrix(),1,n1,n2));
+	_Matrices.emplace_back(Matrix(),0,n1,n2);
 	
 	allocate(get<0>(_Matrices.back()),n1,n2);
 	
@@ -211,8 +223,10 @@ namespace atomism {
     ResourceManager<Scalar,Vector,Matrix,Positions>::requestPositions(size_t n) {
       
         ATOMISM_LOG();
+	std::lock_guard<std::mutex> lock(_Mutex);
+	
 	std::vector<Vector*> vectors;
-	std::vector<size_t*> counts;
+	std::vector<std::atomic<size_t>*> counts;
 	
 	for(  auto& it : _Vectors )
 	    if( ( get<1>(it) == 0) && ( std::get<2>(it) == n)){
@@ -228,7 +242,7 @@ namespace atomism {
 	
         for(size_t i=vectors.size();i<3;i++){
 	  
-	   _Vectors.push_back(VectorResource(Vector(),0,n));
+	   _Vectors.emplace_back(Vector(),0,n);
 	    allocate(get<0>(_Vectors.back()),n);
 	    vectors.push_back(&std::get<0>(_Vectors.back()));
 	    counts.push_back(&std::get<1>(_Vectors.back()));
@@ -238,7 +252,6 @@ namespace atomism {
 		
 	_Positions.push_back(pos);
 	Resource<Positions> resource(_Positions.back(),counts);
-	cout<<*this<<endl;
 	return resource;
 	//return resource;
     } 
@@ -251,7 +264,7 @@ namespace atomism {
       out<<"resource abstract"<<endl;
       for(size_t i=0;i<resource._Vectors.size();i++){
 	
-	  out<<i<<"\t"<<get<1>(resource._Vectors[i])<<"\t"
+	  out<<i<<"\t"<<get<1>(resource._Vectors[i]).load()<<"\t"
 	  <<std::get<2>(resource._Vectors[i])<<"\t"
 	  <<&(std::get<0>(resource._Vectors[i]))<<endl;
       }
@@ -22,7 +22,15 @@
 #define MSSOLVERLAGRANGIAN_H
 
 #include<msLagrangian.h>
+#include<linear_algebra.h>
+#include<ThreadPool.h>
+#include<TrajectoryFile.h>
+#include<Checkpoint.h>
+#include<GeneralizedCoordinates.h>
+#include<functional>
+#include<limits>
 #include<math.h>
+#include<cmath>
 
 
 namespace atomism
@@ -62,22 +70,317 @@ namespace atomism
      * Issues can arise when dynamic of a system described by a Z-Matrice in which
      * a bending and dihedral angles of a same atom are defined as coordinates. Indeed,
      * when the system is close to a bending angle=0 or 180 degrees the determinant
-     * of the K-Matrice become null. The ODEs are hard to solve close to these points.
+     * of the K-Matrice become null. The ODEs are hard to solve close to these points. \n
+     * These configurations are detected from the Cholesky factor of K (see set_singularity):
+     * the linear systems are then damped, \f$ (K+\mu I).qpp = rhs \f$ with iterated Tikhonov
+     * refinements, which keeps the accelerations bounded in the singular directions
+     * instead of failing the step. \n
+     * Two integrators are available (see set_integrator):
+     *  - RungeKutta4: the classical 4th order Runge Kutta on the system above (default).
+     *  - GeneralizedLeapfrog: the symplectic generalized Stormer-Verlet scheme applied
+     * to the Hamiltonian \f$ H(q,p)=\frac{1}{2}p^TK^{-1}(q)p+U(q) \f$, with \f$ p=K(q).qp \f$.
+     * The scheme is implicit in \f$ p \f$ for the first half kick and in \f$ q \f$ for the drift;
+     * both are solved by fixed point iterations. Because
+     * \f$ \partial H/\partial q|_p = -\partial L/\partial q|_{qp} \f$, the forces are obtained
+     * from diffq and \f$ K^{-1}p \f$ from the factorization of the kinetic matrix, which is
+     * cached and reused as long as \f$ q \f$ does not change. The energy does not drift,
+     * allowing larger time steps on long trajectories.
+     *  - DormandPrince: the embedded Runge Kutta 5(4) of Dormand and Prince with adaptive
+     * time step. The 4th order embedded solution gives the local error estimate, the last
+     * stage is reused as the first one of the next step (FSAL) and the step size is updated by
+     * a PI controller (Hairer, Norsett, Wanner). In this mode the argument of step is only used
+     * as the initial step size; the step actually taken is given by getLastStep, and never
+     * goes beyond t_tot.
+     *
+     * Since \f$ A=K(q) \f$ is symmetric positive definite, it is assembled on its upper triangle
+     * only and factorized by Cholesky (unrolled kernels for Ndof<=8, blocked kernel otherwise, or
+     * LAPACK dpotrf if ATOMISM_USE_LAPACK is defined); a pivoted LU is used if the factorization
+     * breaks down. The factors are reused while the coordinates do not change by more than
+     * set_kineticReuse. \n
+     * The finite differences of calc_qpp can be assembled in parallel, each worker using
+     * its own copy of the Lagrangian (see set_assemblyLagrangians). \n
+     * Multiple time steps (RESPA): if a slow part of the potential is given by set_respa, the
+     * Lagrangian given to dynamic holds the fast part only. A step dt is then made of a
+     * half kick of the slow forces, nInner steps dt/nInner of the selected integrator on the
+     * fast Lagrangian (RK4 if DormandPrince is selected), and a second half kick. The slow
+     * forces \f$ -\partial U_{slow}/\partial q \f$ are computed once per outer step,
+     * the velocities being updated by \f$ \delta qp = h/2.K^{-1}(q).F_{slow} \f$. \n
+     * Events: functions \f$ g(t,q,qp) \f$ (e.g. the distance to a dividing surface) can be
+     * monitored along the trajectory (see addEvent). When \f$ g \f$ changes sign over a
+     * step, the crossing is located by root finding on the dense output of the step, and
+     * recorded (see getEvents). The dense output is obtained from the stages of the step,
+     * without new evaluations of the accelerations: the 4th order continuous extension of
+     * DormandPrince; otherwise the cubic Hermite interpolant of \f$ q \f$ from the coordinates
+     * and velocities at both ends, \f$ qp \f$ being given by the 3rd order continuous extension
+     * of RungeKutta4, or by the derivative of the interpolant of \f$ q \f$ (GeneralizedLeapfrog,
+     * RESPA). A terminal event stops the trajectory at the crossing. \n
+     * Output: the trajectory can be streamed to a binary trajectory file (see
+     * set_trajectoryWriter); the frames are written by the thread of the TrajectoryWriter. \n
+     * Checkpoints: the complete state of the integration (coordinates, velocities, time,
+     * step size controller, FSAL accelerations, slow forces, kinetic factorization cache,
+     * finite difference steps and events found) is saved by saveCheckpoint, on a wall clock
+     * cadence during dynamic if set_checkpoint is used. To restart, the solver is configured
+     * as for the interrupted run, the state is restored by loadCheckpoint and the integration
+     * is continued by resume: the trajectory is then bit identical to the uninterrupted one. \n
+     * Frozen DoFs: the mask is the one of the generalized coordinates given by
+     * set_generalizedCoordinates (see GeneralizedCoordinates::freeze), read at each step.
+     * The velocities and accelerations of the frozen DoFs are zero, and the kinetic
+     * system is assembled, factorized and solved on the active DoFs only, in compacted
+     * storage (the leading nActive x nActive block of the matrices). \n
+     * All the buffers used by the integrators and the linear solver are gathered in a
+     * Workspace sized once by dynamic (see allocateWorkspace): a step performs no heap
+     * allocation.
      */
     class msSolverLagrangian : public msTreeMapper
     {
     protected:
         
         msSolverLagrangian() : msTreeMapper() { constructVar("msSolverLagrangian","SolverLagrangian","lagrangian solver");
-            Ndof=0; t_current=0; t_tot=100; SiUnits.setSI();
+            Ndof=0; nActive=0; ActiveValid=0; t_current=0; t_tot=100; TimeStep=1e-15; SiUnits.setSI();
+            Method=RungeKutta4; ImplicitTol=1e-12; ImplicitMaxIt=20;
+            KReuseTol=0; KFactorValid=0; KCholesky=0; KRegularized=0;
+            CondMax=1e10; Regularization=1e-8; RegularizationRefinements=1; nRegularized=0;
+            RelTol=1e-8; AbsTol=1e-12; dtMin=1e-20; dtNext=0; dtLast=0; ErrPrev=1e-4; FsalValid=0;
+            RespaInner=0; FslowValid=0; WriterStride=1; nSteps=0; Termination=Completed;
         }
         
     public:
         
+        //! function monitored along the trajectory
+        typedef std::function<double(double t, const vector_type& q, const vector_type& qp)> EventFunction;
+        
+        //! generalized coordinates holding the mask of the frozen DoFs
+        typedef GeneralizedCoordinates<double,vector_type> coordinates_type;
+        
+        //! crossing of an event
+        struct EventRecord {
+            
+            size_t      Event;   //!< index of the event (order of addEvent)
+            double      t;       //!< time of the crossing
+            vector_type q;       //!< coordinates at the crossing
+            vector_type qp;      //!< velocities at the crossing
+        };
+        
+        //! integration schemes available
+        enum Integrator { RungeKutta4 , GeneralizedLeapfrog , DormandPrince };
+        
+        //! end of an integration
+        enum Status {
+            Completed ,     //!< t_tot reached
+            Stopped ,       //!< stopped by a terminal event
+            Failed          //!< a step failed (kinetic system, implicit iterations, step size below dtmin)
+        };
+        
+        /*! \brief compute a trajectory from the initial conditions up to t_tot
+         *
+         * The velocities are rescaled such that the total energy equals E,
+         * if E is above the potential energy of the initial coordinates.
+         * \param lagrangien Lagrangian of the system
+         * \param E total energy [J]
+         */
         void dynamic( msLagrangian& lagrangien , double E );
         
+        /*! \brief continue the integration from the state restored by loadCheckpoint
+         *
+         * \param lagrangien Lagrangian of the system (the one given to the interrupted dynamic)
+         */
+        void resume( msLagrangian& lagrangien );
+        
+        //! end of the last call to dynamic or resume: a failed trajectory stops at getTime() < t_tot
+        Status getStatus() const { return Termination; }
+        
+        //! save the state of the integration
+        void saveCheckpoint(const std::string& filename) const;
+        
+        //! restore the state of the integration, the solver being configured as when it was saved
+        void loadCheckpoint(const std::string& filename);
+        
+        //! save the state to 'filename' every 'period' seconds of wall clock time during dynamic (0: never)
+        boost::shared_ptr<msTreeMapper> set_checkpoint(const std::string& filename,double period){
+            CheckpointFile=filename; CheckpointCadence.setPeriod(period); return mySharedPtr();
+        };
+        
+        /*! \brief advance the trajectory by one step
+         *
+         * \param dt step size; initial step size for DormandPrince (see getLastStep)
+         * \param dtMax the step actually taken never exceeds dtMax (e.g. the time left to t_tot)
+         * \return false if the step failed
+         */
+        bool step(double dt, double dtMax = std::numeric_limits<double>::infinity());
+        
+        /*! \brief set the initial coordinates and velocities (SI units)
+         *
+         * \param q0 coordinates
+         * \param qp0 velocities
+         */
+        boost::shared_ptr<msTreeMapper> set_initialConditions(const vector_type& q0,const vector_type& qp0){
+            q=q0; qp=qp0; t_current=0;
+            // nothing is kept from the previous trajectory: the result does not depend on it
+            FsalValid=0; KFactorValid=0; KRegularized=0; FslowValid=0; nRegularized=0;
+            dtNext=0; dtLast=0; ErrPrev=1e-4;
+            Epsilon.clear(); Epsilonp.clear();
+            return mySharedPtr();
+        };
+        
         boost::shared_ptr<msTreeMapper> set_ttot(double t){ t_tot=t; return mySharedPtr();};
         
+        boost::shared_ptr<msTreeMapper> set_dt(double t){ TimeStep=t; return mySharedPtr();};
+        
+        boost::shared_ptr<msTreeMapper> set_integrator(Integrator method){ Method=method; FsalValid=0; return mySharedPtr();};
+        
+        /*! \brief set the convergence criteria of the fixed point iterations (GeneralizedLeapfrog)
+         *
+         * The kinetic matrix and the forces are finite differences of the Lagrangian: the
+         * updates stall at the level of their rounding errors, which can be above tol. An
+         * iteration that no longer contracts is then accepted if the update is below sqrt(tol).
+         * \param tol relative tolerance on the momenta/coordinates updates
+         * \param maxIt maximum number of iterations
+         */
+        boost::shared_ptr<msTreeMapper> set_implicitSolver(double tol,int maxIt){
+            ImplicitTol=tol; ImplicitMaxIt=maxIt; return mySharedPtr();
+        };
+        
+        /*! \brief set the error control of the adaptive integrator (DormandPrince)
+         *
+         * \param rtol relative tolerance
+         * \param atol absolute tolerance (SI units)
+         * \param dtmin minimum step size allowed, the step fails below
+         */
+        boost::shared_ptr<msTreeMapper> set_tolerances(double rtol,double atol,double dtmin){
+            RelTol=rtol; AbsTol=atol; dtMin=dtmin; return mySharedPtr();
+        };
+        
+        /*! \brief allow the reuse of the kinetic matrix factorization
+         *
+         * The factorization of \f$ K(q) \f$ is reused (e.g. across the RK stages) as long as
+         * the relative change of the coordinates stays below tol. The default, 0, only reuses
+         * it for identical coordinates (exact).
+         * \param tol relative change of the coordinates
+         */
+        boost::shared_ptr<msTreeMapper> set_kineticReuse(double tol){ KReuseTol=tol; return mySharedPtr();};
+        
+        /*! \brief assemble the equations of motion in parallel
+         *
+         * The \f$ Ndof^2 \f$ finite differences of calc_qpp are distributed over
+         * lagrangians.size() workers, the worker k evaluating lagrangians[k]. The Lagrangians
+         * must be independent copies of the one given to dynamic (they are modified by the
+         * finite differences). The results do not depend on the number of workers.
+         * An empty vector restores the serial assembly.
+         * \param lagrangians one Lagrangian per worker
+         */
+        boost::shared_ptr<msTreeMapper> set_assemblyLagrangians(const std::vector<msLagrangian*>& lagrangians){
+            AssemblyLagrangians = lagrangians;
+            Pool.reset();
+            if( lagrangians.size() > 1 ) Pool = std::make_shared<ThreadPool>( lagrangians.size() );
+            
+            // one private buffer per worker, sized as the rest of the workspace
+            Work.qWorker.resize(  lagrangians.size() );
+            Work.qpWorker.resize( lagrangians.size() );
+            for( size_t w=0; w<lagrangians.size(); w++) { Work.qWorker[w].resize(Ndof); Work.qpWorker[w].resize(Ndof); }
+            KFactorValid=0; FsalValid=0;
+            return mySharedPtr();
+        };
+        
+        /*! \brief integrate with multiple time steps (RESPA)
+         *
+         * The Lagrangian given to dynamic must then be built on the fast part of 'split' only
+         * (see SplitPotentialEnergySurface::getFast), the slow part being evaluated by
+         * split->evaluateSlow on the outer steps only. The slow part is evaluated at the
+         * generalized coordinates given by set_generalizedCoordinates, whose values are set
+         * to the coordinates of the evaluation.
+         * \param split split potential energy surface [J] (see SplitPotentialEnergySurface)
+         * \param nInner number of inner (fast) steps per outer step; 0 disables RESPA
+         */
+        template<typename SplitPES>
+        boost::shared_ptr<msTreeMapper> set_respa(std::shared_ptr<SplitPES> split,int nInner){
+            ATOMISM_EXCEPT_IF( [&](){ return nInner>0 && ( !split || !Coordinates ); } );
+            SlowPotential = [this,split](const vector_type& qs) {
+                Coordinates->setValues(qs);
+                return split->evaluateSlow(*Coordinates);
+            };
+            RespaInner=nInner; FslowValid=0; return mySharedPtr();
+        };
+        
+        /*! \brief set the treatment of the singular configurations
+         *
+         * When the 1-norm condition number of the kinetic matrix, estimated from its Cholesky
+         * factor by Hager's method (see choleskyCondition), exceeds condMax (or the
+         * factorization breaks down), the system is solved with \f$ K+\mu I \f$,
+         * \f$ \mu \f$=mu.tr(K)/Ndof, followed by nRefine iterated Tikhonov refinements.
+         * condMax=0 disables the regularization.
+         * \param condMax conditioning threshold
+         * \param mu relative damping
+         * \param nRefine number of refinements
+         */
+        boost::shared_ptr<msTreeMapper> set_singularity(double condMax,double mu,int nRefine){
+            CondMax=condMax; Regularization=mu; RegularizationRefinements=nRefine; return mySharedPtr();
+        };
+        
+        //! number of factorizations of the kinetic matrix that have been regularized
+        size_t getNoOfRegularizations() const { return nRegularized; }
+        
+        /*! \brief generalized coordinates holding the mask of the frozen DoFs
+         *
+         * The active DoFs are read from 'coordinates' at each step, there is no other mask:
+         * a DoF frozen with GeneralizedCoordinates::freeze is frozen for the solver.
+         * Without coordinates all the DoFs are active.
+         */
+        boost::shared_ptr<msTreeMapper> set_generalizedCoordinates(std::shared_ptr<coordinates_type> coordinates){
+            Coordinates=coordinates; ActiveValid=0; return mySharedPtr();
+        };
+        
+        /*! \brief freeze DoFs of the generalized coordinates (see set_generalizedCoordinates)
+         *
+         * \param frozen frozen[i] is true if the DoF i is frozen; an empty vector unfreezes all the DoFs
+         */
+        boost::shared_ptr<msTreeMapper> set_frozen(const std::vector<bool>& frozen);
+        
+        //! number of active (not frozen) DoFs
+        int getNoOfActive() const { return nActive; }
+        
+        /*! \brief monitor a function along the trajectory
+         *
+         * \param g event function, the events are the zeros of g
+         * \param terminal if true, the trajectory stops at the first crossing
+         * \param direction +1: only the crossings where g increases, -1: where g decreases, 0: both
+         */
+        boost::shared_ptr<msTreeMapper> addEvent(EventFunction g,bool terminal,int direction){
+            Events.push_back(g); EventTerminal.push_back(terminal); EventDirection.push_back(direction);
+            return mySharedPtr();
+        };
+        
+        boost::shared_ptr<msTreeMapper> clearEvents(){
+            Events.clear(); EventTerminal.clear(); EventDirection.clear(); EventRecords.clear();
+            return mySharedPtr();
+        };
+        
+        //! crossings found during the last call to dynamic
+        const std::vector<EventRecord>& getEvents() const { return EventRecords; }
+        
+        /*! \brief stream the trajectory to a file
+         *
+         * The initial state and every stride steps of dynamic are written, as well as the
+         * last state of the trajectory.
+         * \param writer trajectory file, 0 to disable the output
+         * \param stride number of steps between two frames
+         */
+        boost::shared_ptr<msTreeMapper> set_trajectoryWriter(std::shared_ptr<TrajectoryWriter> writer,size_t stride){
+            Writer=writer; WriterStride=std::max<size_t>(stride,1); return mySharedPtr();
+        };
+        
+        //! size of the last step accepted
+        double getLastStep() const { return dtLast; }
+        
+        //! @name state of the trajectory (SI units)
+        //@{
+        const vector_type& getq()  const { return q;  }
+        const vector_type& getqp() const { return qp; }
+        double getTime()           const { return t_current; }
+        double getTotalTime()      const { return t_tot; }
+        double getEk()             const { return Ek; }
+        double getEp()             const { return Ep; }
+        //@}
+        
         std::ostream& print(std::ostream& out) const;
         
         boost::shared_ptr<msParamsManager> getParameters() const{ return Parameters.getSharedPtr(); }
@@ -88,6 +391,7 @@ namespace atomism
         
         double dEk;
         double t_tot;
+        double TimeStep;
         
         double Ek,Ep,Et,L;
         //@}
@@ -114,13 +418,160 @@ namespace atomism
         vector_type rhs;
         matrix_type A;
         //@}
-        double diffq(int i, vector_type& q_, vector_type& qp_);
-        double diffpp(int i, int j, vector_type& q_, vector_type& qp_);
-        double diffqp(int i, int j, vector_type& q_, vector_type& qp_);
+        
+        Integrator Method;
+        
+        //! @name Treatment of the singular configurations
+        //@{
+        double CondMax;                      //!< conditioning of K above which K+mu.I is solved
+        double Regularization;               //!< mu relative to tr(K)/Ndof
+        int    RegularizationRefinements;    //!< iterated Tikhonov refinements
+        size_t nRegularized;                 //!< number of regularized factorizations
+        //@}
+        
+        double ImplicitTol;
+        int    ImplicitMaxIt;
+        
+        //! @name Kinetic matrix factorization cache
+        //@{
+        double           KReuseTol;     //!< relative change of q below which KFactor is reused
+        bool             KFactorValid;  //!< true if KFactor is the factorization of K(qFactor)
+        bool             KCholesky;     //!< true if KFactor holds Cholesky factors, LU otherwise
+        bool             KRegularized;  //!< true if KFactor is the factorization of K+mu.I
+        vector_type      qFactor;       //!< coordinates at which KFactor has been computed
+        matrix_type      KMatrix;       //!< kinetic matrix K(qFactor)
+        matrix_type      KFactor;       //!< factors of the kinetic matrix
+        std::vector<int> KPivot;        //!< row permutation of the LU factorization
+        //@}
+        
+        //! @name Frozen DoFs
+        //@{
+        std::shared_ptr<coordinates_type>          Coordinates;    //!< holds the mask, 0 if no DoF is frozen
+        std::shared_ptr<const std::vector<size_t>> ActiveIndices;  //!< mask from which Active is built
+        bool              ActiveValid;
+        std::vector<int>  Active;       //!< indices of the active DoFs
+        int               nActive;
+        //@}
+        
+        //! @name Adaptive step control (DormandPrince)
+        //@{
+        double RelTol;
+        double AbsTol;
+        double dtMin;
+        double dtNext;                    //!< step size proposed by the controller
+        double dtLast;                    //!< step size of the last accepted step
+        double ErrPrev;                   //!< error norm of the previous accepted step
+        bool   FsalValid;                 //!< true if qppFsal is q'' at the current (q,qp)
+        vector_type qppFsal;
+        //@}
+        
+        /** \brief Buffers of the integrators and of the linear solver
+         *
+         * Sized once by allocateWorkspace, they are reused by every step.
+         */
+        struct Workspace {
+            
+            vector_type qtmp;                 //!< coordinates at the RK stages
+            vector_type qptmp;                //!< velocities at the RK stages
+            vector_type qpp;                  //!< accelerations at the RK stages
+            
+            vector_type p;                    //!< momenta at t
+            vector_type phalf;                //!< momenta at t+dt/2
+            vector_type pnew;                 //!< momenta iterate
+            vector_type qnew;                 //!< coordinates iterate
+            vector_type v0;                   //!< K^-1(q_n).p_1/2
+            vector_type v1;                   //!< K^-1(q_n+1).p_1/2
+            vector_type f;                    //!< generalized forces
+            vector_type fslow;                //!< slow generalized forces (RESPA)
+            vector_type qslow;                //!< coordinates of fslow
+            vector_type res;                  //!< residual of the regularized solves
+            vector_type pc;                   //!< right hand side of the compacted solves
+            vector_type xc;                   //!< solution of the compacted solves
+            vector_type qpzero;               //!< zero velocities of updateEnergies
+            
+            vector_type q0;                   //!< coordinates at the beginning of the step (events)
+            vector_type qp0;                  //!< velocities at the beginning of the step (events)
+            vector_type qe;                   //!< interpolated coordinates (events)
+            vector_type qpe;                  //!< interpolated velocities (events)
+            
+            std::vector<vector_type> Kq;      //!< stages derivatives of q  (= qp at the stages)
+            std::vector<vector_type> Kqp;     //!< stages derivatives of qp (= qpp at the stages)
+            
+            matrix_type B;                    //!< B matrix of the parallel assembly
+            std::vector<vector_type> qWorker; //!< private coordinates of the assembly workers
+            std::vector<vector_type> qpWorker;//!< private velocities of the assembly workers
+        };
+        
+        Workspace Work;
+        
+        std::shared_ptr<TrajectoryWriter>  Writer;      //!< 0 if no output
+        size_t                             WriterStride;
+        
+        void writeFrame() { Writer->write(t_current, q, qp, Ek, Ep); }
+        
+        size_t           nSteps;              //!< steps done by dynamic
+        Status           Termination;         //!< end of the last integration
+        
+        std::string      CheckpointFile;
+        CheckpointClock  CheckpointCadence;
+        
+        void integrate();
+        
+        //! @name Events
+        //@{
+        std::vector<EventFunction>  Events;
+        std::vector<bool>           EventTerminal;
+        std::vector<int>            EventDirection;
+        std::vector<double>         EventValues;       //!< values of the events at the beginning of the step
+        std::vector<EventRecord>    EventRecords;
+        //@}
+        
+        //! @name Multiple time steps (RESPA)
+        //@{
+        std::function<double(const vector_type&)> SlowPotential;   //!< evaluateSlow of the PES of set_respa
+        int          RespaInner;        //!< number of inner steps, 0 if RESPA is not used
+        bool         FslowValid;        //!< true if Work.fslow are the slow forces at Work.qslow
+        //@}
+        
+        //! @name Parallel assembly of the equations of motion
+        //@{
+        std::shared_ptr<ThreadPool>  Pool;                  //!< 0 if the assembly is serial
+        std::vector<msLagrangian*>   AssemblyLagrangians;   //!< Lagrangian used by each worker
+        //@}
+        
+        void allocateWorkspace(int n);
+        void updateActive();
+        void updateEnergies();
+        
+        bool detectEvents(double t0);
+        void interpolate(double theta, double h);
+        double locateEvent(size_t e, double t0, double h, double g0, double g1);
+        
+        bool stepRK4(double dt);
+        bool stepLeapfrog(double dt);
+        bool stepDormandPrince(double dt, double dtMax);
+        bool stepRespa(double dt);
+        bool kickSlow(double h);
+        
+        bool factorKinetic(vector_type& q_);
+        void solveKinetic(const vector_type& p_, vector_type& qp_);
+        void solveCompact(const vector_type& b, vector_type& x);
+        void multiplyKinetic(const vector_type& qp_, vector_type& p_) const;
+        bool computeForces(vector_type& q_, const vector_type& p_, vector_type& qp_, vector_type& f_);
+        double relativeChange(const vector_type& x, const vector_type& y) const;
+        double diffq(int i, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien);
+        double diffpp(int i, int j, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien);
+        double diffqp(int i, int j, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien);
+        
+        double diffq(int i, vector_type& q_, vector_type& qp_)         { return diffq(i,q_,qp_,*Lagrangien); }
+        double diffpp(int i, int j, vector_type& q_, vector_type& qp_) { return diffpp(i,j,q_,qp_,*Lagrangien); }
+        double diffqp(int i, int j, vector_type& q_, vector_type& qp_) { return diffqp(i,j,q_,qp_,*Lagrangien); }
+        
+        bool assembleKinetic(vector_type& q_);
+        bool assembleParallel(vector_type& q_, vector_type& qp_, bool withKinetic);
+        bool factorAssembled(vector_type& q_);
         
         bool calc_qpp(vector_type& q_,vector_type& qp_, vector_type& qpp_);
-        void solve(matrix_type& A, vector_type& v, vector_type& w);
-        void solve2(matrix_type& A, vector_type& v, vector_type& w);
         int Ndof;
         
     };
@@ -128,11 +579,458 @@ namespace atomism
 }
 
 
-bool msSolverLagrangian::step(double dt) {
+void msSolverLagrangian::dynamic( msLagrangian& lagrangien , double E ) {
     
-    vector_type qtmp(  Ndof );
-    vector_type qptmp( Ndof );
-    vector_type qpp(   Ndof );
+    Lagrangien = &lagrangien;
+    Ndof       = q.size();
+    allocateWorkspace(Ndof);
+    
+    updateEnergies();
+    if( ( Ek > 0 ) && ( E > Ep ) ) {
+        
+        double scale = sqrt( (E-Ep) / Ek );
+        for( int i=0; i<Ndof; i++) qp[i] *= scale;
+        updateEnergies();
+    }
+    
+    EventRecords.clear();
+    nSteps = 0;
+    if( Writer ) writeFrame();
+    
+    integrate();
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::resume( msLagrangian& lagrangien ) {
+    
+    ATOMISM_VALUE_MISMATCH( [&](){return int(q.size());}, [&](){return Ndof;} );
+    
+    Lagrangien = &lagrangien;
+    updateEnergies();
+    integrate();
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::integrate() {
+    
+    EventValues.resize( Events.size() );
+    for( size_t e=0; e<Events.size(); e++) EventValues[e] = Events[e](t_current, q, qp);
+    
+    CheckpointCadence.reset();
+    Termination = Completed;
+    
+    while( t_current < t_tot ) {
+        
+        double t0 = t_current;
+        if( !Events.empty() ) { Work.q0 = q; Work.qp0 = qp; }
+        
+        if( !step( std::min( TimeStep, t_tot-t_current ), t_tot-t_current ) ) { Termination = Failed; break; }
+        
+        bool stop = !Events.empty() && detectEvents(t0);
+        updateEnergies();
+        
+        bool last = stop || !( t_current < t_tot );
+        if( Writer && ( ++nSteps % WriterStride == 0 || last ) ) writeFrame();
+        if( stop ) { Termination = Stopped; break; }
+        
+        if( !CheckpointFile.empty() && CheckpointCadence.due() ) saveCheckpoint(CheckpointFile);
+    }
+    if( Writer ) Writer->flush();
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::saveCheckpoint(const std::string& filename) const {
+    
+    CheckpointWriter out(filename);
+    out.writeString("msSolverLagrangian");
+    
+    out.write(Method);   out.write(t_tot);  out.write(TimeStep);
+    out.write(t_current); out.write(nSteps);
+    out.writeVector(q);  out.writeVector(qp);
+    out.writeVector(Epsilon); out.writeVector(Epsilonp);
+    
+    // adaptive step (DormandPrince) and first same as last accelerations
+    out.write(dtNext); out.write(dtLast); out.write(ErrPrev);
+    out.write(FsalValid); out.writeVector(qppFsal);
+    
+    // slow forces of RESPA
+    out.write(FslowValid); out.writeVector(Work.fslow);
+    
+    // the reuse of the factorization depends on the coordinates of the last factorization
+    out.write(KFactorValid); out.write(KCholesky); out.write(KRegularized); out.write(nRegularized);
+    out.writeVector(qFactor);
+    out.writeMatrix(KMatrix, Ndof, Ndof);
+    out.writeMatrix(KFactor, Ndof, Ndof);
+    out.writeVector(KPivot);
+    
+    uint64_t nEvents = EventRecords.size();
+    out.write(nEvents);
+    for( size_t i=0; i<EventRecords.size(); i++) {
+        
+        out.write( uint64_t(EventRecords[i].Event) ); out.write( EventRecords[i].t );
+        out.writeVector( EventRecords[i].q );       out.writeVector( EventRecords[i].qp );
+    }
+    out.commit();
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::loadCheckpoint(const std::string& filename) {
+    
+    CheckpointReader in(filename);
+    in.expect("msSolverLagrangian");
+    
+    in.read(Method);   in.read(t_tot);  in.read(TimeStep);
+    in.read(t_current); in.read(nSteps);
+    in.readVector(q);  in.readVector(qp);
+    in.readVector(Epsilon); in.readVector(Epsilonp);
+    
+    // sizes the buffers, and invalidates the caches restored below
+    Ndof = q.size();
+    allocateWorkspace(Ndof);
+    
+    in.read(dtNext); in.read(dtLast); in.read(ErrPrev);
+    in.read(FsalValid); in.readVector(qppFsal);
+    
+    in.read(FslowValid); in.readVector(Work.fslow);
+    
+    in.read(KFactorValid); in.read(KCholesky); in.read(KRegularized); in.read(nRegularized);
+    in.readVector(qFactor);
+    in.readMatrix(KMatrix);
+    in.readMatrix(KFactor);
+    in.readVector(KPivot);
+    
+    uint64_t nEvents;
+    in.read(nEvents);
+    EventRecords.resize(nEvents);
+    for( size_t i=0; i<nEvents; i++) {
+        
+        uint64_t e; in.read(e); EventRecords[i].Event = e;
+        in.read( EventRecords[i].t );
+        in.readVector( EventRecords[i].q ); in.readVector( EventRecords[i].qp );
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::detectEvents(double t0) {
+    
+    double h  = t_current - t0;
+    
+    size_t terminal = Events.size();
+    double tTerminal = t_current;
+    
+    for( size_t e=0; e<Events.size(); e++) {
+        
+        double g0 = EventValues[e];
+        double g1 = Events[e](t_current, q, qp);
+        EventValues[e] = g1;
+        
+        bool crossing = ( g0<0 && g1>=0 ) || ( g0>0 && g1<=0 );
+        if( !crossing || ( EventDirection[e]*(g1-g0) < 0 ) ) continue;
+        
+        double theta = locateEvent(e, t0, h, g0, g1);
+        interpolate(theta, h);
+        
+        EventRecord record;
+        record.Event = e; record.t = t0 + theta*h; record.q = Work.qe; record.qp = Work.qpe;
+        EventRecords.push_back(record);
+        
+        if( EventTerminal[e] && ( record.t < tTerminal ) ) { terminal = e; tTerminal = record.t; }
+    }
+    
+    if( terminal == Events.size() ) return 0;
+    
+    // stop at the first terminal crossing, the later crossings of the step are discarded
+    size_t n = 0;
+    for( size_t i=0; i<EventRecords.size(); i++)
+        if( EventRecords[i].t <= tTerminal ) EventRecords[n++] = EventRecords[i];
+    EventRecords.resize(n);
+    
+    interpolate( (tTerminal-t0)/h, h );
+    q = Work.qe; qp = Work.qpe;
+    t_current = tTerminal;
+    FsalValid = 0; FslowValid = 0; dtNext = 0;
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::interpolate(double theta, double h) {
+    
+    // the stages are those of the last step, from (Work.q0,Work.qp0) to (q,qp)
+    if( RespaInner==0 && Method==DormandPrince ) {
+        
+        // continuous extension of Dormand-Prince (Hairer, Norsett, Wanner: dopri5)
+        static const double d[7] = { -12715105075./11282082432, 0, 87487479700./32700410799,
+                                     -10690763975./1880347072, 701980252875./199316789632,
+                                     -1453857185./822651844, 69997945./29380423 };
+        const std::vector<vector_type>& Kq  = Work.Kq;
+        const std::vector<vector_type>& Kqp = Work.Kqp;
+        double theta1 = 1 - theta;
+        
+        for( int i=0; i<Ndof; i++) {
+            
+            double dq  = q[i] - Work.q0[i],  bq  = h*Kq[0][i]  - dq,  cq  = dq  - h*Kq[6][i]  - bq;
+            double dqp = qp[i] - Work.qp0[i], bqp = h*Kqp[0][i] - dqp, cqp = dqp - h*Kqp[6][i] - bqp;
+            double eq = 0, eqp = 0;
+            for( int s=0; s<7; s++) { eq += d[s]*Kq[s][i]; eqp += d[s]*Kqp[s][i]; }
+            
+            Work.qe[i]  = Work.q0[i]  + theta*( dq  + theta1*( bq  + theta*( cq  + theta1*h*eq  ) ) );
+            Work.qpe[i] = Work.qp0[i] + theta*( dqp + theta1*( bqp + theta*( cqp + theta1*h*eqp ) ) );
+        }
+    }
+    else {
+        
+        // cubic Hermite basis on [0,1] and its derivatives
+        double t2 = theta*theta, t3 = t2*theta;
+        double h00 = 2*t3 - 3*t2 + 1, h10 = t3 - 2*t2 + theta;
+        double h01 = -2*t3 + 3*t2,    h11 = t3 - t2;
+        double d00 = 6*t2 - 6*theta,  d10 = 3*t2 - 4*theta + 1, d11 = 3*t2 - 2*theta;
+        
+        // continuous extension of the classical Runge Kutta for qp, Kp_s = dt * stage accelerations
+        bool   rk4 = ( RespaInner==0 ) && ( Method==RungeKutta4 );
+        double b1 = theta - 1.5*t2 + 2*t3/3, b23 = t2 - 2*t3/3, b4 = -0.5*t2 + 2*t3/3;
+        
+        for( int i=0; i<Ndof; i++) {
+            
+            Work.qe[i]  = h00*Work.q0[i] + h10*h*Work.qp0[i] + h01*q[i] + h11*h*qp[i];
+            Work.qpe[i] = rk4 ? Work.qp0[i] + b1*Kp_0[i] + b23*( Kp_1[i] + Kp_2[i] ) + b4*Kp_3[i]
+                              : d00*( Work.q0[i] - q[i] )/h + d10*Work.qp0[i] + d11*qp[i];
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+double msSolverLagrangian::locateEvent(size_t e, double t0, double h, double g0, double g1) {
+    
+    // Illinois variant of the regula falsi on theta in [0,1]
+    double a = 0, b = 1, ga = g0, gb = g1;
+    int side = 0;
+    
+    for( int it=0; it<60 && ( b-a ) > 1e-14; it++) {
+        
+        double c = ( a*gb - b*ga ) / ( gb - ga );
+        interpolate(c, h);
+        double gc = Events[e](t0 + c*h, Work.qe, Work.qpe);
+        
+        if( gc == 0 ) return c;
+        
+        if( ( gc<0 ) == ( ga<0 ) ) { a = c; ga = gc;
+            if( side == -1 ) gb *= 0.5;
+            side = -1;
+        }
+        else { b = c; gb = gc;
+            if( side == +1 ) ga *= 0.5;
+            side = +1;
+        }
+    }
+    return b;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::allocateWorkspace(int n) {
+    
+    vector_type* vectors[] = { &K_0, &K_1, &K_2, &K_3, &Kp_0, &Kp_1, &Kp_2, &Kp_3, &rhs,
+                               &qFactor, &qppFsal,
+                               &Work.qtmp, &Work.qptmp, &Work.qpp,
+                               &Work.p, &Work.phalf, &Work.pnew, &Work.qnew,
+                               &Work.v0, &Work.v1, &Work.f, &Work.fslow, &Work.qslow, &Work.res,
+                               &Work.q0, &Work.qp0, &Work.qe, &Work.qpe,
+                               &Work.pc, &Work.xc, &Work.qpzero };
+    
+    for( auto v : vectors ) v->resize(n);
+    
+    A.resize(n,n);
+    KMatrix.resize(n,n);
+    KFactor.resize(n,n);
+    KPivot.resize(n);
+    
+    Work.B.resize(n,n);
+    Work.qWorker.resize(  AssemblyLagrangians.size() );
+    Work.qpWorker.resize( AssemblyLagrangians.size() );
+    for( size_t w=0; w<AssemblyLagrangians.size(); w++) { Work.qWorker[w].resize(n); Work.qpWorker[w].resize(n); }
+    
+    Work.Kq.resize(7);
+    Work.Kqp.resize(7);
+    for( int s=0; s<7; s++) { Work.Kq[s].resize(n); Work.Kqp[s].resize(n); }
+    
+    // default finite difference steps, relative to the initial state
+    if( Epsilon.size() != n ) { Epsilon.resize(n);
+        for( int i=0; i<n; i++) Epsilon[i] = 1e-5 * std::max( fabs(q[i]), 1. );
+    }
+    if( Epsilonp.size() != n ) { Epsilonp.resize(n);
+        for( int i=0; i<n; i++) Epsilonp[i] = 1e-5 * std::max( fabs(qp[i]), 1. );
+    }
+    ActiveValid = 0;
+    updateActive();
+    
+    KFactorValid = 0;
+    FsalValid    = 0;
+    FslowValid   = 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::updateActive() {
+    
+    // the mask is shared with the coordinates: Active is rebuilt only when they publish a new one
+    std::shared_ptr<const std::vector<size_t>> indices;
+    if( Coordinates ) indices = Coordinates->getActiveIndices();
+    if( ActiveValid && indices == ActiveIndices ) return;
+    
+    ATOMISM_EXCEPT_IF( [&](){ return indices && !indices->empty() && int(indices->back()) >= Ndof; } );
+    
+    Active.clear();
+    if( indices ) Active.assign( indices->begin(), indices->end() );
+    else          for( int i=0; i<Ndof; i++) Active.push_back(i);
+    nActive       = Active.size();
+    ActiveIndices = indices;
+    ActiveValid   = 1;
+    
+    // velocities of the frozen DoFs are zero
+    size_t a = 0;
+    for( int i=0; i<Ndof; i++) if( a<Active.size() && Active[a]==i ) a++; else qp[i] = 0;
+    
+    // the factorization, FSAL accelerations and slow forces were those of the previous mask
+    KFactorValid = 0;
+    FsalValid    = 0;
+    FslowValid   = 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+boost::shared_ptr<msTreeMapper> msSolverLagrangian::set_frozen(const std::vector<bool>& frozen) {
+    
+    ATOMISM_EXCEPT_IF( [&](){ return !Coordinates; } );
+    
+    size_t n = n_elements( Coordinates->getSnapshot()->Values );
+    ATOMISM_EXCEPT_IF( [&](){ return !frozen.empty() && frozen.size() != n; } );
+    
+    // one snapshot for the whole mask
+    std::vector<bool> active(n,true);
+    for( size_t i=0; i<frozen.size(); i++) active[i] = !frozen[i];
+    
+    Coordinates->setActiveMask(active);
+    return mySharedPtr();
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::updateEnergies() {
+    
+    // L(q,0) = -U(q) and L(q,qp) = T(q,qp) - U(q)
+    for( int i=0; i<Ndof; i++) Work.qpzero[i] = 0;
+    
+    Ep = -Lagrangien->L(q, Work.qpzero);
+    L  =  Lagrangien->L(q, qp);
+    Ek =  L + Ep;
+    
+    if( RespaInner>0 ) { double Us = SlowPotential(q);
+        Ep += Us;
+        L  -= Us;
+    }
+    Et =  Ek + Ep;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::step(double dt, double dtMax) {
+    
+    updateActive();
+    
+    if( Method!=DormandPrince || RespaInner>0 ) dt = std::min( dt, dtMax );
+    
+    if( RespaInner>0 ) return stepRespa(dt);
+    
+    switch(Method){
+            
+        case GeneralizedLeapfrog: return stepLeapfrog(dt);
+        case DormandPrince:       return stepDormandPrince(dt, dtMax);
+        default:                  return stepRK4(dt);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::stepRespa(double dt) {
+    
+    double t0 = t_current;
+    double h  = dt / RespaInner;
+    
+    if( !kickSlow(0.5*dt) ) return 0;
+    
+    for( int k=0; k<RespaInner; k++) {
+        
+        bool ok = ( Method==GeneralizedLeapfrog ) ? stepLeapfrog(h) : stepRK4(h);
+        if( !ok ) return 0;
+    }
+    
+    if( !kickSlow(0.5*dt) ) return 0;
+    
+    t_current = t0 + dt;
+    dtLast    = dt;
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::kickSlow(double h) {
+    
+    // the forces of the second half kick of a step are those of the first half kick of the next one
+    if( !FslowValid || ( relativeChange(q, Work.qslow) != 0 ) ) {
+        
+        vector_type& qs = Work.qslow;
+        qs = q;
+        
+        for( int a=0; a<nActive; a++) { int i = Active[a];
+            
+            qs[i] = q[i] + Epsilon[i];
+            double Up = SlowPotential(qs);
+            qs[i] = q[i] - Epsilon[i];
+            double Um = SlowPotential(qs);
+            qs[i] = q[i];
+            
+            Work.fslow[i] = -(Up-Um)/(2*Epsilon[i]);
+        }
+        FslowValid = 1;
+    }
+    
+    // delta p = h.F_slow, i.e. delta qp = h.K^-1(q).F_slow
+    if( !factorKinetic(q) ) return 0;
+    solveKinetic(Work.fslow, Work.v0);
+    
+    for( int i=0; i<Ndof; i++) qp[i] += h * Work.v0[i];
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::stepRK4(double dt) {
+    
+    vector_type& qtmp  = Work.qtmp;
+    vector_type& qptmp = Work.qptmp;
+    vector_type& qpp   = Work.qpp;
     
     if( !calc_qpp(q, qp, qpp) )  return 0;
     
@@ -176,20 +1074,175 @@ bool msSolverLagrangian::step(double dt) {
     
     //q2Coordinfo();
     t_current += dt;
+    dtLast     = dt;
     return 1;
 }
 
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-double msSolverLagrangian::diffq(int i, vector_type& q_, vector_type& qp_)
+bool msSolverLagrangian::stepLeapfrog(double dt) {
+    
+    vector_type& p     = Work.p;
+    vector_type& phalf = Work.phalf;
+    vector_type& pnew  = Work.pnew;
+    vector_type& qnew  = Work.qnew;
+    vector_type& v0    = Work.v0;
+    vector_type& v1    = Work.v1;
+    vector_type& f     = Work.f;
+    
+    if( !factorKinetic(q) ) return 0;
+    multiplyKinetic(qp, p);
+    
+    // half kick, implicit in p: p_1/2 = p_n + dt/2 * F(q_n, p_1/2)
+    for( int i=0; i<Ndof; i++) phalf[i] = p[i];
+    
+    // an iteration that does not contract is at the noise level of the finite differences
+    double stall = sqrt(ImplicitTol), previous = std::numeric_limits<double>::infinity();
+    
+    int it=0;
+    for( ; it<ImplicitMaxIt; it++) {
+        
+        if( !computeForces(q, phalf, v0, f) ) return 0;
+        for( int i=0; i<Ndof; i++) pnew[i] = p[i] + 0.5 * dt * f[i];
+        
+        double change = relativeChange(pnew, phalf);
+        for( int i=0; i<Ndof; i++) phalf[i] = pnew[i];
+        if( change < ImplicitTol || ( change >= previous && change < stall ) ) break;
+        previous = change;
+    }
+    if( it==ImplicitMaxIt ) return 0;
+    
+    // drift, implicit in q: q_n+1 = q_n + dt/2 * ( K^-1(q_n) + K^-1(q_n+1) ) p_1/2
+    solveKinetic(phalf, v0);
+    for( int i=0; i<Ndof; i++) qnew[i] = q[i] + dt * v0[i];
+    
+    previous = std::numeric_limits<double>::infinity();
+    for( it=0; it<ImplicitMaxIt; it++) {
+        
+        if( !factorKinetic(qnew) ) return 0;
+        solveKinetic(phalf, v1);
+        
+        double change = 0;
+        for( int i=0; i<Ndof; i++) {
+            
+            double qi = q[i] + 0.5 * dt * ( v0[i] + v1[i] );
+            change = std::max( change, fabs(qi-qnew[i]) / (fabs(qi)+Epsilon[i]) );
+            qnew[i] = qi;
+        }
+        if( change < ImplicitTol || ( change >= previous && change < stall ) ) break;
+        previous = change;
+    }
+    if( it==ImplicitMaxIt ) return 0;
+    
+    // second half kick, explicit: p_n+1 = p_1/2 + dt/2 * F(q_n+1, p_1/2)
+    if( !computeForces(qnew, phalf, v1, f) ) return 0;
+    for( int i=0; i<Ndof; i++) pnew[i] = phalf[i] + 0.5 * dt * f[i];
+    
+    for( int i=0; i<Ndof; i++) q[i] = qnew[i];
+    solveKinetic(pnew, qp);
+    
+    t_current += dt;
+    dtLast     = dt;
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::stepDormandPrince(double dt, double dtMax) {
+    
+    static const double c[7]    = { 0, 1./5, 3./10, 4./5, 8./9, 1, 1 };
+    static const double a[7][6] = {
+        { 0,             0,             0,             0,          0,              0       },
+        { 1./5,          0,             0,             0,          0,              0       },
+        { 3./40,         9./40,         0,             0,          0,              0       },
+        { 44./45,       -56./15,        32./9,         0,          0,              0       },
+        { 19372./6561,  -25360./2187,   64448./6561,  -212./729,   0,              0       },
+        { 9017./3168,   -355./33,       46732./5247,   49./176,   -5103./18656,    0       },
+        { 35./384,       0,             500./1113,     125./192,  -2187./6784,     11./84  } };
+    // difference between the 5th and the embedded 4th order weights
+    static const double e[7]    = { 71./57600, 0, -71./16695, 71./1920, -17253./339200, 22./525, -1./40 };
+    
+    const double safe = 0.9, beta = 0.04, expo = 0.2 - 0.75*beta;
+    const double facMin = 0.2, facMax = 10;
+    
+    vector_type& qtmp  = Work.qtmp;
+    vector_type& qptmp = Work.qptmp;
+    std::vector<vector_type>& Kq  = Work.Kq;
+    std::vector<vector_type>& Kqp = Work.Kqp;
+    
+    // the step proposed by the controller is clamped, e.g. not to overshoot t_tot
+    double h = std::min( dtNext>0 ? dtNext : dt, dtMax );
+    
+    if( !FsalValid ) {
+        
+        if( !calc_qpp(q, qp, qppFsal) ) return 0;
+        FsalValid = 1;
+    }
+    
+    while(1) {
+        
+        // a step shortened by the clamp only is not a failure
+        if( h < std::min( dtMin, dtMax ) ) return 0;
+        
+        for( int i=0; i<Ndof; i++) { Kq[0][i] = qp[i]; Kqp[0][i] = qppFsal[i]; }
+        
+        for( int s=1; s<7; s++) {
+            
+            for( int i=0; i<Ndof; i++) { qtmp[i] = q[i]; qptmp[i] = qp[i];
+                for( int r=0; r<s; r++) { qtmp[i]  += h * a[s][r] * Kq[r][i];
+                    qptmp[i] += h * a[s][r] * Kqp[r][i];
+                }
+                Kq[s][i] = qptmp[i];
+            }
+            if( !calc_qpp(qtmp, qptmp, Kqp[s]) ) return 0;
+        }
+        // the 7th stage is evaluated at the 5th order solution: qtmp, qptmp hold y_n+1
+        
+        double err = 0;
+        for( int i=0; i<Ndof; i++) {
+            
+            double eq = 0, eqp = 0;
+            for( int s=0; s<7; s++) { eq  += e[s] * Kq[s][i];
+                eqp += e[s] * Kqp[s][i];
+            }
+            double sq  = AbsTol + RelTol * std::max( fabs(q[i]),  fabs(qtmp[i])  );
+            double sqp = AbsTol + RelTol * std::max( fabs(qp[i]), fabs(qptmp[i]) );
+            err += pow( h*eq/sq , 2 ) + pow( h*eqp/sqp , 2 );
+        }
+        err = sqrt( err / (2*Ndof) );
+        
+        if( err <= 1 ) {
+            
+            double fac = err>0 ? safe * pow(err,-expo) * pow(ErrPrev,beta) : facMax;
+            fac = std::min( facMax, std::max( facMin, fac ) );
+            ErrPrev = std::max( err, 1e-4 );
+            
+            for( int i=0; i<Ndof; i++) { q[i] = qtmp[i]; qp[i] = qptmp[i];
+                qppFsal[i] = Kqp[6][i];
+            }
+            t_current += h;
+            dtLast     = h;
+            dtNext     = h * fac;
+            return 1;
+        }
+        // rejected step: shrink, never grow
+        h *= std::max( facMin, safe * pow(err,-expo) );
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+double msSolverLagrangian::diffq(int i, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien)
 {
     double L0, L1;
     
     q_[i] +=  Epsilon[i];
-    L1     =  Lagrangien->L(q_, qp_);
+    L1     =  lagrangien.L(q_, qp_);
     q_[i] -=  2*Epsilon[i];
-    L0     =  Lagrangien->L(q_, qp_);
+    L0     =  lagrangien.L(q_, qp_);
     q_[i] +=  Epsilon[i];
     
     return (L1-L0)/(2*Epsilon[i]);
@@ -198,21 +1251,21 @@ double msSolverLagrangian::diffq(int i, vector_type& q_, vector_type& qp_)
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-double msSolverLagrangian::diffpp(int i, int j, vector_type& q_, vector_type& qp_)
+double msSolverLagrangian::diffpp(int i, int j, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien)
 {
     double L00, L01, L10, L11;
     
     double epsilonp_i=Epsilonp[i]; double epsilonp_j=Epsilonp[j];
     
-    Lagrangien->GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
-    Lagrangien->KineticOperator->computeKMat( SiUnits );
+    lagrangien.GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
+    lagrangien.KineticOperator->computeKMat( SiUnits );
     
     qp_[i] += epsilonp_i;
     qp_[j] += epsilonp_j;
-    L11     = Lagrangien->L(q_, qp_, 0); qp_[j] -= 2*epsilonp_j;
-    L10     = Lagrangien->L(q_, qp_, 0); qp_[i] -= 2*epsilonp_i;
-    L00     = Lagrangien->L(q_, qp_, 0); qp_[j] += 2*epsilonp_j;
-    L01     = Lagrangien->L(q_, qp_, 0); qp_[j] -= epsilonp_j;
+    L11     = lagrangien.L(q_, qp_, 0); qp_[j] -= 2*epsilonp_j;
+    L10     = lagrangien.L(q_, qp_, 0); qp_[i] -= 2*epsilonp_i;
+    L00     = lagrangien.L(q_, qp_, 0); qp_[j] += 2*epsilonp_j;
+    L01     = lagrangien.L(q_, qp_, 0); qp_[j] -= epsilonp_j;
     qp_[i] += epsilonp_i;
     
     return ((L11-L01)/(2*epsilonp_i)-(L10-L00)/(2*epsilonp_i))/(2*epsilonp_j);
@@ -221,26 +1274,26 @@ double msSolverLagrangian::diffpp(int i, int j, vector_type& q_, vector_type& qp
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-double msSolverLagrangian::diffqp(int i, int j, vector_type& q_, vector_type& qp_) {
+double msSolverLagrangian::diffqp(int i, int j, vector_type& q_, vector_type& qp_, msLagrangian& lagrangien) {
     
     double L00, L01, L10, L11;
     
     q_[i]  += Epsilon[i];
     qp_[j] += Epsilonp[j];
-    Lagrangien->GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
-    Lagrangien->KineticOperator->computeKMat( SiUnits );
-    L11    = Lagrangien->L(q_, qp_,0);
+    lagrangien.GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
+    lagrangien.KineticOperator->computeKMat( SiUnits );
+    L11    = lagrangien.L(q_, qp_,0);
     
     qp_[j] -= 2*Epsilonp[j];
-    L10    = Lagrangien->L(q_, qp_,0);
+    L10    = lagrangien.L(q_, qp_,0);
     
     q_[i]  -= 2*Epsilon[i];
-    Lagrangien->GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
-    Lagrangien->KineticOperator->computeKMat( SiUnits );
-    L00    = Lagrangien->L(q_, qp_,0);
+    lagrangien.GeneralizedCoordinates->setUnfreezedValues(SiUnits,q_);
+    lagrangien.KineticOperator->computeKMat( SiUnits );
+    L00    = lagrangien.L(q_, qp_,0);
     
     qp_[j] += 2*Epsilonp[j];
-    L01    = Lagrangien->L(q_, qp_,0);
+    L01    = lagrangien.L(q_, qp_,0);
     
     qp_[j] -= Epsilonp[j];
     q_[i]  += Epsilon[i];
@@ -253,78 +1306,259 @@ double msSolverLagrangian::diffqp(int i, int j, vector_type& q_, vector_type& qp
 
 bool msSolverLagrangian::calc_qpp(vector_type& q_, vector_type& qp_, vector_type& qpp_)
 {
-    // Calculate system of equations
-    for (int i=0; i<Ndof; i++) {
+    // A = K(q) is symmetric and does not depend on qp: it is assembled on i<=j only,
+    // and its factorization is reused while q stays within KReuseTol of qFactor
+    bool reuse = KFactorValid && ( relativeChange(q_, qFactor) <= KReuseTol );
+    
+    if( Pool ) {
         
-        rhs[i] = diffq(i,q_,qp_);
-        for (int j=0; j<Ndof; j++) {
-            
-            A(i,j) = diffpp(j,i,q_,qp_);
+        if( !( assembleParallel(q_, qp_, !reuse) && ( reuse || factorAssembled(q_) ) ) ) {
+            printError(AijError); return 0;
+        }
+    }
+    else {
+        
+        if( !reuse && !( assembleKinetic(q_) && factorAssembled(q_) ) ) { printError(AijError); return 0; }
+        
+        // compacted on the active DoFs, the velocities of the frozen ones being zero
+        for (int a=0; a<nActive; a++) { int i = Active[a];
             
-            if(A(i,j)==0){ printError(AijError); return 0;  }
+            rhs[a] = diffq(i,q_,qp_);
             // calculate B
-            rhs[i] -= diffqp(j,i,q_,qp_) * qp_[j];
+            for (int b=0; b<nActive; b++) { int j = Active[b];
+                rhs[a] -= diffqp(j,i,q_,qp_) * qp_[j];
+            }
         }
     }
     // Solve A * q'' = rhs
-    solve(A,rhs,qpp_);
+    solveCompact(rhs,Work.xc);
+    
+    for (int i=0; i<Ndof; i++) qpp_[i] = 0;
+    for (int a=0; a<nActive; a++) qpp_[Active[a]] = Work.xc[a];
     return 1;
 }
 
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-void msSolverLagrangian::solve(matrix_type& A, vector_type& v, vector_type& w ) {
+bool msSolverLagrangian::assembleParallel(vector_type& q_, vector_type& qp_, bool withKinetic) {
     
-    if (Ndof==2) { solve2(A, v, w); return;
-    }
+    // one task per (i,j): each task works on private copies of q_ and qp_ and on the
+    // Lagrangian of its worker, and writes its own elements of A, B and rhs only.
+    // The reduction of B.qp is done afterwards in a fixed order: the result does not
+    // depend on the number of threads or on the scheduling.
     
-    int* r = new int[Ndof];  // indexing rows and columns for quick reordering
-    int* c = new int[Ndof];
-    int  n = 0;              // n is the total number of unconstrained rows
+    std::atomic<bool> invalid(0);
     
-    for (int i=0; i<Ndof; i++) { c[n]=i; r[n]=i; n++;
-    }
+    // compacted on the active DoFs: (a,b) -> (Active[a],Active[b])
+    Pool->parallelFor( nActive*nActive, [&](size_t task, size_t worker) {
+        
+        int a = task / nActive, i = Active[a];
+        int b = task % nActive, j = Active[b];
+        
+        vector_type&  qw  = Work.qWorker[worker];
+        vector_type&  qpw = Work.qpWorker[worker];
+        msLagrangian& lag = *AssemblyLagrangians[worker];
+        
+        qw = q_; qpw = qp_;
+        Work.B(a,b) = diffqp(j,i,qw,qpw,lag);
+        
+        if( withKinetic && (b>=a) ) {
+            
+            qw = q_; qpw = qp_;
+            A(a,b) = A(b,a) = diffpp(j,i,qw,qpw,lag);
+            if( !std::isfinite(A(a,b)) ) invalid = 1;
+        }
+        if( a==b ) {
+            
+            qw = q_; qpw = qp_;
+            rhs[a] = diffq(i,qw,qpw,lag);
+        }
+    });
     
-    for (int j=0; j<n-1; j++) {  // make j'th column zero from j+1'st row
+    for (int a=0; a<nActive; a++)
+        for (int b=0; b<nActive; b++) rhs[a] -= Work.B(a,b) * qp_[Active[b]];
+    
+    if( withKinetic ) KFactorValid = 0;
+    return !invalid;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::factorKinetic(vector_type& q_) {
+    
+    if( KFactorValid && ( relativeChange(q_, qFactor) <= KReuseTol ) ) return 1;
+    
+    return assembleKinetic(q_) && factorAssembled(q_);
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::assembleKinetic(vector_type& q_) {
+    
+    KFactorValid = 0;
+    
+    if( Pool ) {
         
-        for (int i=j+1; i<n; i++) {  // make Aij zero
+        std::atomic<bool> invalid(0);
+        
+        Pool->parallelFor( nActive*(nActive+1)/2, [&](size_t task, size_t worker) {
             
-            if (fabs(A( r[j] , c[j] ) )<fabs(A(r[i],c[j]) )) {
-                int tmp;
-                tmp=r[i]; r[i]=r[j]; r[j]=tmp;
-            }
+            // task -> (a,b), b>=a
+            int a = 0, n = nActive;
+            while( task >= size_t(n) ) { task -= n; n--; a++; }
+            int b = a + task;
             
-            if (A(r[i],c[j]) != 0.0) {
-                double m = A(r[i] , c[j]) / A( r[j] , c[j]);
-                
-                for (int k=j; k<n; k++)  A(r[i] , c[k]) -= m*A( r[j] , c[k]);
-                
-                v[r[i]] -= m*v[r[j]];
-            }
+            vector_type& qw  = Work.qWorker[worker];
+            vector_type& qpw = Work.qpWorker[worker];
+            qw = q_; qpw = qp;
+            
+            A(a,b) = A(b,a) = diffpp(Active[b],Active[a],qw,qpw,*AssemblyLagrangians[worker]);
+            if( !std::isfinite(A(a,b)) ) invalid = 1;
+        });
+        return !invalid;
+    }
+    
+    // K = d2L/dqp2 does not depend on qp, the current velocities are used for the differences
+    for( int a=0; a<nActive; a++)
+        for( int b=a; b<nActive; b++) {
+            
+            A(a,b) = A(b,a) = diffpp(Active[b],Active[a],q_,qp);
+            if( !std::isfinite(A(a,b)) ) return 0;
+        }
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::factorAssembled(vector_type& q_) {
+    
+    KFactorValid = 0;
+    KRegularized = 0;
+    qFactor      = q_;
+    KMatrix = A;
+    KFactor = A;
+    
+    // all the DoFs frozen: nothing to solve
+    if( nActive==0 ) { KCholesky = 1; KFactorValid = 1; return 1; }
+    
+    // K (compacted on the active DoFs) is positive definite away from the singular
+    // configurations: Cholesky
+    KCholesky = cholesky(KFactor, nActive);
+    
+    // 1-norm conditioning estimated from the factor (a few solves, O(nActive^2) each);
+    // the ratio of the diagonal of the factor misses the couplings of the DoFs, e.g. a
+    // linear bend seen through the Cartesian displacements of its atoms.
+    // Work.pc and Work.xc are only used by the solves, not during the factorization.
+    double cond = 0;
+    if( KCholesky ) cond = choleskyCondition(KMatrix, KFactor, nActive, Work.pc, Work.xc);
+    
+    if( ( CondMax>0 ) && ( !KCholesky || ( cond > CondMax ) ) ) {
+        
+        // close to a singular configuration: damped system (K + mu.I), mu relative to tr(K)/nActive
+        double mu = 0;
+        for( int i=0; i<nActive; i++) mu += fabs( KMatrix(i,i) );
+        mu *= Regularization / nActive;
+        
+        KFactor = KMatrix;
+        for( int i=0; i<nActive; i++) KFactor(i,i) += mu;
+        
+        KRegularized = 1;
+        nRegularized++;
+        KCholesky = cholesky(KFactor, nActive);
+        
+        if( !KCholesky ) {
+            
+            KFactor = KMatrix;
+            for( int i=0; i<nActive; i++) KFactor(i,i) += mu;
         }
     }
-    // calculate result vector
+    else if( !KCholesky ) KFactor = KMatrix;
+    
+    // fallback on a pivoted LU if the Cholesky factorization breaks down
+    if( !KCholesky && !luFactor(KFactor, nActive, KPivot) ) return 0;
+    
+    KFactorValid = 1;
+    return 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::solveKinetic(const vector_type& p_, vector_type& qp_) {
     
-    for (int j=n-1; j>=0; j--) {
+    for( int a=0; a<nActive; a++) Work.pc[a] = p_[Active[a]];
+    
+    solveCompact(Work.pc, Work.xc);
+    
+    for( int i=0; i<Ndof; i++) qp_[i] = 0;
+    for( int a=0; a<nActive; a++) qp_[Active[a]] = Work.xc[a];
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::solveCompact(const vector_type& b, vector_type& x) {
+    
+    int n = nActive;
+    for( int i=0; i<n; i++) x[i] = b[i];
+    
+    if( KCholesky ) choleskySolve(KFactor, n, x);
+    else            luSolve(KFactor, n, KPivot, x);
+    
+    // iterated Tikhonov: x += (K+mu.I)^-1 (b - K.x), bounded in the singular directions
+    for( int it=0; KRegularized && ( it<RegularizationRefinements ); it++) {
         
-        double b=v[r[j]];
-        for (int k=j+1; k<n; k++)  b-=w[c[k]]*A( r[j] , c[k]);
+        vector_type& res = Work.res;
+        for( int i=0; i<n; i++) { res[i] = b[i];
+            for( int j=0; j<n; j++) res[i] -= KMatrix(i,j) * x[j];
+        }
+        if( KCholesky ) choleskySolve(KFactor, n, res);
+        else            luSolve(KFactor, n, KPivot, res);
         
-        w[c[j]] = b / A( r[j] , c[j]);
+        for( int i=0; i<n; i++) x[i] += res[i];
     }
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void msSolverLagrangian::multiplyKinetic(const vector_type& qp_, vector_type& p_) const {
+    
+    // p = K(qFactor).qp = dL/dqp, K being compacted on the active DoFs
+    for( int i=0; i<Ndof; i++) p_[i] = 0;
+    for( int a=0; a<nActive; a++)
+        for( int b=0; b<nActive; b++) p_[Active[a]] += KMatrix(a,b) * qp_[Active[b]];
+}
+
+//-------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool msSolverLagrangian::computeForces(vector_type& q_, const vector_type& p_,
+                                       vector_type& qp_, vector_type& f_) {
     
-    delete[] r;delete[] c;
+    // dH/dq at constant p is -dL/dq at constant qp, with qp = K^-1(q).p
+    if( !factorKinetic(q_) ) return 0;
+    solveKinetic(p_, qp_);
+    
+    for( int i=0; i<Ndof; i++) f_[i] = 0;
+    for( int a=0; a<nActive; a++) f_[Active[a]] = diffq(Active[a], q_, qp_);
+    return 1;
 }
 
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-void msSolverLagrangian::solve2(matrix_type& A, vector_type& v, vector_type& w) {
+double msSolverLagrangian::relativeChange(const vector_type& x, const vector_type& y) const {
     
-    double det=A.determinant();
-    w[0]=( A(1,1)*v[0]-A(0,1)*v[1])/det;
-    w[1]=(-A(1,0)*v[0]+A(0,0)*v[1])/det;
+    double dx=0, nx=0;
+    for( int i=0; i<Ndof; i++) { dx = std::max( dx, fabs(x[i]-y[i]) );
+        nx = std::max( nx, fabs(x[i]) );
+    }
+    return nx>0 ? dx/nx : dx;
 }
 
 //-------------------------------------------------------------------------------------------------
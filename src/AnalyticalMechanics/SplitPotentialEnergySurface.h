@@ -0,0 +1,124 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file SplitPotentialEnergySurface.h Potential energy surface defined as the sum of a fast and a slow part
+
+#ifndef SPLITPOTENTIALENERGYSURFACE_H
+#define SPLITPOTENTIALENERGYSURFACE_H
+
+#include <PotentialEnergySurface.h>
+
+namespace atomism {
+    
+    /** \class SplitPotentialEnergySurface
+     *
+     * \brief Potential energy surface defined as the sum of a fast and a slow part
+     *
+     * \f$ U = U_{fast} + U_{slow} \f$, where \f$ U_{fast} \f$ gathers the cheap and stiff
+     * contributions (bonds, bends) and \f$ U_{slow} \f$ the expensive and soft ones (torsions,
+     * long range interactions). Used as a whole, it behaves as any other surface.
+     * For multiple time step integration (see msSolverLagrangian::set_respa), the Lagrangian
+     * is built with getFast() and the slow part is evaluated separately by evaluateSlow.
+     */
+    template<
+    typename TheEntity,
+    typename FastPES,
+    typename SlowPES,
+    typename Scalar      = double,
+    typename Vector      = std::vector<Scalar>,
+    typename Matrix      = std::vector< std::vector<Scalar> >,
+    typename Positions   = std::tuple<Vector&,Vector&,Vector&>
+    >
+    class SplitPotentialEnergySurface : public PotentialEnergySurface<
+    TheEntity, SplitPotentialEnergySurface<TheEntity,FastPES,SlowPES,Scalar,Vector,Matrix,Positions>,
+    Scalar, Vector, Matrix, Positions > {
+        
+        typedef PotentialEnergySurface<
+        TheEntity, SplitPotentialEnergySurface<TheEntity,FastPES,SlowPES,Scalar,Vector,Matrix,Positions>,
+        Scalar, Vector, Matrix, Positions >  Base;
+        
+    public:
+        
+        typedef typename Base::ConstPositions ConstPositions;
+        
+        SplitPotentialEnergySurface( std::shared_ptr<const TheEntity> entity ,
+                                     std::shared_ptr<const FastPES>   fast,
+                                     std::shared_ptr<const SlowPES>   slow,
+                                     std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource
+                                    );
+        
+        using Base::evaluate;
+        
+        //! \f$ U_{fast}+U_{slow} \f$ at the positions coors of the coordinates q
+        Scalar evaluate(const GeneralizedCoordinates<Scalar,Vector>& q,
+                        const ConstPositions& coors) const;
+        
+        //! fast part of the potential at q
+        Scalar evaluateFast(const GeneralizedCoordinates<Scalar,Vector>& q) const { return _Fast->evaluate(q); }
+        
+        //! slow part of the potential at q
+        Scalar evaluateSlow(const GeneralizedCoordinates<Scalar,Vector>& q) const { return _Slow->evaluate(q); }
+        
+        std::shared_ptr<const FastPES> getFast() const { return _Fast; }
+        
+        std::shared_ptr<const SlowPES> getSlow() const { return _Slow; }
+        
+    private:
+        
+        SplitPotentialEnergySurface();
+        
+        std::shared_ptr<const FastPES> _Fast;
+        std::shared_ptr<const SlowPES> _Slow;
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename FastPES, typename SlowPES, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    SplitPotentialEnergySurface<TheEntity,FastPES,SlowPES,Scalar,Vector,Matrix,Positions>
+    ::SplitPotentialEnergySurface( std::shared_ptr<const TheEntity> entity ,
+                                   std::shared_ptr<const FastPES>   fast,
+                                   std::shared_ptr<const SlowPES>   slow,
+                                   std::shared_ptr<ResourceManager<Scalar,Vector,Matrix>> resource)
+    : Base(entity,resource), _Fast(fast), _Slow(slow) {
+        
+        ATOMISM_LOG();
+        ATOMISM_EXCEPT_IF( [&](){ return !_Fast || !_Slow; } );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    template<
+    typename TheEntity, typename FastPES, typename SlowPES, typename Scalar, typename Vector ,
+    typename Matrix , typename Positions
+    >
+    inline
+    Scalar SplitPotentialEnergySurface<TheEntity,FastPES,SlowPES,Scalar,Vector,Matrix,Positions>
+    ::evaluate(const GeneralizedCoordinates<Scalar,Vector>& q, const ConstPositions& coors) const {
+        
+        ATOMISM_LOG();
+        return _Fast->evaluate(q,coors) + _Slow->evaluate(q,coors);
+    }
+}
+#endif // SPLITPOTENTIALENERGYSURFACE_H
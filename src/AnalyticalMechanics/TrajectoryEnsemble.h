@@ -0,0 +1,264 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file TrajectoryEnsemble.h Dynamic of an ensemble of independent trajectories
+
+#ifndef TRAJECTORYENSEMBLE_H
+#define TRAJECTORYENSEMBLE_H
+
+#include <SolverLagrangian.h>
+#include <ThreadPool.h>
+#include <Checkpoint.h>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+
+namespace atomism {
+    
+    /** \class TrajectoryEnsemble
+     *
+     * \brief Runs an ensemble of independent trajectories over a pool of threads
+     *
+     * Rates and thermodynamic estimates are obtained from many independent trajectories.
+     * Each worker of the ensemble owns a solver and a Lagrangian, created once by the
+     * WorkerFactory: the factory is expected to build the Lagrangian (entity, kinetic
+     * operator and PES) on a ResourceManager of its own, so that the workers share no
+     * mutable state.
+     *
+     * The trajectories are distributed by work stealing (see ThreadPool::parallelForStealing):
+     * trajectories of uneven lengths are balanced between the workers.
+     * For each trajectory, the initial conditions are given by the InitialConditions
+     * function, and the TrajectoryCallback is called with the solver once the trajectory
+     * is completed. Both are called from the worker threads, concurrently: they must be
+     * thread safe. To obtain reproducible ensembles, the initial conditions should only
+     * depend on the index of the trajectory (e.g. a random generator seeded by the index). \n
+     * Checkpoints (see setCheckpoint): the set of completed trajectories is saved on a wall
+     * clock cadence. After restart, run() only integrates the trajectories not completed; as
+     * the initial conditions only depend on the index, the trajectories interrupted are
+     * started again from the beginning. \n
+     * A trajectory is recorded as completed once its callback has returned: the callbacks
+     * are delivered at least once. The callback of a trajectory completed after the last
+     * checkpoint is called again after restart, with the same solver state: the callbacks
+     * must be idempotent (e.g. store the result of the trajectory at its index). With such
+     * callbacks, the restarted ensemble is identical to the uninterrupted one. \n
+     * The ensemble checkpoint holds the completion flags only, not the state of the
+     * trajectories in progress: an interruption costs at most one trajectory per worker.
+     * The state of a single long trajectory is saved by the solver itself, in a file of
+     * its own (see msSolverLagrangian::set_checkpoint).
+     */
+    class TrajectoryEnsemble {
+        
+    public:
+        
+        //! solver and Lagrangian owned by a worker
+        struct Worker {
+            
+            boost::shared_ptr<msSolverLagrangian>  Solver;
+            std::shared_ptr<msLagrangian>          Lagrangian;
+        };
+        
+        //! create the Worker of index 'worker'
+        typedef std::function<Worker(size_t worker)>                                     WorkerFactory;
+        
+        //! fill the initial coordinates and velocities of the trajectory 'trajectory'
+        typedef std::function<void(size_t trajectory, vector_type& q0, vector_type& qp0)> InitialConditions;
+        
+        //! called when the trajectory 'trajectory' is completed (see msSolverLagrangian::getStatus for a failed one)
+        typedef std::function<void(size_t trajectory, const msSolverLagrangian& solver)>  TrajectoryCallback;
+        
+        /** \brief constructor
+         *
+         * \param nWorkers number of workers (threads, including the calling one)
+         * \param factory creates the solver and the Lagrangian of each worker
+         */
+        TrajectoryEnsemble(size_t nWorkers, WorkerFactory factory);
+        
+        /** \brief run the trajectories
+         *
+         * \param nTrajectories number of trajectories
+         * \param E total energy of the trajectories [J] (see msSolverLagrangian::dynamic)
+         * \param init initial conditions
+         * \param done callback called at the end of each trajectory, idempotent (see the class)
+         */
+        void run(size_t nTrajectories, double E, InitialConditions init, TrajectoryCallback done);
+        
+        size_t noOfWorkers() const { return _Workers.size(); }
+        
+        const Worker& getWorker(size_t i) const { return _Workers[i]; }
+        
+        /** \brief save the completed trajectories every 'period' seconds of wall clock time
+         *
+         * \param filename checkpoint file
+         * \param period [s], 0 saves only at the end of run()
+         */
+        void setCheckpoint(const std::string& filename, double period);
+        
+        //! restore the completed trajectories from a checkpoint file
+        void restart(const std::string& filename);
+        
+        //! save the completed trajectories
+        void saveCheckpoint(const std::string& filename);
+        
+        //! number of trajectories completed
+        size_t noOfCompleted() const;
+        
+    private:
+        
+        TrajectoryEnsemble();
+        
+        //! run the trajectory 'trajectory' on the worker 'worker'
+        void runTrajectory(size_t trajectory, size_t worker, double E, InitialConditions& init);
+        
+        //! write the completion flags, _CheckpointMutex being locked
+        void writeCheckpoint(const std::string& filename) const;
+        
+        std::vector<Worker>       _Workers;
+        
+        std::vector<vector_type>  _q0;      //!< initial coordinates buffer of each worker
+        std::vector<vector_type>  _qp0;     //!< initial velocities buffer of each worker
+        
+        ThreadPool                _Pool;
+        
+        //! @name Checkpoints
+        //@{
+        std::vector<char>         _Completed;       //!< completion flag of each trajectory
+        bool                      _Restarted;       //!< true if _Completed has been restored
+        std::string               _CheckpointFile;
+        CheckpointClock           _CheckpointCadence;
+        mutable std::mutex        _CheckpointMutex;
+        //@}
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    TrajectoryEnsemble::TrajectoryEnsemble(size_t nWorkers, WorkerFactory factory)
+    : _q0(nWorkers), _qp0(nWorkers), _Pool(nWorkers), _Restarted(0) {
+        
+        ATOMISM_LOG();
+        ATOMISM_EXCEPT_IF( [&](){ return nWorkers==0; } );
+        
+        for(size_t i=0; i<nWorkers; i++) _Workers.push_back( factory(i) );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::run(size_t nTrajectories, double E, InitialConditions init, TrajectoryCallback done) {
+        
+        ATOMISM_LOG();
+        
+        // a checkpoint restored by restart() must describe the same ensemble
+        if( !_Restarted ) _Completed.assign( nTrajectories, 0 );
+        ATOMISM_VALUE_MISMATCH( [&](){return _Completed.size();}, [&](){return nTrajectories;} );
+        _Restarted = 0;
+        
+        _CheckpointCadence.reset();
+        
+        _Pool.parallelForStealing( nTrajectories, [&](size_t trajectory, size_t worker) {
+            
+            if( _Completed[trajectory] ) return;
+            
+            runTrajectory(trajectory, worker, E, init);
+            done( trajectory, *_Workers[worker].Solver );
+            
+            // recorded after the callback: a restart never loses a trajectory
+            std::lock_guard<std::mutex> lock(_CheckpointMutex);
+            _Completed[trajectory] = 1;
+            if( !_CheckpointFile.empty() && _CheckpointCadence.due() ) writeCheckpoint(_CheckpointFile);
+        });
+        
+        if( !_CheckpointFile.empty() ) saveCheckpoint(_CheckpointFile);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::setCheckpoint(const std::string& filename, double period) {
+        
+        _CheckpointFile = filename;
+        _CheckpointCadence.setPeriod(period);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::restart(const std::string& filename) {
+        
+        ATOMISM_LOG();
+        
+        CheckpointReader in(filename);
+        in.expect("TrajectoryEnsemble");
+        
+        std::lock_guard<std::mutex> lock(_CheckpointMutex);
+        in.readVector(_Completed);
+        _Restarted = 1;
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::saveCheckpoint(const std::string& filename) {
+        
+        std::lock_guard<std::mutex> lock(_CheckpointMutex);
+        writeCheckpoint(filename);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::writeCheckpoint(const std::string& filename) const {
+        
+        CheckpointWriter out(filename);
+        out.writeString("TrajectoryEnsemble");
+        out.writeVector(_Completed);
+        out.commit();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    size_t TrajectoryEnsemble::noOfCompleted() const {
+        
+        std::lock_guard<std::mutex> lock(_CheckpointMutex);
+        return std::count( _Completed.begin(), _Completed.end(), 1 );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void TrajectoryEnsemble::runTrajectory(size_t trajectory, size_t worker, double E, InitialConditions& init) {
+        
+        Worker& w = _Workers[worker];
+        
+        init( trajectory, _q0[worker], _qp0[worker] );
+        
+        w.Solver->set_initialConditions( _q0[worker], _qp0[worker] );
+        w.Solver->dynamic( *w.Lagrangian, E );
+    }
+}
+#endif // TRAJECTORYENSEMBLE_H
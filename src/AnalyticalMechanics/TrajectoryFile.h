@@ -0,0 +1,681 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file TrajectoryFile.h Binary trajectory files: asynchronous writer and memory mapped reader
+
+#ifndef TRAJECTORYFILE_H
+#define TRAJECTORYFILE_H
+
+#include <Exceptions.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef ATOMISM_USE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace atomism {
+
+    /** \class TrajectoryFile
+     *
+     * \brief Layout of the binary trajectory files
+     *
+     * A file is made of a header, a sequence of chunks and an index:
+     *  - header: the magic "ATMTRAJ1", the number of DoFs, the number of frames per chunk,
+     * then the name and the unit of each DoF (uint32 length followed by the characters).
+     *  - chunk: the number of frames, the compression (0: none, 1: zlib) and the number of
+     * bytes stored, followed by the frames. A frame is the sequence of doubles
+     * t, q[0..n-1], qp[0..n-1], Ek, Ep.
+     *  - index: the offset and the first frame of each chunk, followed by the number of
+     * chunks, the number of frames, the offset of the index and the magic "ATMTRIDX".
+     *
+     * The header and the chunks are padded to 8 bytes, so that the uncompressed frames
+     * can be read in place from a memory map. The numbers are stored in the native byte
+     * order. If the index is missing (the writer has not been closed), the reader
+     * recovers the complete chunks by scanning the file.
+     */
+    struct TrajectoryFile {
+
+        static const char* magic()      { return "ATMTRAJ1"; }
+        static const char* indexMagic() { return "ATMTRIDX"; }
+
+        enum Compression { None=0, Zlib=1 };
+
+        struct ChunkHeader {
+
+            uint32_t nFrames;
+            uint32_t Compression;
+            uint64_t StoredBytes;
+        };
+
+        struct Trailer {
+
+            uint64_t nChunks;
+            uint64_t nFrames;
+            uint64_t IndexOffset;
+            char     Magic[8];
+        };
+
+        static uint64_t padding(uint64_t n) { return ( 8 - n%8 ) % 8; }
+
+        //! number of doubles in a frame
+        static size_t frameSize(size_t nDof) { return 2*nDof + 3; }
+    };
+
+    /** \class TrajectoryWriter
+     *
+     * \brief Writes a trajectory file from a background thread
+     *
+     * The frames are appended to the current chunk by write(); once full, the chunk is
+     * handed to the writer thread, which compresses it (zlib, if ATOMISM_USE_ZLIB is
+     * defined and the compression is requested) and writes it to the file. The thread
+     * calling write() never waits for the disk: the buffers of the written chunks are
+     * recycled. An error of the writer thread is rethrown by the next call to write(),
+     * flush() or close(). \n
+     * write() is not thread safe: a writer is fed by a single solver.
+     */
+    class TrajectoryWriter {
+
+    public:
+
+        /** \brief constructor, writes the header
+         *
+         * \param filename name of the file
+         * \param names name of each DoF
+         * \param units unit of each DoF
+         * \param framesPerChunk number of frames per chunk
+         * \param compress compress the chunks (ignored if ATOMISM_USE_ZLIB is not defined)
+         */
+        TrajectoryWriter(const std::string& filename,
+                         const std::vector<std::string>& names, const std::vector<std::string>& units,
+                         size_t framesPerChunk = 1024, bool compress = false);
+
+        ~TrajectoryWriter();
+
+        //! append a frame
+        template<class Vector>
+        void write(double t, const Vector& q, const Vector& qp, double Ek, double Ep);
+
+        //! hand the current (partial) chunk to the writer thread
+        void flush();
+
+        //! write the pending chunks and the index, and close the file
+        void close();
+
+        size_t noOfDofs()   const { return _nDof; }
+
+        size_t noOfFrames() const { return _nFrames; }
+
+    private:
+
+        TrajectoryWriter();
+        TrajectoryWriter(const TrajectoryWriter&);
+
+        struct Chunk {
+
+            std::vector<double> Frames;
+            size_t              nFrames;
+        };
+
+        void rethrow();
+        void writerLoop();
+        void writeChunk(Chunk& chunk);
+        void writeBytes(const void* data, uint64_t n);
+
+        std::ofstream             _File;
+        uint64_t                  _Offset;          //!< current position in the file
+
+        size_t                    _nDof;
+        size_t                    _FramesPerChunk;
+        bool                      _Compress;
+        size_t                    _nFrames;
+
+        Chunk                     _Current;
+
+        //! @name shared with the writer thread
+        //@{
+        std::deque<Chunk>                 _Queue;
+        std::vector<std::vector<double> > _Free;      //!< recycled chunk buffers
+        std::mutex                        _Mutex;
+        std::condition_variable           _Condition;
+        bool                              _Closing;
+        std::exception_ptr                _Error;
+        //@}
+
+        std::vector<uint64_t>     _Offsets;         //!< offset of each chunk (writer thread)
+        std::vector<uint64_t>     _FirstFrames;     //!< first frame of each chunk (writer thread)
+        uint64_t                  _nWritten;        //!< frames written (writer thread)
+        std::vector<char>         _Compressed;      //!< compression buffer (writer thread)
+
+        std::thread               _Thread;
+    };
+
+    /** \class TrajectoryReader
+     *
+     * \brief Random access to the frames of a trajectory file
+     *
+     * The file is memory mapped: the frames of the uncompressed chunks are read in place,
+     * a compressed chunk is decompressed when one of its frames is accessed (the last
+     * decompressed chunk is kept). The reader is not thread safe; concurrent analyses
+     * should use one reader per thread.
+     */
+    class TrajectoryReader {
+
+    public:
+
+        TrajectoryReader(const std::string& filename);
+
+        ~TrajectoryReader();
+
+        size_t noOfDofs()   const { return _nDof; }
+
+        size_t noOfFrames() const { return _nFrames; }
+
+        const std::vector<std::string>& getNames() const { return _Names; }
+
+        const std::vector<std::string>& getUnits() const { return _Units; }
+
+        //! pointer to the frame i: t, q[0..n-1], qp[0..n-1], Ek, Ep
+        const double* frame(size_t i);
+
+        //! read the frame i
+        template<class Vector>
+        void readFrame(size_t i, double& t, Vector& q, Vector& qp, double& Ek, double& Ep);
+
+        double getTime(size_t i) { return frame(i)[0]; }
+
+    private:
+
+        TrajectoryReader();
+        TrajectoryReader(const TrajectoryReader&);
+
+        struct ChunkEntry {
+
+            uint64_t Offset;
+            uint64_t FirstFrame;
+            TrajectoryFile::ChunkHeader Header;
+        };
+
+        template<class T> T read(uint64_t& offset) const;
+
+        void readHeader(uint64_t& offset);
+        bool readIndex();
+        void scanChunks(uint64_t offset);
+
+        int                       _Fd;
+        const char*               _Map;
+        uint64_t                  _Size;
+
+        size_t                    _nDof;
+        size_t                    _FramesPerChunk;
+        size_t                    _nFrames;
+        std::vector<std::string>  _Names;
+        std::vector<std::string>  _Units;
+
+        std::vector<ChunkEntry>   _Chunks;
+
+        size_t                    _Cached;          //!< chunk held by _Buffer
+        std::vector<double>       _Buffer;          //!< decompressed chunk
+    };
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    TrajectoryWriter::TrajectoryWriter(const std::string& filename,
+                                       const std::vector<std::string>& names, const std::vector<std::string>& units,
+                                       size_t framesPerChunk, bool compress)
+    : _Offset(0), _nDof(names.size()), _FramesPerChunk(framesPerChunk), _Compress(compress), _nFrames(0),
+      _Closing(0), _nWritten(0) {
+
+        ATOMISM_LOG();
+        ATOMISM_VALUE_MISMATCH( [&](){return names.size();}, [&](){return units.size();} );
+        ATOMISM_EXCEPT_IF( [&](){ return framesPerChunk==0; } );
+
+#ifndef ATOMISM_USE_ZLIB
+        _Compress = 0;
+#endif
+        _File.open( filename.c_str(), std::ios::binary | std::ios::trunc );
+        if( !_File ) ATOMISM_THROW( "can not open the trajectory file " + filename );
+
+        uint32_t n = _nDof, nChunk = _FramesPerChunk;
+        writeBytes( TrajectoryFile::magic(), 8 );
+        writeBytes( &n, 4 );
+        writeBytes( &nChunk, 4 );
+
+        for( size_t i=0; i<_nDof; i++) {
+
+            uint32_t l = names[i].size();
+            writeBytes( &l, 4 ); writeBytes( names[i].data(), l );
+            l = units[i].size();
+            writeBytes( &l, 4 ); writeBytes( units[i].data(), l );
+        }
+        uint64_t zero = 0;
+        writeBytes( &zero, TrajectoryFile::padding(_Offset) );
+
+        _Current.Frames.reserve( _FramesPerChunk * TrajectoryFile::frameSize(_nDof) );
+        _Current.nFrames = 0;
+
+        _Thread = std::thread( [this](){ writerLoop(); } );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    TrajectoryWriter::~TrajectoryWriter() {
+
+        try { close(); }
+        catch(...) {}
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Vector>
+    void TrajectoryWriter::write(double t, const Vector& q, const Vector& qp, double Ek, double Ep) {
+
+        ATOMISM_VALUE_MISMATCH( [&](){return size_t(q.size());}, [&](){return _nDof;} );
+
+        std::vector<double>& frames = _Current.Frames;
+        frames.push_back(t);
+        for( size_t i=0; i<_nDof; i++) frames.push_back( q[i] );
+        for( size_t i=0; i<_nDof; i++) frames.push_back( qp[i] );
+        frames.push_back(Ek);
+        frames.push_back(Ep);
+
+        _nFrames++;
+        if( ++_Current.nFrames == _FramesPerChunk ) flush();
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::flush() {
+
+        rethrow();
+        if( _Current.nFrames == 0 ) return;
+
+        std::lock_guard<std::mutex> lock(_Mutex);
+
+        _Queue.push_back( Chunk() );
+        _Queue.back().Frames.swap( _Current.Frames );
+        _Queue.back().nFrames = _Current.nFrames;
+
+        _Current.nFrames = 0;
+        if( !_Free.empty() ) { _Current.Frames.swap( _Free.back() ); _Free.pop_back(); }
+        else _Current.Frames.reserve( _FramesPerChunk * TrajectoryFile::frameSize(_nDof) );
+
+        _Condition.notify_all();
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::close() {
+
+        if( !_Thread.joinable() ) return;
+
+        ATOMISM_LOG();
+
+        bool failed;
+        { std::lock_guard<std::mutex> lock(_Mutex);
+            failed = bool(_Error);
+        }
+        if( !failed ) flush();
+
+        { std::lock_guard<std::mutex> lock(_Mutex);
+            _Closing = 1;
+        }
+        _Condition.notify_all();
+        _Thread.join();
+
+        rethrow();
+
+        // index and trailer
+        TrajectoryFile::Trailer trailer;
+        trailer.nChunks     = _Offsets.size();
+        trailer.nFrames     = _nWritten;
+        trailer.IndexOffset = _Offset;
+        std::memcpy( trailer.Magic, TrajectoryFile::indexMagic(), 8 );
+
+        for( size_t i=0; i<_Offsets.size(); i++) {
+
+            writeBytes( &_Offsets[i], 8 );
+            writeBytes( &_FirstFrames[i], 8 );
+        }
+        writeBytes( &trailer, sizeof(trailer) );
+        _File.close();
+
+        if( !_File ) ATOMISM_THROW( "error while writing the trajectory file" );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::rethrow() {
+
+        std::lock_guard<std::mutex> lock(_Mutex);
+        if( _Error ) std::rethrow_exception(_Error);
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::writerLoop() {
+
+        Chunk chunk;
+
+        while( 1 ) {
+
+            { std::unique_lock<std::mutex> lock(_Mutex);
+
+                _Condition.wait( lock, [this](){ return !_Queue.empty() || _Closing; } );
+                if( _Queue.empty() ) return;
+
+                chunk.Frames.swap( _Queue.front().Frames );
+                chunk.nFrames = _Queue.front().nFrames;
+                _Queue.pop_front();
+            }
+
+            try { writeChunk(chunk); }
+            catch(...) {
+
+                std::lock_guard<std::mutex> lock(_Mutex);
+                _Error = std::current_exception();
+                _Queue.clear();
+                return;
+            }
+
+            chunk.Frames.clear();
+            std::lock_guard<std::mutex> lock(_Mutex);
+            _Free.push_back( std::vector<double>() );
+            _Free.back().swap( chunk.Frames );
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::writeChunk(Chunk& chunk) {
+
+        TrajectoryFile::ChunkHeader header;
+        header.nFrames     = chunk.nFrames;
+        header.Compression = TrajectoryFile::None;
+        header.StoredBytes = chunk.Frames.size() * sizeof(double);
+
+        const void* data   = chunk.Frames.data();
+
+#ifdef ATOMISM_USE_ZLIB
+        if( _Compress ) {
+
+            uLongf n = compressBound( header.StoredBytes );
+            _Compressed.resize(n);
+
+            int status = compress2( reinterpret_cast<Bytef*>(_Compressed.data()), &n,
+                                    reinterpret_cast<const Bytef*>(data), header.StoredBytes, Z_BEST_SPEED );
+
+            if( status != Z_OK ) ATOMISM_THROW( "compression of a trajectory chunk failed" );
+
+            // incompressible chunks are stored as is
+            if( n < header.StoredBytes ) {
+
+                header.Compression = TrajectoryFile::Zlib;
+                header.StoredBytes = n;
+                data = _Compressed.data();
+            }
+        }
+#endif
+        _Offsets.push_back( _Offset );
+        _FirstFrames.push_back( _nWritten );
+
+        uint64_t zero = 0;
+        writeBytes( &header, sizeof(header) );
+        writeBytes( data, header.StoredBytes );
+        writeBytes( &zero, TrajectoryFile::padding(header.StoredBytes) );
+
+        if( !_File ) ATOMISM_THROW( "error while writing the trajectory file" );
+        _nWritten += chunk.nFrames;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryWriter::writeBytes(const void* data, uint64_t n) {
+
+        _File.write( reinterpret_cast<const char*>(data), n );
+        _Offset += n;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    TrajectoryReader::TrajectoryReader(const std::string& filename)
+    : _Fd(-1), _Map(0), _Size(0), _nDof(0), _FramesPerChunk(0), _nFrames(0), _Cached(size_t(-1)) {
+
+        ATOMISM_LOG();
+
+        _Fd = ::open( filename.c_str(), O_RDONLY );
+        if( _Fd < 0 ) ATOMISM_THROW( "can not open the trajectory file " + filename );
+
+        struct stat st;
+        if( fstat(_Fd, &st) != 0 ) { ::close(_Fd); ATOMISM_THROW( "can not stat the trajectory file " + filename ); }
+        _Size = st.st_size;
+
+        void* map = _Size ? mmap( 0, _Size, PROT_READ, MAP_PRIVATE, _Fd, 0 ) : MAP_FAILED;
+        if( map == MAP_FAILED ) { ::close(_Fd); ATOMISM_THROW( "can not map the trajectory file " + filename ); }
+        _Map = static_cast<const char*>(map);
+
+        try {
+            uint64_t offset = 0;
+            readHeader(offset);
+            if( !readIndex() ) scanChunks(offset);
+        }
+        catch(...) {
+            munmap( const_cast<char*>(_Map), _Size ); ::close(_Fd);
+            throw;
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    TrajectoryReader::~TrajectoryReader() {
+
+        munmap( const_cast<char*>(_Map), _Size );
+        ::close(_Fd);
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class T>
+    T TrajectoryReader::read(uint64_t& offset) const {
+
+        if( offset + sizeof(T) > _Size ) ATOMISM_THROW( "truncated trajectory file" );
+
+        T value;
+        std::memcpy( &value, _Map + offset, sizeof(T) );
+        offset += sizeof(T);
+        return value;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryReader::readHeader(uint64_t& offset) {
+
+        if( _Size < 16 || std::memcmp( _Map, TrajectoryFile::magic(), 8 ) != 0 )
+            ATOMISM_THROW( "not a trajectory file" );
+
+        offset = 8;
+        _nDof           = read<uint32_t>(offset);
+        _FramesPerChunk = read<uint32_t>(offset);
+
+        for( size_t i=0; i<_nDof; i++) {
+
+            for( int k=0; k<2; k++) {
+
+                uint32_t l = read<uint32_t>(offset);
+                if( offset + l > _Size ) ATOMISM_THROW( "truncated trajectory file" );
+                ( k==0 ? _Names : _Units ).push_back( std::string( _Map + offset, l ) );
+                offset += l;
+            }
+        }
+        offset += TrajectoryFile::padding(offset);
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    bool TrajectoryReader::readIndex() {
+
+        if( _Size < sizeof(TrajectoryFile::Trailer) ) return 0;
+
+        uint64_t offset = _Size - sizeof(TrajectoryFile::Trailer);
+        TrajectoryFile::Trailer trailer = read<TrajectoryFile::Trailer>(offset);
+
+        if( std::memcmp( trailer.Magic, TrajectoryFile::indexMagic(), 8 ) != 0 ) return 0;
+
+        offset = trailer.IndexOffset;
+        for( uint64_t c=0; c<trailer.nChunks; c++) {
+
+            ChunkEntry entry;
+            entry.Offset     = read<uint64_t>(offset);
+            entry.FirstFrame = read<uint64_t>(offset);
+
+            uint64_t chunk   = entry.Offset;
+            entry.Header     = read<TrajectoryFile::ChunkHeader>(chunk);
+            _Chunks.push_back(entry);
+        }
+        _nFrames = trailer.nFrames;
+        return 1;
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void TrajectoryReader::scanChunks(uint64_t offset) {
+
+        // recovery of a file whose writer has not been closed: the complete chunks are kept
+        while( offset + sizeof(TrajectoryFile::ChunkHeader) <= _Size ) {
+
+            ChunkEntry entry;
+            entry.Offset     = offset;
+            entry.FirstFrame = _nFrames;
+            entry.Header     = read<TrajectoryFile::ChunkHeader>(offset);
+
+            const TrajectoryFile::ChunkHeader& h = entry.Header;
+            uint64_t end = offset + h.StoredBytes;
+            uint64_t raw = h.nFrames * TrajectoryFile::frameSize(_nDof) * sizeof(double);
+            
+            bool valid = ( h.nFrames > 0 ) && ( h.nFrames <= _FramesPerChunk ) && ( end <= _Size )
+                      && ( ( h.Compression == TrajectoryFile::None && h.StoredBytes == raw )
+                        || ( h.Compression == TrajectoryFile::Zlib ) );
+            if( !valid ) break;
+
+            _Chunks.push_back(entry);
+            _nFrames += entry.Header.nFrames;
+            offset = end + TrajectoryFile::padding(entry.Header.StoredBytes);
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    const double* TrajectoryReader::frame(size_t i) {
+
+        ATOMISM_EXCEPT_IF( [&](){ return i >= _nFrames; } );
+
+        // last chunk whose first frame is <= i
+        std::vector<ChunkEntry>::const_iterator it =
+        std::upper_bound( _Chunks.begin(), _Chunks.end(), uint64_t(i),
+                         [](uint64_t frame, const ChunkEntry& c){ return frame < c.FirstFrame; } );
+        size_t c = ( it - _Chunks.begin() ) - 1;
+
+        const ChunkEntry& entry = _Chunks[c];
+        const char* data = _Map + entry.Offset + sizeof(TrajectoryFile::ChunkHeader);
+        size_t n = TrajectoryFile::frameSize(_nDof);
+        size_t k = i - entry.FirstFrame;
+
+        if( entry.Header.Compression == TrajectoryFile::None )
+            return reinterpret_cast<const double*>(data) + k*n;
+
+#ifdef ATOMISM_USE_ZLIB
+        if( _Cached != c ) {
+
+            _Buffer.resize( entry.Header.nFrames * n );
+            uLongf size = _Buffer.size() * sizeof(double);
+
+            int status = uncompress( reinterpret_cast<Bytef*>(_Buffer.data()), &size,
+                                     reinterpret_cast<const Bytef*>(data), entry.Header.StoredBytes );
+
+            if( status != Z_OK || size != _Buffer.size() * sizeof(double) )
+                ATOMISM_THROW( "decompression of a trajectory chunk failed" );
+            _Cached = c;
+        }
+        return _Buffer.data() + k*n;
+#else
+        ATOMISM_THROW( "compressed trajectory file: ATOMISM_USE_ZLIB is required" );
+        return 0;
+#endif
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Vector>
+    void TrajectoryReader::readFrame(size_t i, double& t, Vector& q, Vector& qp, double& Ek, double& Ep) {
+
+        const double* f = frame(i);
+
+        q.resize(_nDof); qp.resize(_nDof);
+        t = f[0];
+        for( size_t j=0; j<_nDof; j++) { q[j] = f[1+j]; qp[j] = f[1+_nDof+j]; }
+        Ek = f[1+2*_nDof];
+        Ep = f[2+2*_nDof];
+    }
+}
+#endif // TRAJECTORYFILE_H
@@ -0,0 +1,383 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ATOMISM_CHECKPOINT_H
+#define ATOMISM_CHECKPOINT_H
+
+#include <Exceptions.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <sstream>
+#include <type_traits>
+
+#include <unistd.h>
+
+namespace atomism
+{
+
+    /** \class CheckpointWriter
+     *
+     * \brief Binary checkpoint file, written atomically
+     *
+     * The data are written to 'filename.tmp', which is renamed to 'filename' by commit()
+     * once flushed to the disk: a checkpoint file is always complete, an interruption
+     * during the writing leaves the previous checkpoint untouched. If commit() is not
+     * called, the temporary file is removed. \n
+     * The values are stored as raw bytes (native byte order), so that a restart is bit
+     * identical. The random engines of the standard library are stored through their
+     * textual representation (see writeEngine).
+     */
+    class CheckpointWriter {
+
+    public:
+
+        CheckpointWriter(const std::string& filename);
+
+        ~CheckpointWriter();
+
+        //! write a trivially copyable value
+        template<class T>
+        void write(const T& value);
+
+        //! write the size and the elements of a vector
+        template<class Vector>
+        void writeVector(const Vector& v);
+
+        //! write a rows x cols matrix
+        template<class Matrix>
+        void writeMatrix(const Matrix& m, size_t rows, size_t cols);
+
+        void writeString(const std::string& s);
+
+        //! write the state of a random engine (e.g. std::mt19937_64)
+        template<class Engine>
+        void writeEngine(const Engine& engine);
+
+        //! flush the file and replace the previous checkpoint
+        void commit();
+
+    private:
+
+        CheckpointWriter(const CheckpointWriter&);
+
+        void writeBytes(const void* data, size_t n);
+
+        std::string _Filename;
+        std::string _Temporary;
+        FILE*       _File;
+    };
+
+    /** \class CheckpointReader
+     *
+     * \brief Reads a checkpoint file written by CheckpointWriter
+     *
+     * The values have to be read in the order they have been written; an exception is
+     * thrown if the file is truncated.
+     */
+    class CheckpointReader {
+
+    public:
+
+        CheckpointReader(const std::string& filename);
+
+        ~CheckpointReader();
+
+        template<class T>
+        void read(T& value);
+
+        template<class Vector>
+        void readVector(Vector& v);
+
+        template<class Matrix>
+        void readMatrix(Matrix& m);
+
+        void readString(std::string& s);
+
+        template<class Engine>
+        void readEngine(Engine& engine);
+
+        //! read a string and check that it is equal to 'expected'
+        void expect(const std::string& expected);
+
+    private:
+
+        CheckpointReader(const CheckpointReader&);
+
+        void readBytes(void* data, size_t n);
+
+        FILE* _File;
+    };
+
+    /** \class CheckpointClock
+     *
+     * \brief Wall clock cadence of the checkpoints
+     *
+     * due() returns true once per period of wall clock time (steady clock, not affected
+     * by the changes of the system time). A period <= 0 disables the checkpoints.
+     */
+    class CheckpointClock {
+
+    public:
+
+        CheckpointClock(double period = 0) : _Period(period), _Last(std::chrono::steady_clock::now()) {}
+
+        void setPeriod(double period) { _Period = period; reset(); }
+
+        double getPeriod() const { return _Period; }
+
+        void reset() { _Last = std::chrono::steady_clock::now(); }
+
+        bool due() {
+
+            if( _Period <= 0 ) return 0;
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if( std::chrono::duration<double>( now - _Last ).count() < _Period ) return 0;
+
+            _Last = now;
+            return 1;
+        }
+
+    private:
+
+        double                                 _Period;    //!< [s]
+        std::chrono::steady_clock::time_point  _Last;
+    };
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    CheckpointWriter::CheckpointWriter(const std::string& filename)
+    : _Filename(filename), _Temporary(filename + ".tmp") {
+
+        _File = fopen( _Temporary.c_str(), "wb" );
+        if( !_File ) ATOMISM_THROW( "can not open the checkpoint file " + _Temporary );
+
+        // the destructor is not called if the constructor throws
+        if( fwrite( "ATMCHKP1", 1, 8, _File ) != 8 ) {
+
+            fclose(_File); _File = 0;
+            remove( _Temporary.c_str() );
+            ATOMISM_THROW( "error while writing the checkpoint file " + _Temporary );
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    CheckpointWriter::~CheckpointWriter() {
+
+        if( _File ) { fclose(_File); remove( _Temporary.c_str() ); }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class T>
+    void CheckpointWriter::write(const T& value) {
+
+        static_assert( std::is_trivially_copyable<T>::value, "CheckpointWriter::write: trivially copyable type expected" );
+        writeBytes( &value, sizeof(T) );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Vector>
+    void CheckpointWriter::writeVector(const Vector& v) {
+
+        uint64_t n = v.size();
+        write(n);
+        for( uint64_t i=0; i<n; i++) write( v[i] );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Matrix>
+    void CheckpointWriter::writeMatrix(const Matrix& m, size_t rows, size_t cols) {
+
+        uint64_t r = rows, c = cols;
+        write(r); write(c);
+        for( size_t i=0; i<rows; i++)
+            for( size_t j=0; j<cols; j++) write( m(i,j) );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointWriter::writeString(const std::string& s) {
+
+        uint64_t n = s.size();
+        write(n);
+        writeBytes( s.data(), n );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Engine>
+    void CheckpointWriter::writeEngine(const Engine& engine) {
+
+        std::ostringstream out;
+        out << engine;
+        writeString( out.str() );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointWriter::commit() {
+
+        ATOMISM_LOG();
+
+        bool ok = ( fflush(_File) == 0 ) && ( fsync( fileno(_File) ) == 0 );
+        ok = ( fclose(_File) == 0 ) && ok;
+        _File = 0;
+
+        if( !ok || rename( _Temporary.c_str(), _Filename.c_str() ) != 0 ) {
+
+            remove( _Temporary.c_str() );
+            ATOMISM_THROW( "can not write the checkpoint file " + _Filename );
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointWriter::writeBytes(const void* data, size_t n) {
+
+        if( n && fwrite( data, 1, n, _File ) != n ) ATOMISM_THROW( "error while writing the checkpoint file " + _Temporary );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    CheckpointReader::CheckpointReader(const std::string& filename) {
+
+        _File = fopen( filename.c_str(), "rb" );
+        if( !_File ) ATOMISM_THROW( "can not open the checkpoint file " + filename );
+
+        // the destructor is not called if the constructor throws
+        char magic[8];
+        if( fread( magic, 1, 8, _File ) != 8 || std::string( magic, 8 ) != "ATMCHKP1" ) {
+
+            fclose(_File); _File = 0;
+            ATOMISM_THROW( "not a checkpoint file: " + filename );
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    CheckpointReader::~CheckpointReader() {
+
+        if( _File ) fclose(_File);
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class T>
+    void CheckpointReader::read(T& value) {
+
+        static_assert( std::is_trivially_copyable<T>::value, "CheckpointReader::read: trivially copyable type expected" );
+        readBytes( &value, sizeof(T) );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Vector>
+    void CheckpointReader::readVector(Vector& v) {
+
+        uint64_t n;
+        read(n);
+        v.resize(n);
+        for( uint64_t i=0; i<n; i++) read( v[i] );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Matrix>
+    void CheckpointReader::readMatrix(Matrix& m) {
+
+        uint64_t r, c;
+        read(r); read(c);
+        m.resize(r,c);
+        for( uint64_t i=0; i<r; i++)
+            for( uint64_t j=0; j<c; j++) read( m(i,j) );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointReader::readString(std::string& s) {
+
+        uint64_t n;
+        read(n);
+        s.resize(n);
+        if( n ) readBytes( &s[0], n );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    template<class Engine>
+    void CheckpointReader::readEngine(Engine& engine) {
+
+        std::string state;
+        readString(state);
+        std::istringstream in(state);
+        in >> engine;
+        if( in.fail() ) ATOMISM_THROW( "invalid random engine state in the checkpoint file" );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointReader::expect(const std::string& expected) {
+
+        std::string s;
+        readString(s);
+        if( s != expected ) ATOMISM_THROW( "checkpoint file: '" + expected + "' expected, '" + s + "' found" );
+    }
+
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+
+    inline
+    void CheckpointReader::readBytes(void* data, size_t n) {
+
+        if( n && fread( data, 1, n, _File ) != n ) ATOMISM_THROW( "truncated checkpoint file" );
+    }
+}
+#endif // ATOMISM_CHECKPOINT_H
@@ -367,7 +367,7 @@ namespace atomism
 	
 	if( _FunctionCalls2Tree ) _CurrentElement->addMessage(INFO,out.str());
 	
-	if( INFO>=_MinPriority) (*_OutStream)<<out<<endl;
+	if( INFO>=_MinPriority) (*_OutStream)<<out.str()<<endl;
 	
     }
  
@@ -0,0 +1,262 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ATOMISM_THREADPOOL_H
+#define ATOMISM_THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <deque>
+
+namespace atomism
+{
+    
+    /** \class ThreadPool
+     *
+     * \brief Pool of persistent threads executing independent tasks.
+     *
+     * The calling thread takes part to the work as the worker 0, the pool owns
+     * the workers 1 to noOfWorkers()-1. The tasks of parallelFor are distributed
+     * dynamically (first come, first served), and the worker index given to the
+     * task allows to use per worker buffers without synchronization.
+     * The first exception thrown by a task is rethrown in the calling thread. \n
+     * parallelForStealing is meant for tasks of very uneven durations (e.g. trajectories):
+     * the tasks are first split in contiguous ranges, one per worker; a worker takes its
+     * tasks from the front of its own queue and, once it is empty, steals the tasks
+     * at the back of the queues of the other workers.
+     *
+     * Note that the Logger is not thread safe: it should not be active while tasks
+     * are executed concurrently.
+     */
+    class ThreadPool {
+        
+    public:
+        
+        ThreadPool(size_t nWorkers);
+        
+        ~ThreadPool();
+        
+        //! number of workers, including the calling thread
+        size_t noOfWorkers() const { return _Threads.size()+1; }
+        
+        /** \brief execute func(task,worker) for task in [0,n)
+         *
+         * The call returns when all the tasks are completed.
+         * \param n number of tasks
+         * \param func task, called with the index of the task and of the worker
+         */
+        void parallelFor(size_t n, const std::function<void(size_t,size_t)>& func);
+        
+        /** \brief execute func(task,worker) for task in [0,n), with work stealing
+         *
+         * The call returns when all the tasks are completed.
+         * \param n number of tasks
+         * \param func task, called with the index of the task and of the worker
+         */
+        void parallelForStealing(size_t n, const std::function<void(size_t,size_t)>& func);
+        
+    private:
+        
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+        
+        void workerLoop(size_t worker);
+        void runTasks(size_t worker);
+        void launch(size_t n, const std::function<void(size_t,size_t)>& func, bool stealing);
+        bool popTask(size_t worker, size_t& task);
+        
+        std::vector<std::thread> _Threads;
+        
+        std::mutex               _Mutex;
+        std::condition_variable  _WakeUp;
+        std::condition_variable  _Done;
+        
+        const std::function<void(size_t,size_t)>* _Job;
+        
+        std::atomic<size_t>      _Next;
+        size_t                   _NTasks;
+        size_t                   _Busy;
+        size_t                   _Generation;
+        bool                     _Stop;
+        bool                     _Stealing;
+        std::exception_ptr       _Error;
+        
+        std::vector<std::deque<size_t>> _Queues;      //!< tasks of each worker (work stealing)
+        std::vector<std::mutex>         _QueueMutexes;
+    };
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    ThreadPool::ThreadPool(size_t nWorkers)
+    : _Job(0), _Next(0), _NTasks(0), _Busy(0), _Generation(0), _Stop(false), _Stealing(false),
+      _Queues(nWorkers>0 ? nWorkers : 1), _QueueMutexes(nWorkers>0 ? nWorkers : 1) {
+        
+        for(size_t i=1; i<nWorkers; i++)
+            _Threads.push_back( std::thread( &ThreadPool::workerLoop, this, i ) );
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    ThreadPool::~ThreadPool() {
+        
+        {   std::lock_guard<std::mutex> guard(_Mutex);
+            _Stop = true;
+        }
+        _WakeUp.notify_all();
+        for(auto& thread : _Threads) thread.join();
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void ThreadPool::parallelFor(size_t n, const std::function<void(size_t,size_t)>& func) {
+        
+        launch(n, func, false);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void ThreadPool::parallelForStealing(size_t n, const std::function<void(size_t,size_t)>& func) {
+        
+        size_t nWorkers = noOfWorkers();
+        
+        for(size_t w=0; w<nWorkers; w++) {
+            
+            _Queues[w].clear();
+            for(size_t task = w*n/nWorkers; task < (w+1)*n/nWorkers; task++) _Queues[w].push_back(task);
+        }
+        launch(n, func, true);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void ThreadPool::launch(size_t n, const std::function<void(size_t,size_t)>& func, bool stealing) {
+        
+        std::unique_lock<std::mutex> lock(_Mutex);
+        _Stealing = stealing;
+        _Job    = &func;
+        _NTasks = n;
+        _Next   = 0;
+        _Busy   = _Threads.size();
+        _Error  = std::exception_ptr();
+        _Generation++;
+        lock.unlock();
+        _WakeUp.notify_all();
+        
+        runTasks(0);
+        
+        lock.lock();
+        _Done.wait(lock, [&](){ return _Busy==0; });
+        _Job = 0;
+        
+        if( _Error ) std::rethrow_exception(_Error);
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void ThreadPool::workerLoop(size_t worker) {
+        
+        size_t generation = 0;
+        
+        while(1) {
+            
+            std::unique_lock<std::mutex> lock(_Mutex);
+            _WakeUp.wait(lock, [&](){ return _Stop || (_Generation != generation); });
+            if( _Stop ) return;
+            generation = _Generation;
+            lock.unlock();
+            
+            runTasks(worker);
+            
+            lock.lock();
+            if( --_Busy == 0 ) _Done.notify_all();
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    void ThreadPool::runTasks(size_t worker) {
+        
+        size_t task;
+        while( popTask(worker, task) ) {
+            
+            try{ (*_Job)(task, worker);
+            }
+            catch(...) {
+                
+                std::lock_guard<std::mutex> guard(_Mutex);
+                if( !_Error ) _Error = std::current_exception();
+            }
+        }
+    }
+    
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+    
+    inline
+    bool ThreadPool::popTask(size_t worker, size_t& task) {
+        
+        if( !_Stealing ) return (task = _Next++) < _NTasks;
+        
+        size_t nWorkers = noOfWorkers();
+        
+        {   std::lock_guard<std::mutex> guard(_QueueMutexes[worker]);
+            if( !_Queues[worker].empty() ) {
+                
+                task = _Queues[worker].front();
+                _Queues[worker].pop_front();
+                return true;
+            }
+        }
+        // the tasks are all queued before the launch: once every queue is found empty,
+        // there is nothing left to steal
+        for(size_t k=1; k<nWorkers; k++) {
+            
+            size_t victim = (worker+k) % nWorkers;
+            std::lock_guard<std::mutex> guard(_QueueMutexes[victim]);
+            if( !_Queues[victim].empty() ) {
+                
+                task = _Queues[victim].back();
+                _Queues[victim].pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+#endif // ATOMISM_THREADPOOL_H
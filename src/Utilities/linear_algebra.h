@@ -0,0 +1,303 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ATOMISM_LINEAR_ALGEBRA_H
+#define ATOMISM_LINEAR_ALGEBRA_H
+
+#include <linear_algebra_decl.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef ATOMISM_USE_LAPACK
+extern "C" {
+    void dpotrf_(const char* uplo, const int* n, double* a, const int* lda, int* info);
+}
+#endif
+
+/* The kernels below are called in the inner loops of the integrators: they do not log.
+ * Matrices are accessed through a(i,j), vectors through x[i].
+ */
+
+namespace atomism
+{
+  
+  template <int N, typename Matrix>
+  inline
+  bool choleskyFixed(Matrix& a) {
+    
+      for(int j=0; j<N; j++) {
+	
+	  double d = a(j,j);
+	  for(int p=0; p<j; p++) d -= a(j,p)*a(j,p);
+	  if( d<=0 ) return false;
+	  
+	  d = sqrt(d);
+	  a(j,j) = d;
+	  
+	  for(int i=j+1; i<N; i++) {
+	      
+	      double s = a(i,j);
+	      for(int p=0; p<j; p++) s -= a(i,p)*a(j,p);
+	      a(i,j) = s/d;
+	  }
+      }
+      return true;
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix>
+  inline
+  bool choleskyBlocked(Matrix& a, int n, int block) {
+    
+      for(int k0=0; k0<n; k0+=block) {
+	
+	  int k1 = std::min(k0+block,n);
+	  
+	  // diagonal block, the contributions of the previous panels are already subtracted
+	  for(int j=k0; j<k1; j++) {
+	    
+	      double d = a(j,j);
+	      for(int p=k0; p<j; p++) d -= a(j,p)*a(j,p);
+	      if( d<=0 ) return false;
+	      
+	      d = sqrt(d);
+	      a(j,j) = d;
+	      
+	      for(int i=j+1; i<k1; i++) {
+		
+		  double s = a(i,j);
+		  for(int p=k0; p<j; p++) s -= a(i,p)*a(j,p);
+		  a(i,j) = s/d;
+	      }
+	  }
+	  
+	  // panel below the diagonal block: L21 = A21.L11^-T
+	  for(int j=k0; j<k1; j++) {
+	    
+	      for(int p=k0; p<j; p++)
+		  for(int i=k1; i<n; i++) a(i,j) -= a(i,p)*a(j,p);
+	      
+	      double d = a(j,j);
+	      for(int i=k1; i<n; i++) a(i,j) /= d;
+	  }
+	  
+	  // trailing matrix update: A22 -= L21.L21^T (lower triangle)
+	  for(int j=k1; j<n; j++)
+	      for(int p=k0; p<k1; p++) {
+		
+		  double ljp = a(j,p);
+		  for(int i=j; i<n; i++) a(i,j) -= a(i,p)*ljp;
+	      }
+      }
+      return true;
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix>
+  inline
+  bool cholesky(Matrix& a, int n) {
+    
+      switch(n) {
+	
+	  case 1: return choleskyFixed<1>(a);
+	  case 2: return choleskyFixed<2>(a);
+	  case 3: return choleskyFixed<3>(a);
+	  case 4: return choleskyFixed<4>(a);
+	  case 5: return choleskyFixed<5>(a);
+	  case 6: return choleskyFixed<6>(a);
+	  case 7: return choleskyFixed<7>(a);
+	  case 8: return choleskyFixed<8>(a);
+      }
+#ifdef ATOMISM_USE_LAPACK
+      // needs a contiguous column major storage (e.g. Eigen dynamic matrices),
+      // the factorized block is the leading n x n one
+      int info = 0, lda = a.rows();
+      const char uplo = 'L';
+      dpotrf_(&uplo, &n, a.data(), &lda, &info);
+      return info==0;
+#else
+      return choleskyBlocked(a, n, 32);
+#endif
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <int N, typename Matrix, typename Vector>
+  inline
+  void choleskySolveFixed(const Matrix& l, Vector& x) {
+    
+      for(int i=0; i<N; i++) {
+	
+	  for(int k=0; k<i; k++) x[i] -= l(i,k)*x[k];
+	  x[i] /= l(i,i);
+      }
+      for(int i=N-1; i>=0; i--) {
+	
+	  for(int k=i+1; k<N; k++) x[i] -= l(k,i)*x[k];
+	  x[i] /= l(i,i);
+      }
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix, typename Vector>
+  inline
+  void choleskySolve(const Matrix& l, int n, Vector& x) {
+    
+      switch(n) {
+	
+	  case 1: choleskySolveFixed<1>(l,x); return;
+	  case 2: choleskySolveFixed<2>(l,x); return;
+	  case 3: choleskySolveFixed<3>(l,x); return;
+	  case 4: choleskySolveFixed<4>(l,x); return;
+	  case 5: choleskySolveFixed<5>(l,x); return;
+	  case 6: choleskySolveFixed<6>(l,x); return;
+	  case 7: choleskySolveFixed<7>(l,x); return;
+	  case 8: choleskySolveFixed<8>(l,x); return;
+      }
+      // forward substitution by columns (contiguous access in column major storage)
+      for(int k=0; k<n; k++) {
+	
+	  x[k] /= l(k,k);
+	  for(int i=k+1; i<n; i++) x[i] -= l(i,k)*x[k];
+      }
+      for(int i=n-1; i>=0; i--) {
+	
+	  for(int k=i+1; k<n; k++) x[i] -= l(k,i)*x[k];
+	  x[i] /= l(i,i);
+      }
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix, typename Vector>
+  inline
+  double choleskyCondition(const Matrix& a, const Matrix& l, int n, Vector& x, Vector& z) {
+    
+      double norm = 0;
+      for(int j=0; j<n; j++) {
+	
+	  double s = 0;
+	  for(int i=0; i<n; i++) s += fabs(a(i,j));
+	  norm = std::max(norm,s);
+      }
+      
+      // Hager: maximizes ||a^-1.x||_1 over ||x||_1=1 by moving to the vertex e_j of the
+      // steepest ascent, z = a^-T.sign(a^-1.x) = a^-1.sign(a^-1.x) being the gradient
+      for(int i=0; i<n; i++) x[i] = 1./n;
+      
+      double est = 0;
+      int vertex = -1;
+      for(int it=0; it<5; it++) {
+	
+	  choleskySolve(l,n,x);
+	  
+	  double e = 0;
+	  for(int i=0; i<n; i++) e += fabs(x[i]);
+	  if( vertex>=0 && e<=est ) break;
+	  est = e;
+	  
+	  for(int i=0; i<n; i++) z[i] = x[i]<0 ? -1 : 1;
+	  choleskySolve(l,n,z);
+	  
+	  int j = 0;
+	  double zx = 0;
+	  for(int i=0; i<n; i++) {
+	      
+	      if( fabs(z[i]) > fabs(z[j]) ) j = i;
+	      zx += z[i];
+	  }
+	  // z^T.x of the current vertex (of the uniform vector for the first iteration)
+	  zx = vertex<0 ? zx/n : z[vertex];
+	  if( fabs(z[j]) <= zx || j==vertex ) break;
+	  
+	  for(int i=0; i<n; i++) x[i] = 0;
+	  x[j] = 1;
+	  vertex = j;
+      }
+      
+      // alternating vector of Higham (LAPACK dlacn2), for the matrices where the ascent stalls
+      for(int i=0; i<n; i++) x[i] = ( i%2 ? -1 : 1 ) * ( 1 + ( n>1 ? double(i)/(n-1) : 0 ) );
+      choleskySolve(l,n,x);
+      
+      double e = 0;
+      for(int i=0; i<n; i++) e += fabs(x[i]);
+      est = std::max( est, 2*e/(3*n) );
+      
+      return norm*est;
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix>
+  inline
+  bool luFactor(Matrix& a, int n, std::vector<int>& pivots) {
+    
+      for(int j=0; j<n; j++) {
+	
+	  int p = j;
+	  for(int i=j+1; i<n; i++)
+	      if( fabs(a(i,j)) > fabs(a(p,j)) ) p = i;
+	  
+	  pivots[j] = p;
+	  if( a(p,j)==0 ) return false;
+	  
+	  if( p != j )
+	      for(int k=0; k<n; k++) std::swap( a(j,k), a(p,k) );
+	  
+	  for(int i=j+1; i<n; i++) {
+	    
+	      a(i,j) /= a(j,j);
+	      for(int k=j+1; k<n; k++) a(i,k) -= a(i,j) * a(j,k);
+	  }
+      }
+      return true;
+  }
+  
+    //-----------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------
+	
+  template <typename Matrix, typename Vector>
+  inline
+  void luSolve(const Matrix& a, int n, const std::vector<int>& pivots, Vector& x) {
+    
+      for(int j=0; j<n; j++)
+	  if( pivots[j] != j ) std::swap( x[j], x[pivots[j]] );
+      
+      for(int i=1; i<n; i++)
+	  for(int k=0; k<i; k++) x[i] -= a(i,k) * x[k];
+      
+      for(int i=n-1; i>=0; i--) {
+	
+	  for(int k=i+1; k<n; k++) x[i] -= a(i,k) * x[k];
+	  x[i] /= a(i,i);
+      }
+  }
+  
+} // end namespace Atomism
+
+#endif //ATOMISM_LINEAR_ALGEBRA_H
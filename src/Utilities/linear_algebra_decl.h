@@ -0,0 +1,75 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ATOMISM_LINEAR_ALGEBRA_DECL_H
+#define ATOMISM_LINEAR_ALGEBRA_DECL_H
+
+#include <vector>
+
+namespace atomism
+{
+  
+  // Cholesky factorization A = L.L^T of a symmetric positive definite matrix.
+  // Only the lower triangle of 'a' is read and overwritten by L.
+  // Returns false if 'a' is not positive definite.
+  template <typename Matrix>
+  inline
+  bool cholesky(Matrix& a, int n);
+  
+  // Cholesky factorization, fixed size unrolled kernel
+  template <int N, typename Matrix>
+  inline
+  bool choleskyFixed(Matrix& a);
+  
+  // Cholesky factorization, right looking blocked kernel (panels of 'block' columns)
+  template <typename Matrix>
+  inline
+  bool choleskyBlocked(Matrix& a, int n, int block);
+  
+  // solve L.L^T.x = b in place, 'l' being computed by cholesky
+  template <typename Matrix, typename Vector>
+  inline
+  void choleskySolve(const Matrix& l, int n, Vector& x);
+  
+  // solve L.L^T.x = b in place, fixed size unrolled kernel
+  template <int N, typename Matrix, typename Vector>
+  inline
+  void choleskySolveFixed(const Matrix& l, Vector& x);
+  
+  // 1-norm condition number of the symmetric positive definite 'a', 'l' being its Cholesky
+  // factor: ||a||_1 times the estimate of ||a^-1||_1 by Hager's method (as LAPACK dpocon).
+  // The estimate is a lower bound, exact in most cases; 'x' and 'z' are work vectors of size n.
+  template <typename Matrix, typename Vector>
+  inline
+  double choleskyCondition(const Matrix& a, const Matrix& l, int n, Vector& x, Vector& z);
+  
+  // LU factorization with partial pivoting, P.A = L.U
+  // Returns false if 'a' is singular.
+  template <typename Matrix>
+  inline
+  bool luFactor(Matrix& a, int n, std::vector<int>& pivots);
+  
+  // solve P.A.x = b in place, 'a' and 'pivots' being computed by luFactor
+  template <typename Matrix, typename Vector>
+  inline
+  void luSolve(const Matrix& a, int n, const std::vector<int>& pivots, Vector& x);
+  
+} // end namespace Atomism
+
+#endif //ATOMISM_LINEAR_ALGEBRA_DECL_H
@@ -18,8 +18,8 @@
  */
 
 
-#ifndef ATOMISM_VECTOR_DECL_H
-#define ATOMISM_VECTOR_DECL_H
+#ifndef ATOMISM_VECTOR_H
+#define ATOMISM_VECTOR_H
 
 #include <vector_utils_decl.h>
 
@@ -46,6 +46,47 @@ namespace atomism
   };
   
   
+  //! number of entries of a vector
+  template <typename T>
+  inline
+  size_t n_elements(const std::vector<T>& out){
+    return out.size();
+  };
+  
+  //! number of entries of a dense matrix (rows x columns)
+  template <typename T>
+  inline
+  size_t n_elements(const std::vector<std::vector<T>>& out){
+    size_t n = 0;
+    for( const std::vector<T>& row : out ) n += row.size();
+    return n;
+  };
+  
+  //! number of elements of positions (x,y,z)
+  template <typename T>
+  inline
+  size_t n_elements(const std::tuple<std::vector<T>&,std::vector<T>&,std::vector<T>&>& out){
+    
+    ATOMISM_VALUE_MISMATCH( [&](){return std::get<0>(out).size();} ,
+			    [&](){return std::get<1>(out).size();});
+    ATOMISM_VALUE_MISMATCH( [&](){return std::get<0>(out).size();} ,
+			    [&](){return std::get<2>(out).size();});
+    return std::get<0>(out).size();
+  };
+  
+  //! number of elements of read-only positions (x,y,z)
+  template <typename T>
+  inline
+  size_t n_elements(const std::tuple<const std::vector<T>&,const std::vector<T>&,const std::vector<T>&>& out){
+    
+    ATOMISM_VALUE_MISMATCH( [&](){return std::get<0>(out).size();} ,
+			    [&](){return std::get<1>(out).size();});
+    ATOMISM_VALUE_MISMATCH( [&](){return std::get<0>(out).size();} ,
+			    [&](){return std::get<2>(out).size();});
+    return std::get<0>(out).size();
+  };
+  
+  
   template<typename T1,typename T2>
   std::vector<T1> operator* (const std::vector<T1>& x,const std::vector<T2>& y){
      
@@ -89,6 +130,30 @@ namespace atomism
       out[1] = vector<T>(n);
       out[2] = vector<T>(n);
   }
+  
+  //! dense matrix of n1 rows of n2 columns
+  template <typename T>
+  inline
+  void allocate(std::vector<std::vector<T>>& out,size_t n1,size_t n2) {
+    
+      ATOMISM_LOG();
+      out.assign(n1,std::vector<T>(n2,0));
+  }
+  
+  //! row i of a dense matrix
+  template <typename T>
+  inline
+  std::vector<T>& slice(size_t i,std::vector<std::vector<T>>& matrix) {
+    
+      return matrix[i];
+  }
+  
+  template <typename T>
+  inline
+  const std::vector<T>& slice(size_t i,const std::vector<std::vector<T>>& matrix) {
+    
+      return matrix[i];
+  }
     
   template <typename T>
   inline
@@ -123,7 +188,16 @@ namespace atomism
   init_constant(std::vector<T>& example,const T& v) {
     
       ATOMISM_LOG();
-      for(auto i:example) i=v;      
+      for(auto& i:example) i=v;      
+  }
+  
+  template <typename T>
+  inline
+  void
+  init_clone(std::vector<T>& output,const std::vector<T>& example) {
+    
+      ATOMISM_LOG();
+      output = example;
   }
   
   template <typename T>
@@ -24,6 +24,7 @@
 #include <metaprogramming_decl.h>
 #include <Exceptions.h>
 #include <vector>
+#include <tuple>
 
 
   
@@ -39,6 +40,30 @@ namespace atomism{
   inline
   size_t noOfElements(const std::array<std::vector<T>,3>& out);
   
+  template <typename T>
+  inline
+  size_t n_elements(const std::vector<T>& out);
+  
+  template <typename T>
+  inline
+  size_t n_elements(const std::vector<std::vector<T>>& out);
+  
+  template <typename T>
+  inline
+  size_t n_elements(const std::tuple<std::vector<T>&,std::vector<T>&,std::vector<T>&>& out);
+  
+  template <typename T>
+  inline
+  size_t n_elements(const std::tuple<const std::vector<T>&,const std::vector<T>&,const std::vector<T>&>& out);
+  
+  // read-only view of positions: std::tuple<Vector&,Vector&,Vector&> gives
+  // std::tuple<const Vector&,const Vector&,const Vector&>; other types are kept
+  template <typename Positions>
+  struct const_positions { typedef Positions type; };
+  
+  template <typename... T>
+  struct const_positions<std::tuple<T&...>> { typedef std::tuple<const T&...> type; };
+  
   template <typename T>
   inline
   void allocate(std::vector<T>& out,size_t n);
@@ -47,6 +72,18 @@ namespace atomism{
   inline
   void allocate(std::array<std::vector<T>&,3>& out,size_t n);
   
+  template <typename T>
+  inline
+  void allocate(std::vector<std::vector<T>>& out,size_t n1,size_t n2);
+  
+  template <typename T>
+  inline
+  std::vector<T>& slice(size_t i,std::vector<std::vector<T>>& matrix);
+  
+  template <typename T>
+  inline
+  const std::vector<T>& slice(size_t i,const std::vector<std::vector<T>>& matrix);
+  
   template<typename T1,typename T2>
   std::vector<T1> operator* (const std::vector<T1>& x,const std::vector<T2>& y);
   
@@ -70,6 +107,10 @@ namespace atomism{
   inline
   void init_constant(std::vector<T>& example,const T& v);
   
+  template <typename T>
+  inline
+  void init_clone(std::vector<T>& output,const std::vector<T>& example);
+  
   template <typename T>
   inline
   void init_range(std::vector<T>& example,const T& min,const T& max);
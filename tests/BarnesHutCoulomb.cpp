@@ -0,0 +1,118 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file BarnesHutCoulomb.cpp Barnes-Hut Coulomb energy against the direct summation
+
+#include <BarnesHutCoulomb.h>
+#include <random>
+#include <cstdio>
+
+using namespace atomism;
+
+namespace {
+
+    typedef std::vector<double>                    Vector;
+    typedef std::tuple<Vector&,Vector&,Vector&>    Positions;
+
+    //! elements without degrees of freedom: the positions are given to evaluate
+    struct Cluster {
+
+        size_t N;
+        size_t noOfElements() const { return N; }
+    };
+
+    int failures = 0;
+
+    //! prints the value and the bound (or the reference) it is compared to
+    void check(bool ok, const char* what, double value, double reference) {
+
+        std::printf( "%-48s %.3e (%.3e) %s\n", what, value, reference, ok ? "ok" : "FAILED" );
+        if( !ok ) failures++;
+    }
+
+    //! relative error of the Barnes-Hut energy of a gaussian cluster of n charges
+    struct Errors {
+
+        Vector x, y, z, charges;
+        std::shared_ptr<ResourceManager<>> resource;
+        std::shared_ptr<Cluster>           cluster;
+        double direct;
+
+        Errors(size_t n, bool neutral) : x(n), y(n), z(n), charges(n) {
+
+            std::mt19937 generator(12345);
+            std::normal_distribution<double> gaussian(0, 2e-9);
+
+            for( size_t i=0; i<n; i++) {
+
+                x[i] = gaussian(generator); y[i] = gaussian(generator); z[i] = gaussian(generator);
+                charges[i] = ( neutral && i%2 ? -1 : 1 ) * 1.602e-19 * ( 1 + 0.1*(i%3) );
+            }
+            resource = std::make_shared<ResourceManager<>>();
+            cluster  = std::make_shared<Cluster>(); cluster->N = n;
+
+            Positions coors(x,y,z);
+            direct = BarnesHutCoulomb<Cluster>(cluster, resource, charges).evaluateDirect(coors);
+        }
+
+        double energy(double theta, size_t order, size_t threads = 1) {
+
+            Positions coors(x,y,z);
+            GeneralizedCoordinates<> q(1, 0., -1., 1., 1e-3, 1e-2, resource);
+
+            BarnesHutCoulomb<Cluster> coulomb(cluster, resource, charges, theta, order);
+            coulomb.setNoOfThreads(threads);
+            return coulomb.evaluate(q,coors);
+        }
+
+        double operator()(double theta, size_t order) {
+
+            return std::fabs( energy(theta,order) - direct ) / std::fabs(direct);
+        }
+    };
+}
+
+//! small clusters: the O(N^2) direct sum is the reference
+int main() {
+
+    Errors charged(1000,false);
+
+    // theta = 0 opens all the cells: direct sum up to the rounding
+    for( size_t order=0; order<3; order++)
+        check( charged(0,order) < 1e-12, "theta 0: relative error", charged(0,order), 1e-12 );
+
+    // like charges: each order of the expansions improves the accuracy
+    check( charged(0.5,0) < 5e-2, "like charges, theta 0.5, order 0", charged(0.5,0), 5e-2 );
+    check( charged(0.5,1) < 2e-3, "like charges, theta 0.5, order 1", charged(0.5,1), 2e-3 );
+    check( charged(0.5,2) < 1e-4, "like charges, theta 0.5, order 2", charged(0.5,2), 1e-4 );
+    check( charged(0.3,2) < 1e-5, "like charges, theta 0.3, order 2", charged(0.3,2), 1e-5 );
+
+    // neutral cluster: the energy results from cancellations, the relative error is larger
+    Errors neutral(1000,true);
+
+    check( neutral(0.3,2) < 2e-3, "neutral, theta 0.3, order 2", neutral(0.3,2), 2e-3 );
+    check( neutral(0.5,2) < 2e-2, "neutral, theta 0.5, order 2", neutral(0.5,2), 2e-2 );
+
+    // the threaded evaluation groups the sums by tiles: equal up to the rounding
+    double serial = neutral.energy(0.5,2,1), threaded = neutral.energy(0.5,2,4);
+    double spread = std::fabs( threaded - serial ) / std::fabs(serial);
+    check( spread < 1e-12, "neutral, theta 0.5, 4 threads against serial", spread, 1e-12 );
+
+    return failures ? 1 : 0;
+}
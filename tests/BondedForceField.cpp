@@ -0,0 +1,128 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file BondedForceField.cpp forces of the bonded terms against finite differences of the energy
+
+#include <BondedForceField.h>
+#include <random>
+#include <cstdio>
+
+using namespace atomism;
+
+namespace {
+
+    typedef std::vector<double>                    Vector;
+    typedef std::tuple<Vector&,Vector&,Vector&>    Positions;
+    typedef std::tuple<const Vector&,const Vector&,const Vector&> ConstPositions;
+
+    //! elements without degrees of freedom: the positions are given to evaluate
+    struct Cluster {
+
+        size_t N;
+        size_t noOfElements() const { return N; }
+    };
+
+    int failures = 0;
+
+    //! prints the value and the bound it is compared to
+    void check(bool ok, const char* what, double value, double reference) {
+
+        std::printf( "%-56s %.3e (%.3e) %s\n", what, value, reference, ok ? "ok" : "FAILED" );
+        if( !ok ) failures++;
+    }
+}
+
+//! zig-zag chain with all the kinds of terms, randomly distorted
+int main() {
+
+    const size_t n = 42;
+    const double b = 1.5e-10;
+
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+
+    Vector x(n), y(n), z(n);
+    for( size_t i=0; i<n; i++) {
+
+        x[i] = i*b*0.8 + 0.1*b*uniform(generator);
+        y[i] = ( i%2 ? 0.6*b : 0 ) + 0.1*b*uniform(generator);
+        z[i] = ( i%4 < 2 ? 0.3*b : -0.3*b ) + 0.1*b*uniform(generator);
+    }
+
+    auto resource = std::make_shared<ResourceManager<>>();
+    auto cluster  = std::make_shared<Cluster>(); cluster->N = n;
+    GeneralizedCoordinates<> q(1, 0., -1., 1., 1e-3, 1e-2, resource);
+
+    BondedForceField<Cluster> field(cluster, resource);
+
+    for( size_t i=0; i+1<n; i++) field.addHarmonicBond(i, i+1, 300., 1.5e-10);
+    for( size_t i=0; i+2<n; i+=3) field.addMorseBond(i, i+2, 5e-19, 2e10, 2.5e-10);
+    for( size_t i=0; i+2<n; i++) field.addAngle(i, i+1, i+2, 6e-19, 1.9);
+    for( size_t i=0; i+3<n; i++) field.addTorsion(i, i+1, i+2, i+3, 2e-20, 1 + i%3, 0.3*(i%4));
+
+    Vector fx(n), fy(n), fz(n);
+    Positions forces(fx,fy,fz);
+    double energy = field.computeCartesianForces(ConstPositions(x,y,z), forces);
+
+    // F = -dU/dr by central differences, on each component of each element
+    const double h = 1e-5*b;
+    double largest = 0, error = 0;
+    Vector* r[3] = { &x, &y, &z };
+    Vector* f[3] = { &fx, &fy, &fz };
+
+    for( size_t i=0; i<n; i++)
+        for( int c=0; c<3; c++) {
+
+            double r0 = (*r[c])[i];
+            (*r[c])[i] = r0 + h; double up   = field.evaluate(q, ConstPositions(x,y,z));
+            (*r[c])[i] = r0 - h; double down = field.evaluate(q, ConstPositions(x,y,z));
+            (*r[c])[i] = r0;
+
+            largest = std::max( largest, std::fabs( (*f[c])[i] ) );
+            error   = std::max( error, std::fabs( (*f[c])[i] + ( up - down )/( 2*h ) ) );
+        }
+
+    check( error < 1e-6*largest, "forces against finite differences (relative)", error/largest, 1e-6 );
+
+    double alone = field.evaluate(q, ConstPositions(x,y,z));
+    check( std::fabs( energy - alone ) <= 1e-14*std::fabs(alone), "energy with and without the forces (relative)",
+           std::fabs( energy - alone )/std::fabs(alone), 1e-14 );
+
+    // the vector kernels (if the processor has them) against the plain loops
+    if( PairKernel::getIsa() != PairKernel::Generic ) {
+
+        PairKernel::Isa isa = PairKernel::getIsa();
+        PairKernel::setIsa(PairKernel::Generic);
+
+        Vector gx(n), gy(n), gz(n);
+        Positions generic(gx,gy,gz);
+        double reference = field.computeCartesianForces(ConstPositions(x,y,z), generic);
+        PairKernel::setIsa(isa);
+
+        double spread = 0;
+        for( size_t i=0; i<n; i++)
+            spread = std::max( { spread, std::fabs( gx[i]-fx[i] ), std::fabs( gy[i]-fy[i] ), std::fabs( gz[i]-fz[i] ) } );
+
+        check( std::fabs( energy - reference ) <= 1e-14*std::fabs(reference), "vector kernels: energy against the plain loops",
+               std::fabs( energy - reference )/std::fabs(reference), 1e-14 );
+        check( spread <= 1e-14*largest, "vector kernels: forces against the plain loops", spread/largest, 1e-14 );
+    }
+
+    return failures ? 1 : 0;
+}
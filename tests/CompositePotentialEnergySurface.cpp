@@ -0,0 +1,155 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file CompositePotentialEnergySurface.cpp positions computed by the composite surface, forces against finite differences
+
+#include <CompositePotentialEnergySurface.h>
+#include <BondedForceField.h>
+#include <cstdio>
+
+using namespace atomism;
+
+namespace {
+
+    typedef std::vector<double>                    Vector;
+    typedef std::tuple<Vector&,Vector&,Vector&>    Positions;
+    typedef std::tuple<const Vector&,const Vector&,const Vector&> ConstPositions;
+
+    const double Angstrom = 1e-10;
+
+    //! two atoms in the plane z = 0, q = (x0,y0,x1,y1) in Angstrom; counts the computations of the positions
+    struct Atoms : Entity<Atoms> {
+
+        Atoms(std::shared_ptr<ResourceManager<>> resource) : Entity<Atoms>(resource), Computed(0) {
+            initElements( Vector(2, 2e-26) );
+        }
+
+        size_t noOfElements() const { return 2; }
+        size_t noOfDofs()     const { return 4; }
+
+        void computeRelativePositions(const Vector& q, Positions& positions) const {
+
+            Computed++;
+            for( size_t i=0; i<2; i++) {
+
+                std::get<0>(positions)[i] = q[2*i]   * Angstrom;
+                std::get<1>(positions)[i] = q[2*i+1] * Angstrom;
+                std::get<2>(positions)[i] = 0;
+            }
+        }
+
+        mutable size_t Computed;
+    };
+
+    //! harmonic restraint of one component of one element: no computeCartesianForces
+    struct Wall : PotentialEnergySurface<Atoms,Wall> {
+
+        Wall(std::shared_ptr<const Atoms> atoms, std::shared_ptr<ResourceManager<>> resource,
+             size_t element, size_t component, double center)
+        : PotentialEnergySurface<Atoms,Wall>(atoms,resource), Element(element), Component(component), Center(center) {}
+
+        using PotentialEnergySurface<Atoms,Wall>::evaluate;
+
+        double evaluate(const GeneralizedCoordinates<>&, const ConstPositions& coors) const {
+
+            const Vector& r = Component == 0 ? std::get<0>(coors) : std::get<1>(coors);
+            double d = r[Element]/Angstrom - Center;
+            return 1e-19 * d * d;
+        }
+
+        size_t Element, Component;
+        double Center;
+    };
+
+    typedef CompositePES<Atoms,BondedForceField<Atoms>,Wall,Wall> Composite;
+
+    int failures = 0;
+
+    //! prints the value and the bound (or the reference) it is compared to
+    void check(bool ok, const char* what, double value, double reference) {
+
+        std::printf( "%-56s %.3e (%.3e) %s\n", what, value, reference, ok ? "ok" : "FAILED" );
+        if( !ok ) failures++;
+    }
+}
+
+//! a bond (cartesian forces) and two restraints (finite differences) on 4 active DoFs
+int main() {
+
+    auto resource = std::make_shared<ResourceManager<>>();
+    auto atoms    = std::make_shared<Atoms>(resource);
+
+    auto bonds = std::make_shared<BondedForceField<Atoms>>(atoms, resource);
+    bonds->addHarmonicBond(0, 1, 300., 1.5e-10);
+
+    auto wall = std::make_shared<const Wall>(atoms, resource, 0, 0, 0.1);
+    auto well = std::make_shared<const Wall>(atoms, resource, 1, 1, 0.5);
+
+    Composite composite(atoms, resource, bonds, wall, well);
+
+    GeneralizedCoordinates<> q(4, 0., -10., 10., 1e-5, 1e-2, resource);
+    q.setValues( Vector{ 0.2, -0.1, 1.3, 0.4 } );
+    const size_t nActive = q.noOfActive();
+
+    // the positions: once at q, once per active DoF for the jacobian, twice per active DoF
+    // for the finite differences shared by the two restraints
+    Vector forces(4);
+    composite.setTiming(true);
+    atoms->Computed = 0;
+    double energy = composite.evaluateWithForces(q, forces);
+    size_t shared = atoms->Computed;
+
+    check( shared == 1 + 3*nActive, "positions computed by evaluateWithForces", shared, 1 + 3*nActive );
+
+    // one gradient per restraint would compute them twice per active DoF for each
+    Vector gradient(4);
+    atoms->Computed = 0;
+    wall->computeGradient(q, gradient);
+    size_t single = atoms->Computed;
+    check( single == 2*nActive, "positions computed by the gradient of one restraint", single, 2*nActive );
+
+    size_t separate = 1 + nActive + 2*single;
+    check( shared + single == separate, "positions: shared against one gradient per restraint", shared, separate );
+
+    // the energy counts one call of each term, the finite differences are counted apart
+    for( size_t i=0; i<Composite::noOfTerms(); i++)
+        check( composite.getNoOfCalls(i) == 1, "calls of the term in the energy", composite.getNoOfCalls(i), 1 );
+
+    check( composite.getNoOfFallbackCalls(0) == 0, "finite differences calls of the bond",
+           composite.getNoOfFallbackCalls(0), 0 );
+    for( size_t i=1; i<Composite::noOfTerms(); i++)
+        check( composite.getNoOfFallbackCalls(i) == 2*nActive, "finite differences calls of the restraint",
+               composite.getNoOfFallbackCalls(i), 2*nActive );
+
+    // energy and forces against the evaluation and the central differences of the sum
+    double sum = composite.evaluate(q);
+    check( std::fabs( energy - sum ) <= 1e-14*std::fabs(sum), "energy with and without the forces (relative)",
+           std::fabs( energy - sum )/std::fabs(sum), 1e-14 );
+
+    composite.computeGradient(q, gradient);
+    double largest = 0, error = 0;
+    for( size_t i=0; i<4; i++) {
+
+        largest = std::max( largest, std::fabs( forces[i] ) );
+        error   = std::max( error, std::fabs( forces[i] + gradient[i] ) );
+    }
+    check( error < 1e-4*largest, "forces against finite differences (relative)", error/largest, 1e-4 );
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file PairForceField.cpp incremental energy changes of Monte Carlo moves against full evaluations
+
+#include <PairForceField.h>
+#include <random>
+#include <cstdio>
+
+using namespace atomism;
+
+namespace {
+
+    typedef std::vector<double>                    Vector;
+    typedef std::tuple<Vector&,Vector&,Vector&>    Positions;
+
+    //! elements without degrees of freedom: the positions are given to evaluate
+    struct Cluster {
+
+        size_t N;
+        size_t noOfElements() const { return N; }
+    };
+
+    int failures = 0;
+
+    //! prints the value and the bound it is compared to
+    void check(bool ok, const char* what, double value, double reference) {
+
+        std::printf( "%-56s %.3e (%.3e) %s\n", what, value, reference, ok ? "ok" : "FAILED" );
+        if( !ok ) failures++;
+    }
+}
+
+//! random moves of a few elements of a Lennard-Jones cluster, accepted one time out of two
+int main() {
+
+    const size_t side = 6, n = side*side*side;
+    const double a    = 0.38e-9;
+
+    std::mt19937 generator(2024);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+
+    Vector x(n), y(n), z(n);
+    for( size_t i=0; i<n; i++) {
+
+        x[i] = a * ( i%side             + 0.05*uniform(generator) );
+        y[i] = a * ( (i/side)%side      + 0.05*uniform(generator) );
+        z[i] = a * ( i/(side*side)      + 0.05*uniform(generator) );
+    }
+    auto resource = std::make_shared<ResourceManager<>>();
+    auto cluster  = std::make_shared<Cluster>(); cluster->N = n;
+
+    PairForceField<Cluster> field(cluster, resource, 1e-9, 0.1e-9);
+    GeneralizedCoordinates<> q(1, 0., -1., 1., 1e-3, 1e-2, resource);
+
+    Positions ref(x,y,z);
+    double energy = field.beginMoves(ref);
+    double scale  = std::fabs(energy);
+
+    Vector tx, ty, tz;
+    Positions trial(tx,ty,tz);
+
+    // worst difference between the incremental and the full energy changes
+    auto move = [&](const std::vector<size_t>& moved, double step, bool accept) {
+
+        tx = x; ty = y; tz = z;
+        for( size_t i : moved ) {
+
+            tx[i] += step*uniform(generator); ty[i] += step*uniform(generator); tz[i] += step*uniform(generator);
+        }
+        double delta = field.trialMove(moved,trial);
+        double full  = field.evaluate(q,trial) - field.evaluate(q,ref);
+
+        if( accept ) { field.commitMove(); x = tx; y = ty; z = tz; }
+        else           field.rejectMove();
+
+        return std::fabs( delta - full ) / scale;
+    };
+
+    // small moves: the Verlet list of the reference covers the pairs of the moved elements
+    double worst = 0;
+    std::uniform_int_distribution<size_t> element(0,n-1);
+
+    for( size_t k=0; k<500; k++) {
+
+        std::vector<size_t> moved( 1 + k%3 );
+        for( size_t& i : moved ) i = element(generator);
+
+        worst = std::max( worst, move( moved, 0.02e-9, k%2 == 0 ) );
+    }
+    check( worst < 1e-10, "small moves: incremental against full energy change", worst, 1e-10 );
+
+    // an element drifts past skin/2: the commit rebuilds the Verlet list of the reference
+    size_t builds = field.noOfNeighborBuilds();
+    tx = x; ty = y; tz = z;
+    tx[7] += 0.08e-9;
+
+    std::vector<size_t> drifted(1,7);
+    double before = field.evaluate(q,ref);
+    double delta  = field.trialMove(drifted,trial);
+    field.commitMove(); x = tx;
+
+    check( field.noOfNeighborBuilds() > builds, "drift past skin/2: rebuilds of the Verlet list",
+           field.noOfNeighborBuilds() - builds, 1 );
+
+    double error = std::fabs( delta - ( field.evaluate(q,ref) - before ) ) / scale;
+    check( error < 1e-10, "drift past skin/2: incremental against full change", error, 1e-10 );
+
+    worst = 0;
+    for( size_t k=0; k<200; k++) {
+
+        std::vector<size_t> moved( 1, k%2 ? 7 : element(generator) );
+        worst = std::max( worst, move( moved, 0.02e-9, k%4 == 0 ) );
+    }
+    check( worst < 1e-10, "after the rebuild: incremental against full change", worst, 1e-10 );
+
+    // the accumulated changes give the energy of the final reference
+    double drift = std::fabs( field.getReferenceEnergy() - field.evaluate(q,ref) ) / scale;
+    check( drift < 1e-10, "reference energy against the full evaluation", drift, 1e-10 );
+
+    return failures ? 1 : 0;
+}
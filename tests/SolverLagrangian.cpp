@@ -0,0 +1,337 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file SolverLagrangian.cpp integrators of msSolverLagrangian against analytic oscillators
+
+#include <SolverLagrangian.h>
+#include <SplitPotentialEnergySurface.h>
+#include <functional>
+#include <cstdio>
+
+using namespace atomism;
+
+namespace {
+
+    typedef std::vector<double>                    Vector;
+    typedef std::tuple<Vector&,Vector&,Vector&>    Positions;
+    typedef std::tuple<const Vector&,const Vector&,const Vector&> ConstPositions;
+
+    //! one element on the x axis, its abscissa is the only DoF
+    struct Line : Entity<Line> {
+
+        Line(std::shared_ptr<ResourceManager<>> resource) : Entity<Line>(resource) {}
+
+        size_t noOfElements() const { return 1; }
+        size_t noOfDofs()     const { return 1; }
+
+        void computeRelativePositions(const Vector& q, Positions& coors) const {
+
+            std::get<0>(coors)[0] = q[0]; std::get<1>(coors)[0] = 0; std::get<2>(coors)[0] = 0;
+        }
+    };
+
+    //! harmonic spring tying the element to the origin, U = k.x^2/2
+    struct Spring : PotentialEnergySurface<Line,Spring> {
+
+        Spring(std::shared_ptr<const Line> line, std::shared_ptr<ResourceManager<>> resource, double k)
+        : PotentialEnergySurface<Line,Spring>(line,resource), K(k) {}
+
+        using PotentialEnergySurface<Line,Spring>::evaluate;
+
+        double evaluate(const GeneralizedCoordinates<>& /* q */, const ConstPositions& coors) const {
+
+            double x = std::get<0>(coors)[0];
+            return 0.5 * K * x * x;
+        }
+
+        double K;
+    };
+
+    typedef SplitPotentialEnergySurface<Line,Spring,Spring> Split;
+
+    //! unit mass, L = qp^2/2 - U(q)
+    struct Oscillator : msLagrangian {
+
+        Oscillator(std::function<double(double)> potential) : Potential(potential) {}
+
+        double L(vector_type& q, vector_type& qp, bool /* update */) {
+
+            return 0.5 * qp[0] * qp[0] - Potential(q[0]);
+        }
+
+        std::function<double(double)> Potential;
+    };
+
+    /*! \brief two DoFs coupled through a bend angle beta
+     *
+     * K = R^T.diag(1,sin^2 beta).R, R the rotation of 45 degrees: the kinetic matrix is
+     * singular for a linear bend, its condition number is 1/sin^2 beta, whereas the ratio
+     * of the diagonal of its Cholesky factor only gives (1+sin^2 beta)^2/(4 sin^2 beta).
+     */
+    struct Bend : msLagrangian {
+
+        Bend(double beta) : S( std::sin(beta)*std::sin(beta) ) {}
+
+        double L(vector_type& q, vector_type& qp, bool /* update */) {
+
+            double a = 0.5*(1+S), b = 0.5*(1-S);
+            return 0.5 * ( a*qp[0]*qp[0] + 2*b*qp[0]*qp[1] + a*qp[1]*qp[1] ) - 0.5 * ( q[0]*q[0] + q[1]*q[1] );
+        }
+
+        double S;
+    };
+
+    //! the constructor of the solver is reserved to the tree mapper
+    struct Solver : msSolverLagrangian {
+
+        Solver() : msSolverLagrangian() {}
+    };
+
+    int failures = 0;
+
+    //! prints the value and the bound it is compared to
+    void check(bool ok, const char* what, double value, double reference) {
+
+        std::printf( "%-56s %.3e (%.3e) %s\n", what, value, reference, ok ? "ok" : "FAILED" );
+        if( !ok ) failures++;
+    }
+
+    //! unit mass and frequency, q(0)=1, qp(0)=0: q(t)=cos(t), E=1/2
+    struct Harmonic {
+
+        Oscillator               Lagrangian;
+        boost::shared_ptr<Solver> Integrator;
+
+        Harmonic(msSolverLagrangian::Integrator method)
+        : Lagrangian( [](double x) { return 0.5 * x * x; } ), Integrator(new Solver) {
+
+            Integrator->set_integrator(method);
+            Integrator->set_initialConditions(Vector(1,1.), Vector(1,0.));
+            Integrator->set_ttot(0);
+            Integrator->dynamic(Lagrangian, 0);
+        }
+
+        //! energy relative to the exact one
+        double energyError() const {
+
+            double q = Integrator->getq()[0], qp = Integrator->getqp()[0];
+            return std::fabs( q*q + qp*qp - 1 );
+        }
+
+        //! |q-cos(t)| at the current time
+        double error() const { return std::fabs( Integrator->getq()[0] - std::cos( Integrator->getTime() ) ); }
+
+        /*! \brief n steps dt, one by one
+         *
+         * \return the largest energy error along the steps, negative if a step failed
+         */
+        double steps(double dt, size_t n) {
+
+            double largest = 0;
+            for( size_t k=0; k<n; k++) {
+
+                if( !Integrator->step(dt) ) return -1;
+                largest = std::max( largest, energyError() );
+            }
+            return largest;
+        }
+    };
+
+    //! coordinates of one DoF on [-10,10]
+    std::shared_ptr<GeneralizedCoordinates<>> line(std::shared_ptr<ResourceManager<>> resource) {
+
+        return std::make_shared<GeneralizedCoordinates<>>(1, 1., -10., 10., 1e-4, 1e-2, resource);
+    }
+}
+
+int main() {
+
+    auto resource = std::make_shared<ResourceManager<>>();
+    auto entity   = std::make_shared<const Line>(resource);
+
+    // RESPA: stiff spring integrated on the inner steps, soft one on the outer steps
+    {
+        auto fast  = std::make_shared<const Spring>(entity, resource, 1.);
+        auto slow  = std::make_shared<const Spring>(entity, resource, 0.1);
+        auto split = std::make_shared<const Split>(entity, fast, slow, resource);
+
+        auto values = line(resource);
+        Oscillator lagrangian( [&](double x) {
+            values->setValues(Vector(1,x));
+            return split->evaluateFast(*values);
+        });
+
+        boost::shared_ptr<Solver> solver(new Solver);
+        solver->set_generalizedCoordinates( line(resource) );
+        solver->set_respa(split, 4);
+        solver->set_initialConditions(Vector(1,1.), Vector(1,0.));
+        solver->set_dt(0.05);
+        solver->set_ttot(10);
+        solver->dynamic(lagrangian, 0);
+
+        double error = std::fabs( solver->getq()[0] - std::cos( std::sqrt(1.1) * 10 ) );
+        check( solver->getStatus()==msSolverLagrangian::Completed && error < 1e-4,
+               "RESPA, 4 inner steps: error on q(t)", error, 1e-4 );
+    }
+
+    // long trajectory at 10 times the usual step (h=0.5, period 2.pi): the energy of the
+    // symplectic scheme oscillates with an amplitude of O(h^2) without drift, the one of RK4 decays
+    {
+        Harmonic leapfrog(msSolverLagrangian::GeneralizedLeapfrog), rk4(msSolverLagrangian::RungeKutta4);
+
+        double first = leapfrog.steps(0.5, 100);
+        double bound = std::max( first, leapfrog.steps(0.5, 1800) );
+        double last  = leapfrog.steps(0.5, 100);
+
+        check( first > 0 && std::max( bound, last ) < 0.1, "leapfrog, h=0.5: max energy error", std::max( bound, last ), 0.1 );
+        check( std::fabs( last - first ) < 1e-3, "leapfrog, h=0.5: drift over 1000 time units", std::fabs( last - first ), 1e-3 );
+
+        first = rk4.steps(0.5, 100); rk4.steps(0.5, 1800);
+        last  = rk4.steps(0.5, 100);
+        check( last - first > 0.1, "RK4, h=0.5: drift over 1000 time units", last - first, 0.1 );
+    }
+
+    // second order: the error at t=10 is divided by 4 when the step is halved
+    {
+        double errors[2];
+        for( int k=0; k<2; k++) {
+
+            Harmonic leapfrog(msSolverLagrangian::GeneralizedLeapfrog);
+            leapfrog.steps(0.1/(1<<k), 100<<k);
+            errors[k] = leapfrog.error();
+        }
+        double order = std::log2( errors[0]/errors[1] );
+        check( std::fabs( order - 2 ) < 0.1, "leapfrog: order of convergence", order, 2 );
+    }
+
+    // Dormand-Prince: a first step much too large is rejected and shrunk until the local error
+    // estimate meets the tolerances
+    {
+        Harmonic dopri(msSolverLagrangian::DormandPrince);
+        dopri.Integrator->set_tolerances(1e-8, 1e-8, 1e-12);
+        dopri.steps(2., 1);
+
+        double h = dopri.Integrator->getLastStep();
+        check( h < 0.5, "Dormand-Prince, rtol 1e-8, initial step 2: step taken", h, 0.5 );
+        check( dopri.error() < 1e-8, "Dormand-Prince, rtol 1e-8: local error of the step", dopri.error(), 1e-8 );
+    }
+
+    // the error follows the tolerance, with (1000)^(1/5) times more steps for 1000 times smaller tolerances
+    {
+        double errors[2]; size_t steps[2];
+        for( int k=0; k<2; k++) {
+
+            Harmonic dopri(msSolverLagrangian::DormandPrince);
+            double tol = k==0 ? 1e-5 : 1e-8;
+            dopri.Integrator->set_tolerances(tol, tol, 1e-12);
+
+            steps[k] = 0; errors[k] = 0;
+            while( dopri.Integrator->getTime() < 20 && steps[k] < 100000 ) {
+
+                if( !dopri.Integrator->step(0.1, 20 - dopri.Integrator->getTime()) ) break;
+                errors[k] = std::max( errors[k], dopri.error() );
+                steps[k]++;
+            }
+            check( errors[k] < 20*tol, k==0 ? "Dormand-Prince, tol 1e-5: global error up to t=20"
+                                            : "Dormand-Prince, tol 1e-8: global error up to t=20", errors[k], 20*tol );
+        }
+        double ratio = double(steps[1]) / steps[0];
+        check( ratio > 3 && ratio < 5, "Dormand-Prince: ratio of the numbers of steps", ratio, std::pow(1000., 0.2) );
+    }
+
+    // events: q crosses 0 at t=pi/2, located on the dense output of the step, whose error is
+    // O(h^4) for RK4 (cubic Hermite interpolant of q)
+    {
+        double errors[2];
+        for( int k=0; k<2; k++) {
+
+            Harmonic rk4(msSolverLagrangian::RungeKutta4);
+            rk4.Integrator->addEvent( [](double, const vector_type& q, const vector_type&) { return q[0]; }, 0, -1 );
+            rk4.Integrator->set_dt(0.2/(1<<k));
+            rk4.Integrator->set_ttot(3);
+            rk4.Integrator->dynamic(rk4.Lagrangian, 0);
+
+            const std::vector<msSolverLagrangian::EventRecord>& events = rk4.Integrator->getEvents();
+            errors[k] = events.size()==1 ? std::fabs( events[0].t - M_PI/2 ) : 1;
+        }
+        check( errors[1] < 1e-5, "RK4, h=0.1: crossing time", errors[1], 1e-5 );
+
+        double order = std::log2( errors[0]/errors[1] );
+        check( order > 3.5, "RK4: order of the crossing time", order, 4 );
+    }
+
+    // terminal event on the 4th order continuous extension of Dormand-Prince
+    {
+        Harmonic dopri(msSolverLagrangian::DormandPrince);
+        dopri.Integrator->set_tolerances(1e-9, 1e-9, 1e-12);
+        dopri.Integrator->addEvent( [](double, const vector_type& q, const vector_type&) { return q[0]; }, 1, -1 );
+        dopri.Integrator->set_dt(0.1);
+        dopri.Integrator->set_ttot(3);
+        dopri.Integrator->dynamic(dopri.Lagrangian, 0);
+
+        double error = std::fabs( dopri.Integrator->getTime() - M_PI/2 );
+        check( dopri.Integrator->getStatus()==msSolverLagrangian::Stopped && error < 5e-8,
+               "Dormand-Prince, tol 1e-9: terminal crossing time", error, 5e-8 );
+        check( std::fabs( dopri.Integrator->getqp()[0] + 1 ) < 1e-8,
+               "Dormand-Prince: velocity at the crossing", std::fabs( dopri.Integrator->getqp()[0] + 1 ), 1e-8 );
+    }
+
+    // condition number of the Hilbert matrix of order 6, 2.9e7, against the exact one
+    {
+        const int n = 6;
+        matrix_type a, l;
+        a.resize(n,n);
+        for( int i=0; i<n; i++)
+            for( int j=0; j<n; j++) a(i,j) = 1./(i+j+1);
+        l = a;
+        cholesky(l, n);
+
+        double norm = 0, inverse = 0;
+        Vector x(n), z(n);
+        for( int j=0; j<n; j++) {
+
+            double column = 0, row = 0;
+            for( int i=0; i<n; i++) { x[i] = i==j; row += std::fabs(a(i,j)); }
+            choleskySolve(l, n, x);
+            for( int i=0; i<n; i++) column += std::fabs(x[i]);
+            norm = std::max( norm, row ); inverse = std::max( inverse, column );
+        }
+        double ratio = choleskyCondition(a, l, n, x, z) / ( norm*inverse );
+        check( ratio > 0.9 && ratio < 1 + 1e-6, "Hilbert 6x6: estimated / exact 1-norm condition", ratio, 1 );
+    }
+
+    // near-linear bend (1 degree from 180, condition number 3.3e3): regularized beyond 2e3,
+    // which the ratio of the diagonal of the factor (8.2e2) missed
+    for( int k=0; k<2; k++) {
+
+        Bend bend( k==0 ? M_PI - M_PI/180 : M_PI/2 );
+        boost::shared_ptr<Solver> solver(new Solver);
+        solver->set_singularity(2e3, 1e-8, 1);
+        solver->set_initialConditions(Vector(2,0.5), Vector(2,0.));
+        solver->set_dt(0.01);
+        solver->set_ttot(0.1);
+        solver->dynamic(bend, 0);
+
+        double regularized = solver->getNoOfRegularizations();
+        if( k==0 ) check( regularized > 0, "near-linear bend: regularized factorizations", regularized, 1 );
+        else       check( regularized == 0, "bend of 90 degrees: regularized factorizations", regularized, 0 );
+    }
+
+    return failures ? 1 : 0;
+}
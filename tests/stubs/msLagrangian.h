@@ -0,0 +1,115 @@
+/*
+ <one line to give the library's name and an idea of what it does.>
+ Copyright (C) 2013  Guillaume <email>
+ 
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+ 
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+//! \file msLagrangian.h minimal msTreeMapper / msLagrangian interface for the solver tests
+//!
+//! The solver derives from the tree mapper of the framework, which is not part of the
+//! library: only the members used by msSolverLagrangian are given here.
+
+#ifndef ATOMISM_TESTS_MSLAGRANGIAN_H
+#define ATOMISM_TESTS_MSLAGRANGIAN_H
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <vector>
+#include <string>
+
+namespace atomism {
+
+    typedef std::vector<double> vector_type;
+
+    //! dense row major matrix
+    class matrix_type {
+
+    public:
+
+        void resize(size_t n, size_t m) { _N = n; _M = m; _Data.assign(n*m, 0.); }
+
+        double&       operator()(size_t i, size_t j)       { return _Data[i*_M+j]; }
+        const double& operator()(size_t i, size_t j) const { return _Data[i*_M+j]; }
+
+        size_t size1() const { return _N; }
+        size_t size2() const { return _M; }
+
+    private:
+
+        size_t _N = 0, _M = 0;
+        std::vector<double> _Data;
+    };
+
+    //! the tests work in SI units
+    struct msUnitsManager { void setSI() {} };
+
+    struct msParamsManager {};
+
+    //! errors reported by the solver
+    enum msError { AijError };
+    inline void printError(msError) {}
+
+    //! parameters of a tree mapper
+    struct msParamsHolder {
+
+        boost::shared_ptr<msParamsManager> getSharedPtr() const { return boost::shared_ptr<msParamsManager>(); }
+    };
+
+    class msTreeMapper : public boost::enable_shared_from_this<msTreeMapper> {
+
+    public:
+
+        virtual ~msTreeMapper() {}
+
+    protected:
+
+        void constructVar(const std::string&, const std::string&, const std::string&) {}
+
+        boost::shared_ptr<msTreeMapper> mySharedPtr() { return shared_from_this(); }
+
+        msUnitsManager SiUnits;
+        msParamsHolder Parameters;
+    };
+
+    //! the kinetic matrix is computed by the Lagrangian of the tests
+    struct msKineticOperator  { void computeKMat(const msUnitsManager&) {} };
+    struct msGeneralizedCoordinates { void setUnfreezedValues(const msUnitsManager&, const vector_type&) {} };
+
+    //! L(q,qp) of the system: the tests override L
+    class msLagrangian {
+
+    public:
+
+        msLagrangian() : GeneralizedCoordinates(&_Coordinates), KineticOperator(&_Kinetic) {}
+        virtual ~msLagrangian() {}
+
+        //! Lagrangian [J]; 'update' is false if the kinetic matrix is already computed at q
+        virtual double L(vector_type& q, vector_type& qp, bool update = 1) = 0;
+
+        msGeneralizedCoordinates* GeneralizedCoordinates;
+        msKineticOperator*        KineticOperator;
+
+    private:
+
+        msGeneralizedCoordinates _Coordinates;
+        msKineticOperator        _Kinetic;
+    };
+}
+
+// the members of msSolverLagrangian are defined at global scope
+using namespace atomism;
+
+#endif // ATOMISM_TESTS_MSLAGRANGIAN_H